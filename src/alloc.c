@@ -1,18 +1,93 @@
+#include <string.h>
+#include <pthread.h>
+
 #include "slabInt.h"
 #include "cont.h"
 #include "stats.h"
+#include "page_alloc.h"
+#include "wtracker.h"
+
+/*
+ * The bitmaps are scanned a 64-bit word at a time. The bits of a bitstr_t are
+ * numbered from the least significant bit of its first byte, which matches
+ * the bit order of a little-endian word.
+ */
+static inline uint64_t bitmap_word(bitstr_t *bm, int w, int nbits)
+{
+    uint64_t word = 0;
+    int nbytes = bitstr_size(nbits) - w * sizeof(word);
+
+    memcpy(&word, bm + w * sizeof(word), MIN(nbytes, (int) sizeof(word)));
+    if (nbits - w * 64 < 64)
+        word &= (1ULL << (nbits - w * 64)) - 1;
+
+    return word;
+}
+
+/*
+ * Objects of a slab_entry cached by a thread may be freed by other threads,
+ * so bits are set and cleared atomically
+ */
+static inline void bitmap_atomic_set(bitstr_t *bm, int bit)
+{
+    __sync_fetch_and_or(&bm[_bit_byte(bit)], _bit_mask(bit));
+}
+
+static inline void bitmap_atomic_clear(bitstr_t *bm, int bit)
+{
+    __sync_fetch_and_and(&bm[_bit_byte(bit)], ~_bit_mask(bit));
+}
+
+/*
+ * Return the index of the first clear bit in bm, or -1 if all nbits are set
+ */
+int slab_bitmap_ffc(bitstr_t *bm, int nbits)
+{
+    int nwords = (nbits + 63) / 64;
+
+    for (int w = 0; w < nwords; w++) {
+        uint64_t word = ~bitmap_word(bm, w, nbits);
+        if (nbits - w * 64 < 64)
+            word &= (1ULL << (nbits - w * 64)) - 1;
+        if (word)
+            return w * 64 + __builtin_ctzll(word);
+    }
+
+    return -1;
+}
+
+/*
+ * Return the number of bits set in bm
+ */
+int slab_bitmap_count(bitstr_t *bm, int nbits)
+{
+    int nwords = (nbits + 63) / 64;
+    int count = 0;
+
+    for (int w = 0; w < nwords; w++)
+        count += __builtin_popcountll(bitmap_word(bm, w, nbits));
+
+    return count;
+}
 
 int slab_entry_full(struct slab_entry *se)
+{
+    return SLAB_ENTRY_FULL(se);
+}
+
+/*
+ * Return 1 if maddr falls within an allocated object of se, 0 otherwise
+ */
+int slab_entry_is_allocated(struct slab_entry *se, void *maddr)
 {
     bitstr_t *bitmap = SLAB_ENTRY_CBITMAP(se);
-    int capacity = SLAB_ENTRY_CAPACITY(se);
-    int count = 0;
+    long offset = ptoi(maddr) - ptoi(se->se_data.current.maddr) - SLAB_ENTRY_DATAOFFSET(se);
+    long idx = offset / se->se_size;
 
-    for (int i = 0; i < capacity; i++) {
-        count += bit_test(bitmap, i) ? 1 : 0;
-    }
+    if (offset < 0 || idx >= SLAB_ENTRY_CAPACITY(se))
+        return 0;
 
-    return (count == capacity);
+    return bit_test(bitmap, idx) ? 1 : 0;
 }
 
 static void *slab_entry_alloc_mem(unsigned int cid, struct slab_entry *se)
@@ -25,15 +100,54 @@ static void *slab_entry_alloc_mem(unsigned int cid, struct slab_entry *se)
 
     assert(se->se_data.current.maddr != NULL && "Invalid pointer to data (NULL)");
 
-    bit_ffc(bitmap, bm_capacity, &idx);
-    if (idx != -1) {
-        maddr = se->se_data.current.maddr + data_offset + (idx * se->se_size);
-        bit_set(bitmap, idx);
-    }
+    if (SLAB_ENTRY_FULL(se))
+        return NULL;
+
+    idx = slab_bitmap_ffc(bitmap, bm_capacity);
+    assert(idx != -1 && "Free count does not match the in-use bitmap");
+
+    maddr = se->se_data.current.maddr + data_offset + (idx * se->se_size);
+    bitmap_atomic_set(bitmap, idx);
+    __sync_fetch_and_sub(&se->se_data.current.nfree, 1);
 
     return maddr;
 }
 
+/*
+ * Allocate up to n objects from se, taking its free slots in order of
+ * address. Return the number of objects allocated.
+ */
+static int slab_entry_alloc_run(unsigned int cid, struct slab_entry *se, int n, void **maddrs)
+{
+    bitstr_t *bitmap = SLAB_ENTRY_CBITMAP(se);
+    int bm_capacity = SLAB_ENTRY_CAPACITY(se);
+    void *data = se->se_data.current.maddr + SLAB_ENTRY_DATAOFFSET(se);
+    uint64_t word, taken;
+    int count = 0, idx;
+
+    n = MIN(n, (int) se->se_data.current.nfree);
+
+    for (int w = 0; count < n && w * 64 < bm_capacity; w++) {
+        word = ~bitmap_word(bitmap, w, bm_capacity);
+        if (bm_capacity - w * 64 < 64)
+            word &= (1ULL << (bm_capacity - w * 64)) - 1;
+
+        for (taken = 0; word && count < n; word &= word - 1) {
+            idx = __builtin_ctzll(word);
+            taken |= 1ULL << idx;
+            maddrs[count++] = data + (w * 64 + idx) * se->se_size;
+            STATS_INC_PALLOCATIONS();
+        }
+
+        for (int b = 0; taken; b++, taken >>= 8) {
+            if (taken & 0xff)
+                __sync_fetch_and_or(&bitmap[w * sizeof(word) + b], taken & 0xff);
+        }
+    }
+    __sync_fetch_and_sub(&se->se_data.current.nfree, count);
+
+    return count;
+}
 
 static struct slab_entry *get_free_slab_entry(unsigned int cid)
 {
@@ -74,9 +188,11 @@ static struct slab_entry *get_free_slab_entry(unsigned int cid)
             sd->sd_index++;
         } else {
 
-            if (sd->sd_current[so->so_index - 1].maddr == sd->sd_snapshot[sd->sd_index - 1].maddr)
+            if (sd->sd_current[sd->sd_index - 1].maddr == sd->sd_snapshot[sd->sd_index - 1].maddr) {
                 sd->sd_snapshot[sd->sd_index - 1].maddr =
                     slab_outer_snapshot(cid, so, &sd->sd_snapshot[sd->sd_index - 1].laddr);
+                slab_dirty_add_outer(sd->sd_index - 1);
+            }
         }
 
         size_t si_laddr;
@@ -87,9 +203,11 @@ static struct slab_entry *get_free_slab_entry(unsigned int cid)
         so->so_snapshot[so->so_index].laddr = si_laddr;
         so->so_index++;
     } else {
-        if (so->so_current[so->so_index - 1].maddr == so->so_snapshot[so->so_index - 1].maddr)
+        if (so->so_current[so->so_index - 1].maddr == so->so_snapshot[so->so_index - 1].maddr) {
             so->so_snapshot[so->so_index - 1].maddr =
                 slab_inner_snapshot(cid, si, &so->so_snapshot[so->so_index - 1].laddr);
+            slab_dirty_add_inner(sd->sd_index - 1, so->so_index - 1);
+        }
     }
 
     sb = slab_bucket_init(cid, &sb_laddr);
@@ -111,55 +229,316 @@ use_free_entry:
 }
 
 extern int (*Func_slab_bucket_snapshot)(unsigned int cid, struct slab_bucket *sb);
+extern void (*Func_slab_entry_snapshot)(unsigned int cid, struct slab_entry *se);
+
+/*
+ * Make sure the bucket of a slab_entry has a snapshot before the slab_entry
+ * is modified. sb_has_snapshot is only set once the snapshot is complete, so
+ * it can be checked without holding the slab lock.
+ */
+static void slab_bucket_prepare_update(unsigned int cid, struct slab_bucket *sb)
+{
+    if (sb->sb_has_snapshot)
+        return;
 
-void *slab_palloc(unsigned int cid, unsigned int size)
+    slab_lock(cid);
+    slab_bucket_make_dirty(cid, sb);
+    slab_unlock(cid);
+}
+
+/*
+ * Per-thread caches of slab_entry(s)
+ *
+ * Each thread owns at most one slab_entry per size class and allocates from
+ * it without taking the slab lock. A slab_entry owned by a thread is not in
+ * the list of its slab_entry_size, so no other thread allocates from it.
+ * The slab lock is only taken to refill the cache, which happens once every
+ * SLAB_ENTRY_CAPACITY allocations of the same size. Each registered type is
+ * a size class of its own.
+ *
+ * Caches are drained at checkpoint time and when a thread exits, which gives
+ * the slab_entry(s) back to their lists.
+ */
+#define SLAB_CACHE_SIZES        (PAGE_SIZE / 8 + SLAB_MAX_ALLOC / PAGE_SIZE + 1)
+#define SLAB_CACHE_CLASSES      (SLAB_CACHE_SIZES + SLAB_TYPE_MAX)
+#define SLAB_CACHE_CLASS(size8, type) \
+        ((type) ? SLAB_CACHE_SIZES + (type) - 1 : \
+         ((size8) <= PAGE_SIZE) ? (size8) / 8 : PAGE_SIZE / 8 + (size8) / PAGE_SIZE)
+
+struct slab_cache {
+    unsigned int sc_cid;
+    int sc_count;   ///< number of cached slab_entry(s)
+    struct slab_entry *sc_entries[SLAB_CACHE_CLASSES];
+    LIST_ENTRY(slab_cache) sc_list;
+};
+
+static LIST_HEAD(slab_cache_list, slab_cache) SLAB_CACHES = LIST_HEAD_INITIALIZER(SLAB_CACHES);
+static __thread struct slab_cache *THREAD_SLAB_CACHE = NULL;
+static pthread_key_t slab_cache_key;
+static pthread_once_t slab_cache_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Give a cached slab_entry back to the list of its size. The slab lock must
+ * be held.
+ */
+static void slab_cache_putback(unsigned int cid, struct slab_entry *se)
 {
-    void *maddr = NULL;
-    struct slab_dir *sd;
-    struct container *cont;
-    struct slab_entry *se;
+    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
+    struct slab_entry_size key = SLAB_ENTRY_SIZE_KEY(se);
     struct slab_entry_size *es;
-    struct slab_bucket *sb;
-    int size8 = ROUND8(size);
 
-    STATS_INC_PALLOCATIONS();
+    es = RB_FIND(sizes_slab_entry_tree, &sd->sd_size_root, &key);
+    assert(es && "slab_entry without a size list");
 
-    if (size > PAGE_SIZE)
-        handle_error("allocations bigger than 4KB are not implemented yet.\n");
+    /* full entries are kept at the end of the list */
+    if (SLAB_ENTRY_FULL(se))
+        STAILQ_INSERT_TAIL(&es->es_list, se, se_list);
+    else
+        STAILQ_INSERT_HEAD(&es->es_list, se, se_list);
+}
 
-    cont = get_container(cid);
-    sd = cont->current_slab.maddr;
+static void slab_cache_flush(struct slab_cache *sc)
+{
+    for (int i = 0; sc->sc_count && i < SLAB_CACHE_CLASSES; i++) {
+        if (sc->sc_entries[i]) {
+            slab_cache_putback(sc->sc_cid, sc->sc_entries[i]);
+            sc->sc_entries[i] = NULL;
+            sc->sc_count--;
+        }
+    }
+}
+
+static void slab_cache_destroy(void *arg)
+{
+    struct slab_cache *sc = arg;
+
+    slab_lock(sc->sc_cid);
+    slab_cache_flush(sc);
+    LIST_REMOVE(sc, sc_list);
+    slab_unlock(sc->sc_cid);
+
+    free(sc);
+}
+
+static void slab_cache_key_init()
+{
+    if (pthread_key_create(&slab_cache_key, slab_cache_destroy))
+        handle_error("failed to create the key for the thread slab caches\n");
+}
+
+static struct slab_cache *slab_cache_get(unsigned int cid)
+{
+    struct slab_cache *sc = THREAD_SLAB_CACHE;
+
+    if (sc)
+        return sc;
 
-    struct slab_entry_size key = { .es_size = size8 };
+    pthread_once(&slab_cache_key_once, slab_cache_key_init);
+
+    sc = calloc(1, sizeof(*sc));
+    if (!sc)
+        handle_error("failed to allocate the slab cache of the thread\n");
+    sc->sc_cid = cid;
+
+    slab_lock(cid);
+    LIST_INSERT_HEAD(&SLAB_CACHES, sc, sc_list);
+    slab_unlock(cid);
+
+    pthread_setspecific(slab_cache_key, sc);
+    THREAD_SLAB_CACHE = sc;
+
+    return sc;
+}
+
+/*
+ * Return 1 if se is cached by a thread. The slab lock must be held.
+ */
+static int slab_cache_owns(struct slab_entry *se)
+{
+    struct slab_cache *sc;
+    int class = SLAB_CACHE_CLASS(se->se_size, se->se_data.current.type);
+
+    LIST_FOREACH(sc, &SLAB_CACHES, sc_list) {
+        if (sc->sc_entries[class] == se)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Give every cached slab_entry back to its list. Called at checkpoint time,
+ * when no other thread is allocating memory.
+ */
+void slab_cache_drain(unsigned int cid)
+{
+    struct slab_cache *sc;
+
+    slab_lock(cid);
+    LIST_FOREACH(sc, &SLAB_CACHES, sc_list) {
+        if (sc->sc_cid == cid)
+            slab_cache_flush(sc);
+    }
+    slab_unlock(cid);
+}
+
+/*
+ * Take a non-full slab_entry of size size8 and the given type out of the
+ * shared structures of the slab. The slab lock must be held.
+ */
+static struct slab_entry *slab_cache_refill(unsigned int cid, int size8, int type)
+{
+    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
+    struct slab_entry_size *es;
+    struct slab_entry *se;
+
+    struct slab_entry_size key = { .es_size = size8, .es_type = type };
     es = RB_FIND(sizes_slab_entry_tree, &sd->sd_size_root, &key);
-    if (es) {
-        se = STAILQ_FIRST(&es->es_list);
-        //TODO: consider caching the size to avoid calling slab_entry_full again. It's slow!
-        if (slab_entry_full(se)) {
-            se = get_free_slab_entry(cid);
-            STAILQ_INSERT_HEAD(&es->es_list, se, se_list);
-        }
-    } else {
-        es = slab_entry_size_init(size8);
+    if (!es) {
+        es = slab_entry_size_init(size8, type);
         RB_INSERT(sizes_slab_entry_tree, &sd->sd_size_root, es);
+    }
 
-        se = get_free_slab_entry(cid);
-        STAILQ_INSERT_HEAD(&es->es_list, se, se_list);
+    se = STAILQ_FIRST(&es->es_list);
+    if (se && !SLAB_ENTRY_FULL(se)) {
+        STAILQ_REMOVE_HEAD(&es->es_list, se_list);
+        return se;
     }
 
-    sb = (struct slab_bucket*) ROUND_DWNPG(ptoi(se));
-    sb->sb_has_snapshot = Func_slab_bucket_snapshot(cid, sb);
+    se = get_free_slab_entry(cid);
+    slab_bucket_prepare_update(cid, SLAB_ENTRY_BUCKET(se));
+    slab_entry_init(cid, se, size8, type);
+    RB_INSERT(used_slab_entry_tree, &sd->sd_maddr_root, se);
+
+    return se;
+}
+
+/*
+ * Return the slab_entry the thread allocates objects of size and type from,
+ * which is not full
+ */
+static struct slab_entry *slab_cache_entry(unsigned int cid, unsigned int size, int type)
+{
+    struct slab_cache *sc;
+    struct slab_entry *se;
+    int size8 = ROUND8(size);
+    int class;
+
+    if (size > SLAB_MAX_ALLOC)
+        handle_error("allocations bigger than %d bytes are not supported.\n", SLAB_MAX_ALLOC);
 
-    if (!SLAB_ENTRY_IS_INIT(se)) {
-        slab_entry_init(cid, se, size8);
-        RB_INSERT(used_slab_entry_tree, &sd->sd_maddr_root, se);
+    /* multi-page allocations are grouped by the number of pages they need */
+    if (size > PAGE_SIZE)
+        size8 = ROUNDPG(size);
+
+    sc = slab_cache_get(cid);
+    class = SLAB_CACHE_CLASS(size8, type);
+
+    se = sc->sc_entries[class];
+    if (se == NULL || SLAB_ENTRY_FULL(se)) {
+        slab_lock(cid);
+        if (se)
+            slab_cache_putback(cid, se);
+        else
+            sc->sc_count++;
+        se = sc->sc_entries[class] = slab_cache_refill(cid, size8, type);
+        slab_unlock(cid);
     }
 
-    maddr = slab_entry_alloc_mem(cid, se);
-    if (slab_entry_full(se)) {
-        STAILQ_INSERT_TAIL(&es->es_list, se, se_list);
+    slab_bucket_prepare_update(cid, SLAB_ENTRY_BUCKET(se));
+
+    return se;
+}
+
+static void *do_palloc(unsigned int cid, unsigned int size, int type)
+{
+    STATS_INC_PALLOCATIONS();
+
+    return slab_entry_alloc_mem(cid, slab_cache_entry(cid, size, type));
+}
+
+void *slab_palloc(unsigned int cid, unsigned int size)
+{
+    return do_palloc(cid, size, 0);
+}
+
+/*
+ * Allocate n objects of the same size. The objects fill the free slots of
+ * each slab_entry in order, so consecutive objects are next to each other
+ * whenever possible.
+ */
+void slab_palloc_bulk(unsigned int cid, unsigned int size, int n, void **maddrs)
+{
+    for (int count = 0; count < n; ) {
+        count += slab_entry_alloc_run(cid, slab_cache_entry(cid, size, 0), n - count, maddrs + count);
     }
+}
 
-    return maddr;
+/*
+ * Objects of a registered type get slab_entry(s) of their own, whose type
+ * locates the pointers of every object (see slab_type_foreach_ptr)
+ */
+void *slab_palloc_typed(unsigned int cid, unsigned int type)
+{
+    if (type == 0 || type > get_container(cid)->ntypes)
+        handle_error("trying to allocate an object of unknown type %u\n", type);
+
+    return do_palloc(cid, slab_type_get(cid, type)->st_size, type);
 }
 
+/*
+ * Free the object at maddr. The bitmap of the slab_entry is updated under the
+ * same copy-on-write rules as any other change to the slab_entry, so the free
+ * becomes durable with the next checkpoint. Empty slab_entry(s) are released
+ * at the checkpoint (see slab_bucket_cpoint).
+ */
+void slab_pfree(unsigned int cid, void *maddr)
+{
+    struct slab_dir *sd;
+    struct slab_entry *se;
+    struct slab_entry_size *es;
+    long offset;
+    int idx;
+
+    STATS_INC_PFREES();
+
+    if (maddr == NULL)
+        return;
+
+    slab_lock(cid);
+
+    sd = get_container(cid)->current_slab.maddr;
+    se = slab_find(cid, maddr);
+    if (!se)
+        handle_error("trying to free %p, which is not part of the container\n", maddr);
+
+    offset = ptoi(maddr) - ptoi(se->se_data.current.maddr) - SLAB_ENTRY_DATAOFFSET(se);
+    if (offset < 0 || offset % se->se_size)
+        handle_error("trying to free %p, which is not the start of an object\n", maddr);
+
+    idx = offset / se->se_size;
+    if (!slab_entry_is_allocated(se, maddr))
+        handle_error("trying to free %p, which is not allocated\n", maddr);
+
+    /* the slab_entry is about to change, so it needs a snapshot */
+    slab_bucket_prepare_update(cid, SLAB_ENTRY_BUCKET(se));
+
+    if (se->se_data.current.maddr == se->se_data.snapshot.maddr) {
+        Func_slab_entry_snapshot(cid, se);
+        write_tracker_unprotect(cid, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+    }
+
+    /* the thread that caches se may be allocating from it */
+    bitmap_atomic_clear(SLAB_ENTRY_CBITMAP(se), idx);
+
+    /* non-full entries are kept at the head of the list */
+    if (__sync_fetch_and_add(&se->se_data.current.nfree, 1) == 0 && !slab_cache_owns(se)) {
+        struct slab_entry_size key = SLAB_ENTRY_SIZE_KEY(se);
+        es = RB_FIND(sizes_slab_entry_tree, &sd->sd_size_root, &key);
+        assert(es && "slab_entry without a size list");
+        STAILQ_REMOVE(&es->es_list, se, slab_entry, se_list);
+        STAILQ_INSERT_HEAD(&es->es_list, se, se_list);
+    }
+
+    slab_unlock(cid);
+}
@@ -1,16 +1,182 @@
 #include <string.h>
+#include <stdlib.h>
+#include <cpuid.h>
+#include <immintrin.h>
 #include <atomics.h>
 #include <settings.h>
 #include <macros.h>
+#include <out.h>
 
+int FLUSH_INSN = FLUSH_CLFLUSH;
+
+/* the fence, if asked for, covers all the lines of the segment */
 void flush_memsegment(const void *src, size_t n, int fence)
 {
     void *low = itop(ROUND_DWNCL(ptoi(src)));
     void *high = itop(ROUND_UPCL(ptoi(src) + n));
     void *itr;
     for (itr = low; itr < high; itr+=CACHE_LINE_SIZE) {
-        flush(itr, fence);
+        flush_line(itr);
+    }
+    if (fence)
+        flush_fence();
+}
+
+/*
+ * The copy engine. The cache lines of dest that are entirely copied are
+ * written with non-temporal stores, which bypass the CPU caches, so they do
+ * not need to be flushed and the source is only read once. The partial lines
+ * at both ends are copied through the cache and written back with
+ * flush_line. Both are only ordered by the next fence.
+ *
+ * The engine and the flush instruction are picked once by atomics_init,
+ * from what cpuid reports, and PMLIB_PMEMCPY can ask for a given engine.
+ */
+#define NT_MIN_SIZE     256     ///< smaller copies go through the cache
+
+static void copy_cached(void *dest, const void *src, size_t n)
+{
+    memcpy(dest, src, n);
+    flush_memsegment(dest, n, 0);
+}
+
+/* dest is aligned to a cache line, and n is a multiple of it */
+static void copy_lines_sse2(void *dest, const void *src, size_t n)
+{
+    __m128i *d = dest;
+    const __m128i *s = src;
+
+    for (size_t i = 0; i < n / sizeof(*d); i += 4) {
+        _mm_stream_si128(&d[i], _mm_loadu_si128(&s[i]));
+        _mm_stream_si128(&d[i + 1], _mm_loadu_si128(&s[i + 1]));
+        _mm_stream_si128(&d[i + 2], _mm_loadu_si128(&s[i + 2]));
+        _mm_stream_si128(&d[i + 3], _mm_loadu_si128(&s[i + 3]));
+    }
+}
+
+__attribute__((target("avx2")))
+static void copy_lines_avx2(void *dest, const void *src, size_t n)
+{
+    __m256i *d = dest;
+    const __m256i *s = src;
+
+    for (size_t i = 0; i < n / sizeof(*d); i += 2) {
+        _mm256_stream_si256(&d[i], _mm256_loadu_si256(&s[i]));
+        _mm256_stream_si256(&d[i + 1], _mm256_loadu_si256(&s[i + 1]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void copy_lines_avx512(void *dest, const void *src, size_t n)
+{
+    __m512i *d = dest;
+    const __m512i *s = src;
+
+    for (size_t i = 0; i < n / sizeof(*d); i++)
+        _mm512_stream_si512(&d[i], _mm512_loadu_si512(&s[i]));
+}
+
+static void copy_nt(void (*copy_lines)(void*, const void*, size_t),
+                    void *dest, const void *src, size_t n)
+{
+    size_t head, body;
+
+    if (n < NT_MIN_SIZE) {
+        copy_cached(dest, src, n);
+        return;
+    }
+
+    head = ROUND_UPCL(ptoi(dest)) - ptoi(dest);
+    body = ROUND_DWNCL(n - head);
+
+    if (head)
+        copy_cached(dest, src, head);
+    copy_lines(dest + head, src + head, body);
+    if (n - head - body)
+        copy_cached(dest + head + body, src + head + body, n - head - body);
+}
+
+static void copy_nt_sse2(void *dest, const void *src, size_t n)
+{
+    copy_nt(copy_lines_sse2, dest, src, n);
+}
+
+static void copy_nt_avx2(void *dest, const void *src, size_t n)
+{
+    copy_nt(copy_lines_avx2, dest, src, n);
+}
+
+static void copy_nt_avx512(void *dest, const void *src, size_t n)
+{
+    copy_nt(copy_lines_avx512, dest, src, n);
+}
+
+struct copy_engine {
+    const char *name;
+    void (*copy)(void *dest, const void *src, size_t n);
+    int supported;
+};
+
+enum { ENGINE_AVX512, ENGINE_AVX2, ENGINE_SSE2, ENGINE_FLUSH, ENGINE_CNT };
+
+static struct copy_engine ENGINES[ENGINE_CNT] = {
+    [ENGINE_AVX512] = { "avx512", copy_nt_avx512, 0 },
+    [ENGINE_AVX2]   = { "avx2",   copy_nt_avx2,   0 },
+    [ENGINE_SSE2]   = { "sse2",   copy_nt_sse2,   1 },
+    [ENGINE_FLUSH]  = { "flush",  copy_cached,    1 },  ///< the original path
+};
+
+static struct copy_engine *ENGINE = &ENGINES[ENGINE_FLUSH];
+static const char *FLUSH_INSN_NAMES[] = { "clflush", "clflushopt", "clwb" };
+
+void atomics_init()
+{
+    unsigned int eax, ebx = 0, ecx, edx;
+    char *ptr;
+
+    __builtin_cpu_init();
+    ENGINES[ENGINE_AVX512].supported = __builtin_cpu_supports("avx512f");
+    ENGINES[ENGINE_AVX2].supported = __builtin_cpu_supports("avx2");
+
+    /* the flush instructions are in the extended features, leaf 7 */
+    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    if (ebx & bit_CLWB)
+        FLUSH_INSN = FLUSH_CLWB;
+    else if (ebx & bit_CLFLUSHOPT)
+        FLUSH_INSN = FLUSH_CLFLUSHOPT;
+
+    ptr = getenv("PMLIB_FLUSH");
+    if (ptr) {
+        int i;
+        for (i = FLUSH_INSN; i >= FLUSH_CLFLUSH && strcmp(ptr, FLUSH_INSN_NAMES[i]); i--)
+            ;
+        if (i >= FLUSH_CLFLUSH)
+            FLUSH_INSN = i;
+        else
+            LOG(3, "flush instruction %s is not supported", ptr);
+    }
+
+    /* the engines are listed from the fastest to the slowest */
+    for (ENGINE = ENGINES; !ENGINE->supported; ENGINE++)
+        ;
+
+    ptr = getenv("PMLIB_PMEMCPY");
+    if (ptr) {
+        int i;
+        for (i = 0; i < ENGINE_CNT && strcmp(ptr, ENGINES[i].name); i++)
+            ;
+        if (i < ENGINE_CNT && ENGINES[i].supported)
+            ENGINE = &ENGINES[i];
+        else
+            LOG(3, "pmemcpy engine %s is not supported", ptr);
     }
+
+    LOG(3, "pmemcpy engine: %s, flush: %s", ENGINE->name, FLUSH_INSN_NAMES[FLUSH_INSN]);
+}
+
+const char *pmemcpy_engine()
+{
+    return ENGINE->name;
 }
 
 /**
@@ -18,8 +184,17 @@ void flush_memsegment(const void *src, size_t n, int fence)
  */
 void *pmemcpy(void *dest, const void *src, size_t n)
 {
-    void *ret = memcpy(dest, src, n);
-    flush_memsegment(dest, n, 0);
-    return ret;
+    ENGINE->copy(dest, src, n);
+    store_fence();
+    return dest;
 }
 
+/**
+ * Copy without a fence, so many copies can share one: the copy is only
+ * ordered by the next store_fence()
+ */
+void *pmemcpy_nt(void *dest, const void *src, size_t n)
+{
+    ENGINE->copy(dest, src, n);
+    return dest;
+}
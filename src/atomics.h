@@ -3,6 +3,32 @@
 
 #include "stats.h"
 
+/*
+ * Cache line flushes. flush_line writes back the line of addr with the best
+ * instruction of the CPU, CLWB > CLFLUSHOPT > CLFLUSH, which atomics_init
+ * picks. CLWB and CLFLUSHOPT are only ordered by a fence, so a phase that
+ * updates many lines can queue their flushes and wait for all of them with a
+ * single flush_fence().
+ */
+enum { FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB };
+extern int FLUSH_INSN;
+
+static inline void flush_line(const void *addr)
+{
+    STATS_INC_FLUSH();
+    if (FLUSH_INSN == FLUSH_CLWB)
+        asm volatile ("clwb %0" : "+m" (*(volatile char*) addr));
+    else if (FLUSH_INSN == FLUSH_CLFLUSHOPT)
+        asm volatile ("clflushopt %0" : "+m" (*(volatile char*) addr));
+    else
+        asm volatile ("clflush %0" : "+m" (*(volatile char*) addr));
+}
+
+#define flush_fence() do { \
+    STATS_INC_FENCE(); \
+    asm volatile ("sfence" ::: "memory"); \
+} while (0)
+
 #define atomic_set_flag(bitarray, flag) do { \
     ((bitarray) |= (flag)); \
     volatile void *addr = &(bitarray); \
@@ -21,6 +47,13 @@
     flush(addr, 1); \
 } while (0)
 
+/* the update is only durable after the next flush_fence() */
+#define atomic_set_nofence(ptr, val) do { \
+    volatile uint64_t *addr = ptr; \
+    *addr = val; \
+    flush(addr, 0); \
+} while (0)
+
 #define simflush_fence(addr) do {\
     STATS_INC_FLUSH(); \
     unsigned long long tmp = 0; \
@@ -37,13 +70,19 @@
 } while (0)
 
 #define flush(addr, fence) do {\
-    STATS_INC_FLUSH(); \
-    asm volatile ("clflush %0" : /* no output */ : "m" (addr)); \
+    flush_line((const void*) (addr)); \
     if (fence) \
-        asm volatile ("sfence"); \
+        flush_fence(); \
 } while(0)
 
+#define store_fence() flush_fence()
+
+/* pick the copy engine and the flush instruction of the CPU */
+void atomics_init();
+const char *pmemcpy_engine();
+
 void *pmemcpy(void *dest, const void *src, size_t n);
+void *pmemcpy_nt(void *dest, const void *src, size_t n);
 void flush_memsegment(const void *src, size_t n, int fence);
 
 #endif /* end of include guard: ATOMICS_H */
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <cont.h>
+#include <closure.h>
+#include <timediff.h>
+
+/*
+ * Closure benchmark. Builds a binary search tree of n nodes allocated with
+ * malloc and registered with mallocat and pointerat, whose root is in the
+ * container, and takes a checkpoint, which moves the whole tree to the
+ * container. For every number of closure threads from 1 to the number of
+ * cores, the tree is built and checkpointed in a fresh process. The time of
+ * the checkpoint is compared against the run with a single thread, and the
+ * layout of the tree in the container must be the same in every run.
+ */
+
+struct node {
+    struct node *left;
+    struct node *right;
+    uint64_t key;
+    uint64_t value;
+};
+
+struct result {
+    long double elapsed;
+    uint64_t checksum;
+};
+
+const char *program_name;
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Number of nodes (default: 1000000).\n"
+            "  -t x     Maximum number of threads (default: number of cores).\n");
+    exit(exit_code);
+}
+
+/* the offsets of the nodes in the container, in key order */
+static uint64_t checksum(struct node *node, void *base, uint64_t sum)
+{
+    while (node) {
+        sum = checksum(node->left, base, sum);
+        sum = sum * 31 + ((char*) node - (char*) base) + node->value;
+        node = node->right;
+    }
+    return sum;
+}
+
+static void run(uint64_t n, int nthreads, int fd)
+{
+    struct container *cont;
+    struct node *root, *node, **pnode;
+    struct result res;
+    uint64_t key = 1;
+    char fname[128];
+    TIMEDIFF_INIT();
+
+    /* every run starts from an empty container */
+    sprintf(fname, "%s%d", getenv("PMLIB_CONT_FILE") ? : FM_FILE_NAME_PREFIX, 0);
+    unlink(fname);
+
+    CLOSURE_THREADS = nthreads;
+    cont = container_init();
+
+    root = container_palloc(cont->id, sizeof(*root));
+    root->left = root->right = NULL;
+    root->key = UINT64_MAX / 2;
+    root->value = 0;
+    pointerat(cont->id, &root->left);
+    pointerat(cont->id, &root->right);
+
+    for (uint64_t i = 1; i <= n; i++) {
+        key = key * 6364136223846793005ULL + 1442695040888963407ULL;
+
+        node = malloc(sizeof(*node));
+        node->left = node->right = NULL;
+        node->key = key;
+        node->value = i;
+        mallocat(node, sizeof(*node));
+        pointerat(cont->id, &node->left);
+        pointerat(cont->id, &node->right);
+
+        for (pnode = &root; *pnode; )
+            pnode = key < (*pnode)->key ? &(*pnode)->left : &(*pnode)->right;
+        *pnode = node;
+    }
+    container_setroot(cont->id, root);
+
+    TIMEDIFF_START();
+    container_cpoint(cont->id);
+    clock_gettime(CLOCK_MONOTONIC, &__t1);
+
+    res.elapsed = time_diff(__t0, __t1);
+    res.checksum = checksum(root, cont, 0);
+    if (write(fd, &res, sizeof(res)) != sizeof(res))
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt, status, fds[2];
+    uint64_t n = 1000000;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct result res, base;
+    pid_t pid;
+
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:t:")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoll(optarg); break;
+            case 't': max_threads = atoi(optarg); break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    if (max_threads < 1) {
+        fprintf(stderr, "Invalid number of threads.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pipe(fds)) {
+        fprintf(stderr, "Failed to create a pipe.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("nodes: %lu\n", n);
+    fflush(stdout);
+
+    for (int t = 1; t <= max_threads; t++) {
+        pid = fork();
+        if (pid == 0) {
+            run(n, t, fds[1]);
+            _exit(EXIT_SUCCESS);
+        }
+
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS || read(fds[0], &res, sizeof(res)) != sizeof(res)) {
+            fprintf(stderr, "The run with %d thread(s) failed.\n", t);
+            exit(EXIT_FAILURE);
+        }
+
+        if (t == 1)
+            base = res;
+
+        printf("threads: %2d time: %.3Lf speedup: %.2Lf\n", t, res.elapsed, base.elapsed / res.elapsed);
+
+        if (res.checksum != base.checksum) {
+            fprintf(stderr, "The closure with %d thread(s) differs from the one with 1.\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <cont.h>
+#include <timediff.h>
+
+/*
+ * Asynchronous checkpoint benchmark. Every round writes to n pages of the
+ * container and takes a checkpoint, which retires the n snapshot pages, and
+ * then writes to one page of each of w other objects, timing each write.
+ * Writes to a page that is clean since the checkpoint fault and take the
+ * snapshot of the page, so they contend with the freeing of the retired
+ * pages. The checkpoint is taken with container_cpoint and then with
+ * container_cpoint_async, each in a fresh process.
+ */
+
+struct result {
+    long double cpoint;     ///< average time for the checkpoint to return
+    long double p50, p99, max;
+};
+
+const char *program_name;
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Pages written before each checkpoint (default: 20000).\n"
+            "  -w x     Writes timed after each checkpoint (default: 1000).\n"
+            "  -r x     Number of rounds (default: 10).\n");
+    exit(exit_code);
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+    long double x = *(const long double*) a, y = *(const long double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int async, int n, int w, int rounds, int fd)
+{
+    struct container *cont;
+    char **pages, **probes;
+    long double *latency, cpoint = 0;
+    struct result res;
+    char fname[128];
+    TIMEDIFF_INIT();
+
+    /* every run starts from an empty container */
+    sprintf(fname, "%s%d", getenv("PMLIB_CONT_FILE") ? : FM_FILE_NAME_PREFIX, 0);
+    unlink(fname);
+
+    cont = container_init();
+    pages = malloc(sizeof(*pages) * n);
+    probes = malloc(sizeof(*probes) * w);
+    latency = malloc(sizeof(*latency) * w * rounds);
+    if (!pages || !probes || !latency)
+        exit(EXIT_FAILURE);
+
+    for (int i = 0; i < n; i++)
+        pages[i] = container_palloc(cont->id, PAGE_SIZE);
+    for (int i = 0; i < w; i++)
+        probes[i] = container_palloc(cont->id, PAGE_SIZE);
+    container_cpoint(cont->id);
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < n; i++)
+            pages[i][0] = r;
+
+        TIMEDIFF_START();
+        if (async)
+            container_cpoint_async(cont->id);
+        else
+            container_cpoint(cont->id);
+        clock_gettime(CLOCK_MONOTONIC, &__t1);
+        cpoint += time_diff(__t0, __t1);
+
+        for (int i = 0; i < w; i++) {
+            TIMEDIFF_START();
+            probes[i][0] = r;
+            clock_gettime(CLOCK_MONOTONIC, &__t1);
+            latency[r * w + i] = time_diff(__t0, __t1);
+        }
+
+        /* the probes must be clean again after the next checkpoint */
+        container_cpoint_drain(cont->id);
+    }
+
+    qsort(latency, w * rounds, sizeof(*latency), latency_cmp);
+    res.cpoint = cpoint / rounds;
+    res.p50 = latency[w * rounds / 2];
+    res.p99 = latency[(long) w * rounds * 99 / 100];
+    res.max = latency[w * rounds - 1];
+    if (write(fd, &res, sizeof(res)) != sizeof(res))
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt, status, fds[2];
+    int n = 20000, w = 1000, rounds = 10;
+    const char *names[] = { "sync", "async" };
+    struct result res;
+    pid_t pid;
+
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:w:r:")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoi(optarg); break;
+            case 'w': w = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    if (n < 1 || w < 1 || rounds < 1) {
+        fprintf(stderr, "Invalid arguments.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pipe(fds)) {
+        fprintf(stderr, "Failed to create a pipe.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("pages: %d writes: %d rounds: %d\n", n, w, rounds);
+    printf("%-6s %12s %12s %12s %12s\n", "cpoint", "return(us)", "p50(us)", "p99(us)", "max(us)");
+    fflush(stdout);
+
+    for (int async = 0; async <= 1; async++) {
+        pid = fork();
+        if (pid == 0) {
+            run(async, n, w, rounds, fds[1]);
+            _exit(EXIT_SUCCESS);
+        }
+
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS || read(fds[0], &res, sizeof(res)) != sizeof(res)) {
+            fprintf(stderr, "The %s run failed.\n", names[async]);
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%-6s %12.1Lf %12.1Lf %12.1Lf %12.1Lf\n", names[async], res.cpoint * 1e6,
+               res.p50 * 1e6, res.p99 * 1e6, res.max * 1e6);
+    }
+
+    exit(EXIT_SUCCESS);
+}
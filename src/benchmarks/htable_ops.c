@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <htable.h>
+#include <timediff.h>
+
+/*
+ * Hash table microbenchmark. Compares the htable of the library with the
+ * chained hash table it replaced on the operations done by pointerat and
+ * mallocat: inserting, looking up and removing pointer keys, and refilling
+ * the table after every checkpoint. Keys are laid out like the pointers of
+ * rbtree nodes (three pointers per 512-byte node).
+ */
+
+const char *program_name;
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Number of keys (default: 1000000).\n"
+            "  -r x     Number of checkpoints to refill the table for (default: 100).\n");
+    exit(exit_code);
+}
+
+/*
+ * The chained hash table, as it was before it was replaced: one malloc per
+ * entry and a byte-wise hash of the key
+ */
+struct chained_entry {
+    uint32_t hash;
+    void *key;
+    void *val;
+    struct chained_entry *next_hash;
+};
+
+struct chained {
+    uint32_t length;
+    uint32_t elems;
+    struct chained_entry **list;
+};
+
+/* keys are 8 bytes, so the tail of the original hash is left out */
+static uint32_t chained_hash(const char* data, size_t n, uint32_t seed)
+{
+    const uint32_t m = 0xc6a4a793;
+    const char* limit = data + n;
+    uint32_t h = seed ^ (n * m);
+
+    while (data + 4 <= limit) {
+        uint32_t w = ((uint32_t)(data[0]) | (uint32_t)(data[1] << 8) |
+                      (uint32_t)(data[2] << 16) | (uint32_t)(data[3] << 24));
+        data += 4;
+        h += w;
+        h *= m;
+        h ^= (h >> 16);
+    }
+    return h;
+}
+
+static struct chained_entry **chained_find_pointer(struct chained *ht, void *key, uint32_t hash)
+{
+    struct chained_entry **ptr = &ht->list[hash & (ht->length - 1)];
+    while (*ptr != NULL && ((*ptr)->hash != hash || key != (*ptr)->key))
+        ptr = &(*ptr)->next_hash;
+    return ptr;
+}
+
+static void chained_resize(struct chained *ht)
+{
+    uint32_t new_length = 4;
+    while (new_length < ht->elems)
+        new_length *= 2;
+
+    struct chained_entry **new_list = calloc(new_length, sizeof(void*));
+    assert(new_list);
+
+    for (int i = 0; i < ht->length; i++) {
+        struct chained_entry *e = ht->list[i];
+        while (e != NULL) {
+            struct chained_entry *next = e->next_hash;
+            struct chained_entry **ptr = &new_list[e->hash & (new_length - 1)];
+            e->next_hash = *ptr;
+            *ptr = e;
+            e = next;
+        }
+    }
+
+    free(ht->list);
+    ht->list = new_list;
+    ht->length = new_length;
+}
+
+static void *chained_init()
+{
+    struct chained *ht = calloc(1, sizeof(*ht));
+    assert(ht);
+    chained_resize(ht);
+    return ht;
+}
+
+static void chained_free(void *arg)
+{
+    struct chained *ht = arg;
+    for (int i = 0; i < ht->length; i++) {
+        struct chained_entry *e = ht->list[i];
+        while (e != NULL) {
+            struct chained_entry *next = e->next_hash;
+            free(e);
+            e = next;
+        }
+    }
+    free(ht->list);
+    free(ht);
+}
+
+static int chained_insert(void *arg, void *key, void *val)
+{
+    struct chained *ht = arg;
+    uint32_t hash = chained_hash((char*)&key, sizeof(void*), 0);
+    struct chained_entry **ptr = chained_find_pointer(ht, key, hash);
+
+    if (*ptr) {
+        (*ptr)->val = val;
+        return 0;
+    }
+
+    *ptr = malloc(sizeof(**ptr));
+    assert(*ptr);
+    (*ptr)->key = key;
+    (*ptr)->val = val;
+    (*ptr)->hash = hash;
+    (*ptr)->next_hash = NULL;
+    if (++ht->elems > ht->length)
+        chained_resize(ht);
+    return 1;
+}
+
+static void *chained_lookup(void *arg, void *key)
+{
+    struct chained *ht = arg;
+    uint32_t hash = chained_hash((char*)&key, sizeof(void*), 0);
+    struct chained_entry **ptr = chained_find_pointer(ht, key, hash);
+    return *ptr ? (*ptr)->val : NULL;
+}
+
+/* the original leaked the entry, which is freed here to be fair */
+static void *chained_remove(void *arg, void *key)
+{
+    struct chained *ht = arg;
+    uint32_t hash = chained_hash((char*)&key, sizeof(void*), 0);
+    struct chained_entry **ptr = chained_find_pointer(ht, key, hash);
+    struct chained_entry *e = *ptr;
+    void *val;
+
+    if (!e)
+        return NULL;
+    *ptr = e->next_hash;
+    ht->elems--;
+    val = e->val;
+    free(e);
+    return val;
+}
+
+/* the chained table has no clear: it was freed and allocated again */
+static void *chained_clear(void *arg)
+{
+    chained_free(arg);
+    return chained_init();
+}
+
+static void *htable_ops_init() { return htable_init(); }
+static void htable_ops_free(void *ht) { htable_free(ht); }
+static int htable_ops_insert(void *ht, void *key, void *val) { return htable_insert(ht, key, val); }
+static void *htable_ops_lookup(void *ht, void *key) { return htable_lookup(ht, key); }
+static void *htable_ops_remove(void *ht, void *key) { return htable_remove(ht, key); }
+static void *htable_ops_clear(void *ht) { htable_clear(ht); return ht; }
+
+struct table_ops {
+    const char *name;
+    void *(*init)();
+    void (*free)(void*);
+    int (*insert)(void*, void*, void*);
+    void *(*lookup)(void*, void*);
+    void *(*remove)(void*, void*);
+    void *(*clear)(void*);
+};
+
+static struct table_ops tables[] = {
+    { "chained", chained_init, chained_free, chained_insert, chained_lookup,
+      chained_remove, chained_clear },
+    { "htable", htable_ops_init, htable_ops_free, htable_ops_insert, htable_ops_lookup,
+      htable_ops_remove, htable_ops_clear },
+};
+
+static inline void *key_at(uint64_t i)
+{
+    return (void*)(uintptr_t)(0x10000000000ULL + (i / 3) * 512 + (i % 3) * 8);
+}
+
+static void run(struct table_ops *ops, uint64_t n, int rounds)
+{
+    void *ht = ops->init();
+    uint64_t found = 0;
+    long double t[5];
+    TIMEDIFF_INIT();
+
+    TIMEDIFF_TAKE_VAL(for (uint64_t i = 0; i < n; i++) ops->insert(ht, key_at(i), key_at(i)), t[0]);
+    TIMEDIFF_TAKE_VAL(for (uint64_t i = 0; i < n; i++) found += !!ops->lookup(ht, key_at(i)), t[1]);
+    /* the fourth slot of a node is never a key */
+    TIMEDIFF_TAKE_VAL(for (uint64_t i = 0; i < n; i++) found += !!ops->lookup(ht, key_at(i) + 24), t[2]);
+    TIMEDIFF_TAKE_VAL(for (uint64_t i = 0; i < n; i++) ops->remove(ht, key_at(i)), t[3]);
+
+    /* each checkpoint registers a tenth of the keys again */
+    TIMEDIFF_START();
+    for (int r = 0; r < rounds; r++) {
+        for (uint64_t i = 0; i < n / 10; i++)
+            ops->insert(ht, key_at(i + r), key_at(i));
+        ht = ops->clear(ht);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &__t1);
+    t[4] = time_diff(__t0, __t1);
+
+    if (found != n) {
+        fprintf(stderr, "%s found %lu keys out of %lu.\n", ops->name, found, n);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-8s %10.1Lf %10.1Lf %10.1Lf %10.1Lf %10.3Lf\n", ops->name,
+           t[0] * 1e9 / n, t[1] * 1e9 / n, t[2] * 1e9 / n, t[3] * 1e9 / n, t[4]);
+    ops->free(ht);
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt;
+    uint64_t n = 1000000;
+    int rounds = 100;
+
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:r:")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoll(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    printf("keys: %lu checkpoints: %d\n", n, rounds);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "table", "insert", "hit", "miss", "remove",
+           "refill(s)");
+    printf("%-8s %10s %10s %10s %10s\n", "", "(ns/op)", "(ns/op)", "(ns/op)", "(ns/op)");
+
+    for (int i = 0; i < sizeof(tables) / sizeof(tables[0]); i++)
+        run(&tables[i], n, rounds);
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <cont.h>
+#include <timediff.h>
+
+/*
+ * Multi-threaded allocation benchmark. For every number of threads from 1 to
+ * the number of cores, each thread allocates and initializes n objects, and
+ * then a checkpoint is taken. The throughput is compared against the run with
+ * a single thread.
+ */
+
+const char *program_name;
+
+struct worker_args {
+    unsigned int cid;
+    uint64_t n;
+    int size;
+};
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Allocate x objects per thread (default: 100000).\n"
+            "  -s x     Size of the objects in bytes (default: 64).\n"
+            "  -t x     Maximum number of threads (default: number of cores).\n");
+    exit(exit_code);
+}
+
+void *worker(void *arg)
+{
+    struct worker_args *wa = arg;
+    char *obj;
+
+    for (uint64_t i = 0; i < wa->n; i++) {
+        obj = container_palloc(wa->cid, wa->size);
+        memset(obj, (char) i, wa->size);
+    }
+
+    return NULL;
+}
+
+long double run(unsigned int cid, int nthreads, uint64_t n, int size)
+{
+    pthread_t threads[nthreads];
+    struct worker_args wa = { .cid = cid, .n = n, .size = size };
+    long double elapsed;
+    TIMEDIFF_INIT();
+
+    TIMEDIFF_START();
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, &wa);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &__t1);
+    elapsed = time_diff(__t0, __t1);
+
+    container_cpoint(cid);
+
+    return elapsed;
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt;
+    uint64_t n = 100000;
+    int size = 64;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:s:t:")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoll(optarg); break;
+            case 's': size = atoi(optarg); break;
+            case 't': max_threads = atoi(optarg); break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    if (max_threads < 1 || size < 1) {
+        fprintf(stderr, "Invalid number of threads or object size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct container *cont = container_init();
+    long double base = 0;
+
+    printf("objects per thread: %lu size: %d\n", n, size);
+    for (int t = 1; t <= max_threads; t++) {
+        long double elapsed = run(cont->id, t, n, size);
+        long double mops = (t * n) / elapsed / 1e6;
+
+        if (t == 1)
+            base = mops;
+
+        printf("threads: %2d time: %.3Lf Mallocs/s: %.3Lf speedup: %.2Lf\n",
+               t, elapsed, mops, mops / base);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "tree.h"
 //#define RBTREE_TPL_FILE "/mnt/pmfs/rbtree.tpl"
@@ -14,6 +15,13 @@ struct rbnode {
     char data[1];
 };
 
+/* location of the pointers of a node, to register it as a container type */
+#define RBNODE_NPTRS    3
+#define RBNODE_PTR_OFFSETS { \
+    offsetof(struct rbnode, node.rbe_left), \
+    offsetof(struct rbnode, node.rbe_right), \
+    offsetof(struct rbnode, node.rbe_parent) }
+
 struct rbroot {
     uint64_t node_cnt;
     int node_size;
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <cont.h>
 #include <timediff.h>
@@ -19,6 +20,9 @@
 
 const char *program_name;
 
+/* type of the nodes allocated by workload d, 0 to register their pointers */
+static unsigned int node_type = 0;
+
 void print_usage(FILE *stream, int exit_code)
 {
     fprintf(stream, "Usage: %s options\n", program_name);
@@ -27,7 +31,12 @@ void print_usage(FILE *stream, int exit_code)
             "  -n x     Create x nodes.\n"
             "  -t       Use TPL for persistence.\n"
             "  -p       Use pmlib for persistence.\n"
-            "  -c       Create a consistent point after every modification.\n");
+            "  -c       Create a consistent point after every modification.\n"
+            "  -j x     Run the workload on x threads that share the tree, and make\n"
+            "           their modifications durable with group commit (pmlib only).\n"
+            "  -y       Allocate nodes as a registered type (no pointerat).\n"
+            "  -w x     Run workload x: a (50/50 reads/writes), b (95/5 reads/writes),\n"
+            "           c (read only), or d (delete and re-insert nodes).\n");
     exit(exit_code);
 }
 
@@ -206,6 +215,232 @@ void workloadC(struct rbroot *root, uint64_t n, int consistent,
     printf("reads: %lu, writes: %lu\n", read_cnt, writes_cnt);
 }
 
+static void print_container_size(unsigned int cid)
+{
+    char fname[128];
+    struct stat st;
+
+    sprintf(fname, "%s%d", FM_FILE_NAME_PREFIX, cid);
+    if (stat(fname, &st) == 0)
+        printf("container size: %lu KB\n", st.st_size / 1024);
+}
+
+/*
+ * Remove a node from the tree, free it, and insert a newly allocated node
+ * with the same key
+ */
+static void replace_node(struct rbroot *root, struct rbnode *node, int pmlib, unsigned int cid)
+{
+    uint64_t key = node->key;
+
+    RB_REMOVE(root_struct, &root->root, node);
+    if (pmlib) {
+        container_pfree(cid, node);
+        if (node_type)
+            node = container_palloc_typed(cid, node_type);
+        else
+            node = container_palloc(cid, root->node_size);
+    } else {
+        free(node);
+        node = malloc(root->node_size);
+    }
+    assert(node && "Failed to allocate node");
+
+    node->key = key;
+    write_node_data(node, root->node_size);
+    RB_INSERT(root_struct, &root->root, node);
+
+    if (pmlib && !node_type) {
+        pointerat(cid, &node->node.rbe_left);
+        pointerat(cid, &node->node.rbe_right);
+        pointerat(cid, &node->node.rbe_parent);
+    }
+}
+
+/*
+ * Every operation removes a node from the tree, frees it, and inserts a newly
+ * allocated node with the same key. With pmlib, the size of the container
+ * should stop growing once freed memory is being reused.
+ */
+void workloadD(struct rbroot *root, uint64_t n, int consistent,
+               void (*write_func)(struct rbroot *, void* ), void *write_args)
+{
+    int pmlib = (write_func == write_with_pmlib);
+    unsigned int cid = ptoi(write_args);
+    uint64_t next_key;
+    struct rbnode find, *node;
+    uint64_t deletes_cnt = 0;
+
+    TIMEDIFF_INIT();
+    TIMEDIFF_START();
+
+    uint64_t ten_percent = n / 10;
+    uint64_t verbose_itr = ten_percent;
+    for (uint64_t i = 0; i < n; i++) {
+        next_key = getnext_seq(root->node_cnt);
+        find.key = next_key;
+
+        node = RB_FIND(root_struct, &root->root, &find);
+        assert(node && "The node was not found");
+
+        replace_node(root, node, pmlib, cid);
+        deletes_cnt++;
+
+        if (consistent) {
+            write_func(root, write_args);
+
+            if (i > verbose_itr) {
+                printf("Operations completed %lu out of %lu\n", i, n);
+                if (pmlib)
+                    print_container_size(cid);
+                verbose_itr += ten_percent;
+            }
+        }
+    }
+
+    if (!consistent) {
+        write_func(root, write_args);
+    }
+
+    TIMEDIFF_STOP("Workload D: delete and re-insert");
+    printf("deletes: %lu, inserts: %lu\n", deletes_cnt, deletes_cnt);
+    if (pmlib)
+        print_container_size(cid);
+}
+
+/*
+ * Concurrent workloads: the threads share the tree, which is protected by a
+ * mutex, and every modification is a transaction of the container. With -c,
+ * each thread waits for its modification to be durable before the next
+ * operation, so many commits are pending at the same time and the group
+ * commit serves them with a single checkpoint.
+ */
+struct worker_args {
+    struct rbroot *root;
+    unsigned int cid;
+    int workload;
+    int consistent;
+    uint64_t n;
+    uint64_t reads;
+    uint64_t writes;
+    long double *latency;   ///< of each commit, in seconds
+};
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker(void *arg)
+{
+    struct worker_args *wa = arg;
+    struct rbroot *root = wa->root;
+    struct rbnode find, *node;
+    int next_access;
+    uint64_t ticket;
+    TIMEDIFF_INIT();
+
+    for (uint64_t i = 0; i < wa->n; i++) {
+        container_tx_begin(wa->cid);
+        pthread_mutex_lock(&tree_lock);
+
+        find.key = getnext_seq(root->node_cnt);
+        if (wa->workload == 'a')
+            next_access = getnext_50rw();
+        else if (wa->workload == 'b')
+            next_access = getnext_95rw();
+        else
+            next_access = WRITE;
+
+        node = RB_FIND(root_struct, &root->root, &find);
+        assert(node && "The node was not found");
+
+        if (next_access == READ)
+            read_node_data(node, root->node_size);
+        else if (wa->workload == 'd')
+            replace_node(root, node, 1, wa->cid);
+        else
+            write_node_data(node, root->node_size);
+
+        pthread_mutex_unlock(&tree_lock);
+        container_tx_end(wa->cid);
+
+        if (next_access == READ) {
+            wa->reads++;
+            continue;
+        }
+
+        if (wa->consistent) {
+            TIMEDIFF_START();
+            ticket = container_commit_async(wa->cid);
+            container_commit_wait(wa->cid, ticket);
+            clock_gettime(CLOCK_MONOTONIC, &__t1);
+            wa->latency[wa->writes] = time_diff(__t0, __t1);
+        }
+        wa->writes++;
+    }
+
+    return NULL;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+    long double x = *(const long double*) a, y = *(const long double*) b;
+    return x < y ? -1 : x > y;
+}
+
+void workload_concurrent(struct rbroot *root, uint64_t n, int consistent, int workload,
+                         int nthreads, unsigned int cid)
+{
+    pthread_t threads[nthreads];
+    struct worker_args wa[nthreads];
+    long double *latency = malloc(sizeof(*latency) * (n + 1));
+    uint64_t reads = 0, writes = 0, commits = 0;
+    long double elapsed;
+
+    assert(latency && "Failed to allocate the commit latencies");
+
+    TIMEDIFF_INIT();
+    TIMEDIFF_START();
+
+    for (int t = 0; t < nthreads; t++) {
+        wa[t] = (struct worker_args) {
+            .root = root, .cid = cid, .workload = workload, .consistent = consistent,
+            .n = n / nthreads + (t < n % nthreads), .latency = latency + commits,
+        };
+        commits += wa[t].n;
+        if (pthread_create(&threads[t], NULL, worker, &wa[t])) {
+            fprintf(stderr, "Failed to create thread %d.\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* the latencies of each thread are moved next to each other */
+    commits = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        reads += wa[t].reads;
+        writes += wa[t].writes;
+        if (consistent) {
+            memmove(latency + commits, wa[t].latency, sizeof(*latency) * wa[t].writes);
+            commits += wa[t].writes;
+        }
+    }
+
+    if (!consistent)
+        container_commit(cid);
+
+    clock_gettime(CLOCK_MONOTONIC, &__t1);
+    elapsed = time_diff(__t0, __t1);
+
+    printf("Workload %c on %d threads\t%.3Lf\n", workload, nthreads, elapsed);
+    printf("reads: %lu, writes: %lu\n", reads, writes);
+    if (commits) {
+        qsort(latency, commits, sizeof(*latency), latency_cmp);
+        printf("commits/s: %.0Lf, latency (us) p50: %.1Lf p99: %.1Lf max: %.1Lf\n",
+               commits / elapsed, latency[commits / 2] * 1e6,
+               latency[commits * 99 / 100] * 1e6, latency[commits - 1] * 1e6);
+    }
+    free(latency);
+}
+
 int detectWorkload(char *str)
 {
     if (strcmp(str, "a") == 0) {
@@ -214,6 +449,8 @@ int detectWorkload(char *str)
         return 'b';
     } else if (strcmp(str, "c") == 0) {
         return 'c';
+    } else if (strcmp(str, "d") == 0) {
+        return 'd';
     }
     return -1;
 }
@@ -225,9 +462,11 @@ int main(int argc, char * const argv[])
     int consistent = 0;
     int backend_engine = 0;
     int workload = 0;
+    int typed = 0;
+    int nthreads = 0;
     program_name = argv[0];
 
-    while ((opt = getopt(argc, argv, "hn:ctpw:")) != -1) {
+    while ((opt = getopt(argc, argv, "hn:ctpw:yj:")) != -1) {
         switch (opt) {
             case 'h': print_usage(stdout, EXIT_SUCCESS); break;
             case 'n': n = atoll(optarg); break;
@@ -235,6 +474,8 @@ int main(int argc, char * const argv[])
             case 'p': backend_engine = BACKEND_PMLIB; break;
             case 'c': consistent = 1; break;
             case 'w': workload = detectWorkload(optarg); break;
+            case 'y': typed = 1; break;
+            case 'j': nthreads = atoi(optarg); break;
             default: print_usage(stderr, EXIT_FAILURE);
 
         }
@@ -245,6 +486,12 @@ int main(int argc, char * const argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (nthreads && (backend_engine != BACKEND_PMLIB || nthreads < 1 ||
+                     (workload != 'a' && workload != 'b' && workload != 'd'))) {
+        fprintf(stderr, "Concurrent runs need pmlib and a workload that writes.\n");
+        exit(EXIT_FAILURE);
+    }
+
     struct rbroot *root = NULL;
     void (*write_func)(struct rbroot*, void*) = NULL;
     void *write_args = NULL;
@@ -254,6 +501,12 @@ int main(int argc, char * const argv[])
         root = container_getroot(cont->id);
         write_func = write_with_pmlib;
         write_args = itop(cont->id);
+
+        if (typed) {
+            unsigned int offsets[] = RBNODE_PTR_OFFSETS;
+            node_type = container_register_type(cont->id, root->node_size, offsets, RBNODE_NPTRS);
+            assert(node_type && "Failed to register the node type");
+        }
     } else /* backend_engine == BACKEND_TPL */ {
         root = malloc(sizeof(*root));
         assert(root && "Failed to allocate root");
@@ -290,10 +543,16 @@ int main(int argc, char * const argv[])
         write_func = write_with_tpl;
     }
 
+    if (nthreads) {
+        workload_concurrent(root, n, consistent, workload, nthreads, ptoi(write_args));
+        exit(EXIT_SUCCESS);
+    }
+
     switch (workload) {
         case 'a': workloadA(root, n, consistent, write_func, write_args); break;
         case 'b': workloadB(root, n, consistent, write_func, write_args); break;
         case 'c': workloadC(root, n, consistent, write_func, write_args); break;
+        case 'd': workloadD(root, n, consistent, write_func, write_args); break;
         default: exit(EXIT_FAILURE);
     }
 
@@ -26,6 +26,7 @@ void print_usage(FILE *stream, int exit_code)
             "  -t       Use TPL for persistence.\n"
             "  -p       Use pmlib for persistence.\n"
             "  -m       Allocate memory with malloc.\n"
+            "  -y       Allocate nodes as a registered type (no pointerat).\n"
             "  -c       Create a consistent point after every modification.\n");
     exit(exit_code);
 }
@@ -62,10 +63,12 @@ int main(int argc, char * const argv[])
     int backend_engine = 0;
     int node_size = 512;
     int alloc_with_malloc = 0;
+    int typed = 0;
+    unsigned int node_type = 0;
     program_name = argv[0];
     TIMEDIFF_INIT();
 
-    while ((opt = getopt(argc, argv, "hn:ctpm")) != -1) {
+    while ((opt = getopt(argc, argv, "hn:ctpmy")) != -1) {
         switch (opt) {
             case 'h': print_usage(stdout, EXIT_SUCCESS); break;
             case 'n': n = atoll(optarg); break;
@@ -73,6 +76,7 @@ int main(int argc, char * const argv[])
             case 'p': backend_engine = BACKEND_PMLIB; break;
             case 'c': consistent = 1; break;
             case 'm': alloc_with_malloc = 1; break;
+            case 'y': typed = 1; break;
             default: print_usage(stderr, EXIT_FAILURE);
 
         }
@@ -99,10 +103,17 @@ int main(int argc, char * const argv[])
 
         //allocate root of the RB Tree
         root = container_palloc(cont->id, sizeof(*root));
+        container_setroot(cont->id, root);
         root->node_size = node_size;
         RB_INIT(&root->root);
         pointerat(cont->id, &root->root.rbh_root);
 
+        if (typed) {
+            unsigned int offsets[] = RBNODE_PTR_OFFSETS;
+            node_type = container_register_type(cont->id, node_size, offsets, RBNODE_NPTRS);
+            assert(node_type && "Failed to register the node type");
+        }
+
         if (consistent)
             container_cpoint(cont->id);
 
@@ -111,7 +122,9 @@ int main(int argc, char * const argv[])
             if (alloc_with_malloc) {
                 node = malloc(node_size);
                 mallocat(node, node_size);
-            } else
+            } else if (node_type)
+                node = container_palloc_typed(cont->id, node_type);
+            else
                 node = container_palloc(cont->id, node_size);
 
             node->key = i;
@@ -119,9 +132,11 @@ int main(int argc, char * const argv[])
             RB_INSERT(root_struct, &root->root, node);
             root->node_cnt++;
 
-            pointerat(cont->id, &node->node.rbe_left);
-            pointerat(cont->id, &node->node.rbe_right);
-            pointerat(cont->id, &node->node.rbe_parent);
+            if (!node_type || alloc_with_malloc) {
+                pointerat(cont->id, &node->node.rbe_left);
+                pointerat(cont->id, &node->node.rbe_right);
+                pointerat(cont->id, &node->node.rbe_parent);
+            }
 
             if (consistent) {
                 container_cpoint(cont->id);
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <cont.h>
+#include <closure.h>
+#include <timediff.h>
+
+/*
+ * Restore time benchmark. Creates a container with a linked list of n nodes
+ * whose next pointers are registered with pointerat, and then restores it
+ * twice in fresh processes:
+ *
+ *  - at the address where it was created, where the pointers are still
+ *    valid and are not fixed,
+ *  - with that address taken, which moves the container and fixes every
+ *    pointer.
+ *
+ * With -y the nodes are allocated as a registered type instead, so their
+ * pointers are rebased rather than fixed from their metadata.
+ */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+struct node {
+    struct node *next;
+    uint64_t value;
+};
+
+const char *program_name;
+static int typed = 0;
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Number of nodes (default: 100000).\n"
+            "  -y       Allocate nodes as a registered type (no pointerat).\n");
+    exit(exit_code);
+}
+
+static void create(uint64_t n)
+{
+    struct container *cont = container_init();
+    struct node *head = NULL, *node;
+    unsigned int offsets[] = { offsetof(struct node, next) };
+    unsigned int type = 0;
+
+    if (typed)
+        type = container_register_type(cont->id, sizeof(*node), offsets, 1);
+
+    for (uint64_t i = 0; i < n; i++) {
+        node = type ? container_palloc_typed(cont->id, type) : container_palloc(cont->id, sizeof(*node));
+        node->value = i;
+        node->next = head;
+        if (!type)
+            pointerat(cont->id, (void**) &node->next);
+        head = node;
+    }
+    container_setroot(cont->id, head);
+    container_cpoint(cont->id);
+}
+
+static void restore(uint64_t n, const char *what, int fd)
+{
+    struct container *cont;
+    struct node *node;
+    uint64_t i = n;
+    TIMEDIFF_INIT();
+
+    TIMEDIFF_START();
+    cont = container_restore(0);
+    clock_gettime(CLOCK_MONOTONIC, &__t1);
+
+    for (node = container_getroot(cont->id); node; node = node->next) {
+        if (node->value != --i) {
+            fprintf(stderr, "Node %lu is corrupted.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (i != 0) {
+        fprintf(stderr, "%lu nodes are missing.\n", i);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-16s %p %.3Lf ms\n", what, (void*) cont, time_diff(__t0, __t1) * 1e3);
+    if (fd >= 0 && write(fd, &cont, sizeof(cont)) != sizeof(cont))
+        exit(EXIT_FAILURE);
+}
+
+static void run(void (*fun)(uint64_t, const char*, int), uint64_t n, const char *what, int fd)
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        fun(n, what, fd);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s failed.\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void do_create(uint64_t n, const char *what, int fd)
+{
+    create(n);
+}
+
+/* take the address of the container, so it is restored somewhere else */
+static void do_moved_restore(uint64_t n, const char *what, int fd)
+{
+    void *base;
+
+    if (read(fd, &base, sizeof(base)) != sizeof(base) ||
+        mmap(base, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != base) {
+        fprintf(stderr, "Failed to take the address of the container.\n");
+        exit(EXIT_FAILURE);
+    }
+    restore(n, what, -1);
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt;
+    uint64_t n = 100000;
+    int fds[2];
+
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:y")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoll(optarg); break;
+            case 'y': typed = 1; break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    if (pipe(fds)) {
+        fprintf(stderr, "Failed to create a pipe.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("nodes: %lu typed: %d\n", n, typed);
+    fflush(stdout);
+
+    run(do_create, n, "create", -1);
+    run(restore, n, "same address", fds[1]);
+    run(do_moved_restore, n, "moved", fds[0]);
+
+    exit(EXIT_SUCCESS);
+}
@@ -98,6 +98,7 @@ int main(int argc, char * const argv[])
 
         //allocate head of the slist
         head = container_palloc(cont->id, sizeof(*head));
+        container_setroot(cont->id, head);
         head->node_size = node_size;
         STAILQ_INIT(&head->head);
         pointerat(cont->id, &head->head.stqh_first);
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <cont.h>
+#include <atomics.h>
+#include <timediff.h>
+
+/*
+ * Snapshot copy microbenchmark. Compares the engines of pmemcpy on the copy
+ * of a page, and on the snapshot of a page taken on the first write after a
+ * checkpoint, which also includes the fault and the allocation of the
+ * snapshot page. The engine is picked when the library is loaded, so each
+ * engine is measured in a new process that runs with PMLIB_PMEMCPY set.
+ */
+
+static const char *engines[] = { "flush", "sse2", "avx2", "avx512" };
+
+const char *program_name;
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Number of pages (default: 10000).\n"
+            "  -r x     Number of rounds (default: 5).\n");
+    exit(exit_code);
+}
+
+static void run(const char *engine, int n, int rounds)
+{
+    struct container *cont;
+    char **objs, *src, *dest;
+    long double copy = 0, cow = 0, t;
+    TIMEDIFF_INIT();
+
+    /* the engine is not available on this CPU */
+    if (strcmp(pmemcpy_engine(), engine)) {
+        printf("%-8s %12s\n", engine, "unsupported");
+        return;
+    }
+
+    objs = malloc(sizeof(*objs) * n);
+    if (posix_memalign((void**) &src, PAGE_SIZE, (size_t) n * PAGE_SIZE) ||
+        posix_memalign((void**) &dest, PAGE_SIZE, (size_t) n * PAGE_SIZE) || !objs)
+        exit(EXIT_FAILURE);
+    memset(src, 'a', (size_t) n * PAGE_SIZE);
+    memset(dest, 'b', (size_t) n * PAGE_SIZE);
+
+    for (int r = 0; r < rounds; r++) {
+        TIMEDIFF_TAKE_VAL(for (int i = 0; i < n; i++)
+                              pmemcpy(dest + (size_t) i * PAGE_SIZE, src + (size_t) i * PAGE_SIZE, PAGE_SIZE), t);
+        copy += t;
+    }
+
+    /* every run starts from an empty container */
+    char fname[128];
+    sprintf(fname, "%s%d", getenv("PMLIB_CONT_FILE") ? : FM_FILE_NAME_PREFIX, 0);
+    unlink(fname);
+
+    cont = container_init();
+    for (int i = 0; i < n; i++)
+        objs[i] = container_palloc(cont->id, PAGE_SIZE);
+    container_cpoint(cont->id);
+
+    for (int r = 0; r < rounds; r++) {
+        TIMEDIFF_TAKE_VAL(for (int i = 0; i < n; i++) objs[i][0] = r, t);
+        cow += t;
+        container_cpoint(cont->id);
+    }
+
+    printf("%-8s %12.1Lf %12.1Lf\n", engine, copy * 1e9 / n / rounds, cow * 1e9 / n / rounds);
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt, status;
+    int n = 10000, rounds = 5;
+    const char *engine = NULL;
+    char nbuf[32], rbuf[32];
+    pid_t pid;
+
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:r:e:")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'e': engine = optarg; break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    if (n < 1 || rounds < 1) {
+        fprintf(stderr, "Invalid arguments.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the run of a single engine, in its own process */
+    if (engine) {
+        run(engine, n, rounds);
+        exit(EXIT_SUCCESS);
+    }
+
+    printf("pages: %d rounds: %d\n", n, rounds);
+    printf("%-8s %12s %12s\n", "engine", "copy(ns/pg)", "cow(ns/pg)");
+    fflush(stdout);
+
+    sprintf(nbuf, "%d", n);
+    sprintf(rbuf, "%d", rounds);
+    for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        pid = fork();
+        if (pid == 0) {
+            setenv("PMLIB_PMEMCPY", engines[i], 1);
+            execl("/proc/self/exe", program_name, "-n", nbuf, "-r", rbuf, "-e", engines[i], NULL);
+            _exit(EXIT_FAILURE);
+        }
+
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "The run of engine %s failed.\n", engines[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    exit(EXIT_SUCCESS);
+}
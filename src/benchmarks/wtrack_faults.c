@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cont.h>
+#include <wtracker.h>
+#include <timediff.h>
+
+/*
+ * Write tracking benchmark. Allocates n data pages, and then for a number of
+ * rounds writes one byte to every page (which faults once per page) and takes
+ * a checkpoint (which write-protects the pages again). The cost per page of
+ * both steps is reported for the write tracker selected with
+ * PMLIB_WRITE_TRACKER (signal or uffd). userfaultfd can only write-protect
+ * shmem, so place the container on it to use uffd, e.g.:
+ *
+ *   PMLIB_WRITE_TRACKER=uffd PMLIB_CONT_FILE=/dev/shm/container ./wtrack_faults
+ */
+
+#define PAGE_SIZE   4096
+
+const char *program_name;
+
+void print_usage(FILE *stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "  -h       Display usage.\n"
+            "  -n x     Number of data pages (default: 10000).\n"
+            "  -r x     Number of rounds (default: 5).\n");
+    exit(exit_code);
+}
+
+int main(int argc, char * const argv[])
+{
+    int opt;
+    uint64_t n = 10000;
+    int rounds = 5;
+    char **pages;
+    long double fault_time = 0, cpoint_time = 0;
+    TIMEDIFF_INIT();
+
+    program_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "hn:r:")) != -1) {
+        switch (opt) {
+            case 'h': print_usage(stdout, EXIT_SUCCESS); break;
+            case 'n': n = atoll(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: print_usage(stderr, EXIT_FAILURE);
+        }
+    }
+
+    pages = malloc(n * sizeof(*pages));
+    if (!pages) {
+        fprintf(stderr, "Failed to allocate the array of pages.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct container *cont = container_init();
+
+    /* objects of a page fill a data page each */
+    for (uint64_t i = 0; i < n; i++)
+        pages[i] = container_palloc(cont->id, PAGE_SIZE);
+    container_cpoint(cont->id);
+
+    for (int r = 0; r < rounds; r++) {
+        TIMEDIFF_START();
+        for (uint64_t i = 0; i < n; i++)
+            pages[i][0] = (char) r;
+        clock_gettime(CLOCK_MONOTONIC, &__t1);
+        fault_time += time_diff(__t0, __t1);
+
+        TIMEDIFF_START();
+        container_cpoint(cont->id);
+        clock_gettime(CLOCK_MONOTONIC, &__t1);
+        cpoint_time += time_diff(__t0, __t1);
+    }
+
+    printf("%s\n", write_tracker_name());
+    printf("pages: %lu rounds: %d\n", n, rounds);
+    printf("first write: %.3Lf us/page\n", fault_time * 1e6 / (n * rounds));
+    printf("checkpoint:  %.3Lf us/page\n", cpoint_time * 1e6 / (n * rounds));
+
+    free(pages);
+    exit(EXIT_SUCCESS);
+}
@@ -1,103 +1,371 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "slabInt.h"
 #include "cont.h"
 #include "atomics.h"
 #include "page_alloc.h"
+#include "wtracker.h"
+#include "softdirty.h"
+#include "stats.h"
+#include "out.h"
 
-static void slab_bucket_cpoint(unsigned int cid, struct slab_bucket *sb, int type)
+extern void (*Func_slab_entry_commit)(unsigned int cid, struct slab_entry *se);
+extern void (*Func_slab_collect_dirty)(unsigned int cid);
+
+/*
+ * Data runs and snapshot pages of the slab that can only be given back to
+ * the page allocator once the checkpoint is complete
+ */
+struct retired_run {
+    void *maddr;
+    size_t size;
+};
+static VECTOR_DECL(retired_vector, struct retired_run) RETIRED_RUNS;
+
+static void slab_retire_pages(void *maddr, size_t size)
 {
-    struct slab_entry *se;
-    int i;
+    struct retired_run run = { .maddr = maddr, .size = size };
+    VECTOR_APPEND(&RETIRED_RUNS, run);
+}
 
-    for (i = 0; i < SLAB_BUCKET_ENTRIES; i++) {
-        se = &sb->sb_entries[i];
+static void slab_free_retired(unsigned int cid)
+{
+    struct retired_run *run;
 
-        if (!SLAB_ENTRY_IS_INIT(se))
-            continue;
+    for (int i = 0; i < VECTOR_SIZE(&RETIRED_RUNS); i++) {
+        run = &VECTOR_AT(&RETIRED_RUNS, i);
+        for (size_t off = 0; off < run->size; off += PAGE_SIZE)
+            page_allocator_freepages(cid, run->maddr + off);
+    }
+    VECTOR_FREE(&RETIRED_RUNS);
+}
 
-        if (se->se_data.current.maddr != se->se_data.snapshot.maddr) {
-            atomic_set(&se->se_data.snapshot.laddr, se->se_data.current.laddr);
-            page_allocator_freepages(cid, se->se_data.snapshot.maddr);
-            se->se_data.snapshot.maddr = se->se_data.current.maddr;
-            //TODO: handle allocation bigger than one page
-        }
+/*
+ * Asynchronous checkpoints leave the retired runs, and the report of the
+ * stats of the transaction, to a background thread. The thread takes the
+ * slab lock to free a few pages at a time, so the writes that fault in the
+ * meantime are not held up for long.
+ */
+#define RECLAIM_CHUNK_PAGES 64
+
+struct reclaim_batch {
+    struct retired_vector runs;
+    struct global_stats stats;
+    STAILQ_ENTRY(reclaim_batch) list;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    STAILQ_HEAD(reclaim_batch_head, reclaim_batch) batches;
+    int running;
+    int busy;
+} RECLAIMER = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .batches = STAILQ_HEAD_INITIALIZER(RECLAIMER.batches),
+};
+
+static void slab_reclaim_batch(unsigned int cid, struct reclaim_batch *b)
+{
+    struct retired_run *run;
+    int freed = 0;
 
-        if (se->se_ptr.current.maddr != NULL) {
-            if (se->se_ptr.snapshot.maddr != NULL &&
-                    se->se_ptr.snapshot.maddr != se->se_ptr.current.maddr) {
-                page_allocator_freepages(cid, se->se_ptr.snapshot.maddr);
+    slab_lock(cid);
+    for (int i = 0; i < VECTOR_SIZE(&b->runs); i++) {
+        run = &VECTOR_AT(&b->runs, i);
+        for (size_t off = 0; off < run->size; off += PAGE_SIZE) {
+            page_allocator_freepages(cid, run->maddr + off);
+            if (++freed % RECLAIM_CHUNK_PAGES == 0) {
+                slab_unlock(cid);
+                slab_lock(cid);
             }
-            atomic_set(&se->se_ptr.snapshot.laddr, se->se_ptr.current.laddr);
-            se->se_ptr.snapshot.maddr = se->se_ptr.current.maddr;
         }
+    }
+    slab_unlock(cid);
+    VECTOR_FREE(&b->runs);
 
-        if (type == CPOINT_REGULAR)
-            page_allocator_mprotect(cid, se->se_data.current.maddr, PAGE_SIZE, PROT_READ);
+    LOG(8, stats_pt_report_of(&b->stats));
+    LOG(8, stats_general_report_of(&b->stats));
+}
+
+//TODO: add support for multiple containers
+static void *slab_reclaimer(void *arg)
+{
+    struct reclaim_batch *b;
+
+    pthread_mutex_lock(&RECLAIMER.lock);
+    for (;;) {
+        while (!(b = STAILQ_FIRST(&RECLAIMER.batches)))
+            pthread_cond_wait(&RECLAIMER.work, &RECLAIMER.lock);
+        STAILQ_REMOVE_HEAD(&RECLAIMER.batches, list);
+        RECLAIMER.busy = 1;
+        pthread_mutex_unlock(&RECLAIMER.lock);
+
+        slab_reclaim_batch(0, b);
+        free(b);
+
+        pthread_mutex_lock(&RECLAIMER.lock);
+        RECLAIMER.busy = 0;
+        if (STAILQ_EMPTY(&RECLAIMER.batches))
+            pthread_cond_broadcast(&RECLAIMER.idle);
     }
 
+    return NULL;
 }
 
-static void slab_inner_cpoint(unsigned int cid, struct slab_inner *si, int type)
+/* hand the retired runs to the background thread; the slab lock is held */
+static void slab_free_retired_async(unsigned int cid)
 {
-    int i;
-    struct slab_bucket *sb;
+    struct reclaim_batch *b;
+    pthread_t thread;
+
+    b = malloc(sizeof(*b));
+    if (!b)
+        handle_error("failed to allocate a reclaim batch\n");
+    b->runs = RETIRED_RUNS;
+    memset(&RETIRED_RUNS, 0, sizeof(RETIRED_RUNS));
+    b->stats = GLOBAL_STATS;
+
+    pthread_mutex_lock(&RECLAIMER.lock);
+    if (!RECLAIMER.running) {
+        if (pthread_create(&thread, NULL, slab_reclaimer, NULL))
+            handle_error("failed to create the reclaimer thread\n");
+        pthread_detach(thread);
+        RECLAIMER.running = 1;
+    }
+    STAILQ_INSERT_TAIL(&RECLAIMER.batches, b, list);
+    pthread_cond_signal(&RECLAIMER.work);
+    pthread_mutex_unlock(&RECLAIMER.lock);
+}
+
+/*
+ * Wait for the background thread to free the pages retired by the
+ * asynchronous checkpoints
+ */
+void slab_reclaim_drain(unsigned int cid)
+{
+    pthread_mutex_lock(&RECLAIMER.lock);
+    while (RECLAIMER.busy || !STAILQ_EMPTY(&RECLAIMER.batches))
+        pthread_cond_wait(&RECLAIMER.idle, &RECLAIMER.lock);
+    pthread_mutex_unlock(&RECLAIMER.lock);
+}
 
-    for (i = 0; i < si->si_index; i++) {
-        sb = si->si_current[i].maddr;
-        if (sb->sb_has_snapshot) {
-            slab_bucket_cpoint(cid, si->si_current[i].maddr, type);
+/*
+ * The modified data run becomes part of the checkpoint, and its snapshot is
+ * no longer needed.
+ */
+void slab_entry_cow_commit(unsigned int cid, struct slab_entry *se)
+{
+    atomic_set_nofence(&se->se_data.snapshot.laddr, se->se_data.current.laddr);
+    slab_retire_pages(se->se_data.snapshot.maddr, SLAB_ENTRY_DATASIZE(se));
+    se->se_data.snapshot.maddr = se->se_data.current.maddr;
+}
 
-            atomic_set(&si->si_snapshot[i].laddr, si->si_current[i].laddr);
-            page_allocator_freepages(cid, si->si_snapshot[i].maddr);
-            si->si_snapshot[i].maddr = si->si_current[i].maddr;
+/*
+ * The redo copy is already the version of the checkpoint, unless the
+ * slab_entry is about to be released.
+ */
+void slab_entry_redo_commit(unsigned int cid, struct slab_entry *se)
+{
+    if (SLAB_ENTRY_EMPTY(se)) {
+        atomic_set_nofence(&se->se_data.snapshot.laddr, se->se_data.current.laddr);
+        slab_retire_pages(se->se_data.snapshot.maddr, SLAB_ENTRY_DATASIZE(se));
+        se->se_data.snapshot.maddr = se->se_data.current.maddr;
+    }
+}
+
+/*
+ * Soft-dirty mode: take a redo copy of every data run written since the last
+ * checkpoint. The data pages of a new slab_entry are shared with the
+ * checkpoint until they get their first redo copy, so those are copied even
+ * if they are clean.
+ */
+void slab_collect_dirty(unsigned int cid)
+{
+    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
+    struct softdirty_scan scan;
+    struct slab_entry *se;
+
+    softdirty_scan_begin(&scan);
+    RB_FOREACH(se, used_slab_entry_tree, &sd->sd_maddr_root) {
+        /* empty slab_entry(s) are released by this checkpoint */
+        if (SLAB_ENTRY_EMPTY(se))
+            continue;
 
-            sb->sb_has_snapshot = 0;
+        if (se->se_data.current.maddr == se->se_data.snapshot.maddr) {
+            slab_entry_redo_copy(cid, se);
+        } else if (softdirty_test(&scan, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se))) {
+            slab_retire_pages(se->se_data.snapshot.maddr, SLAB_ENTRY_DATASIZE(se));
+            slab_entry_redo_copy(cid, se);
         }
     }
+    softdirty_scan_end(&scan);
+
+    softdirty_clear();
+}
+
+static int slab_entry_addr_cmp(const void *a, const void *b)
+{
+    const struct slab_entry *x = *(struct slab_entry * const *) a;
+    const struct slab_entry *y = *(struct slab_entry * const *) b;
+
+    if (x->se_data.current.maddr == y->se_data.current.maddr)
+        return 0;
+    return x->se_data.current.maddr < y->se_data.current.maddr ? -1 : 1;
 }
 
-static void slab_outer_cpoint(unsigned int cid, struct slab_outer *so, int type)
+/*
+ * Track the writes to the data pages modified since the last checkpoint
+ * again. The slab_entry(s) are sorted by address, so adjacent data runs are
+ * protected with a single call.
+ */
+static void slab_protect_modified(unsigned int cid, struct slab_dir *sd)
 {
+    struct write_tracker_batch batch;
+    struct slab_entry *se;
+
+    qsort(sd->sd_vector.buffer, VECTOR_SIZE(&sd->sd_vector),
+          sizeof(struct slab_entry*), slab_entry_addr_cmp);
+
+    write_tracker_batch_init(&batch, cid);
+    for (int i = 0; i < VECTOR_SIZE(&sd->sd_vector); i++) {
+        se = VECTOR_AT(&sd->sd_vector, i);
+        /* released slab_entry(s) are no longer initialized */
+        if (SLAB_ENTRY_IS_INIT(se))
+            write_tracker_batch_protect(&batch, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+    }
+    write_tracker_batch_flush(&batch);
+}
+
+static void slab_bucket_cpoint(unsigned int cid, struct slab_bucket *sb, int type)
+{
+    struct slab_entry *se;
     int i;
 
-    for (i = 0; i < so->so_index; i++) {
-        slab_inner_cpoint(cid, so->so_current[i].maddr, type);
+    for (i = 0; i < SLAB_BUCKET_ENTRIES; i++) {
+        se = &sb->sb_entries[i];
 
-        if (so->so_current[i].maddr != so->so_snapshot[i].maddr) {
-            atomic_set(&so->so_snapshot[i].laddr, so->so_current[i].laddr);
-            page_allocator_freepages(cid, so->so_snapshot[i].maddr);
-            so->so_snapshot[i].maddr = so->so_current[i].maddr;
+        if (!SLAB_ENTRY_IS_INIT(se))
+            continue;
+
+        if (se->se_data.current.maddr != se->se_data.snapshot.maddr)
+            Func_slab_entry_commit(cid, se);
+
+        if (se->se_ptr.current.maddr != se->se_ptr.snapshot.maddr) {
+            slab_ptr_release_snapshot(cid, se);
+            se->se_ptr.snapshot.idx = se->se_ptr.current.idx;
+            se->se_ptr.snapshot.size = se->se_ptr.current.size;
+            atomic_set_nofence(&se->se_ptr.snapshot.laddr, se->se_ptr.current.laddr);
+            se->se_ptr.snapshot.maddr = se->se_ptr.current.maddr;
         }
+
+        /* the snapshot is gone, so an empty entry can be reused */
+        if (SLAB_ENTRY_EMPTY(se))
+            slab_entry_release(cid, se);
     }
+
 }
 
+/*
+ * Commit the nodes of the dirty set, from the bottom of the tree up: the
+ * slab_entry(s) of the slab_bucket(s) first, then the pointers to the
+ * slab_bucket(s), to the slab_inner(s) and to the slab_outer(s). Only the
+ * nodes that changed since the last checkpoint are visited. The updates of a
+ * level are flushed together and made durable by one fence, before the next
+ * level starts.
+ */
 static void slab_dir_cpoint(unsigned int cid, struct slab_dir *sd, int type)
 {
-    int i;
+    struct slab_bucket *sb;
+    struct slab_inner *si;
+    struct slab_outer *so;
+    int i, idx;
+
+    for (i = 0; i < VECTOR_SIZE(&SLAB_DIRTY.buckets); i++) {
+        sb = VECTOR_AT(&SLAB_DIRTY.buckets, i);
+        slab_bucket_cpoint(cid, sb, type);
+    }
+    flush_fence();
+
+    for (i = 0; i < VECTOR_SIZE(&SLAB_DIRTY.buckets); i++) {
+        sb = VECTOR_AT(&SLAB_DIRTY.buckets, i);
+        si = slab_bucket_inner(cid, sb, &idx);
+        assert(sb->sb_has_snapshot && si->si_current[idx].maddr == sb && "Invalid dirty slab_bucket");
+
+        atomic_set_nofence(&si->si_snapshot[idx].laddr, si->si_current[idx].laddr);
+        slab_retire_pages(si->si_snapshot[idx].maddr, PAGE_SIZE);
+        si->si_snapshot[idx].maddr = si->si_current[idx].maddr;
+
+        sb->sb_has_snapshot = 0;
+    }
+    flush_fence();
+
+    for (i = 0; i < VECTOR_SIZE(&SLAB_DIRTY.inners); i++) {
+        so = sd->sd_current[VECTOR_AT(&SLAB_DIRTY.inners, i) / SLAB_OUTER_ENTRIES].maddr;
+        idx = VECTOR_AT(&SLAB_DIRTY.inners, i) % SLAB_OUTER_ENTRIES;
+
+        if (so->so_current[idx].maddr != so->so_snapshot[idx].maddr) {
+            atomic_set_nofence(&so->so_snapshot[idx].laddr, so->so_current[idx].laddr);
+            slab_retire_pages(so->so_snapshot[idx].maddr, PAGE_SIZE);
+            so->so_snapshot[idx].maddr = so->so_current[idx].maddr;
+        }
+    }
+    flush_fence();
 
-    for (i = 0; i < sd->sd_index; i++) {
-        slab_outer_cpoint(cid, sd->sd_current[i].maddr, type);
+    for (i = 0; i < VECTOR_SIZE(&SLAB_DIRTY.outers); i++) {
+        idx = VECTOR_AT(&SLAB_DIRTY.outers, i);
 
-        if (sd->sd_current[i].maddr != sd->sd_snapshot[i].maddr) {
-            atomic_set(&sd->sd_snapshot[i].laddr, sd->sd_current[i].laddr);
-            page_allocator_freepages(cid, sd->sd_snapshot[i].maddr);
-            sd->sd_snapshot[i].maddr = sd->sd_current[i].maddr;
+        if (sd->sd_current[idx].maddr != sd->sd_snapshot[idx].maddr) {
+            atomic_set_nofence(&sd->sd_snapshot[idx].laddr, sd->sd_current[idx].laddr);
+            slab_retire_pages(sd->sd_snapshot[idx].maddr, PAGE_SIZE);
+            sd->sd_snapshot[idx].maddr = sd->sd_current[idx].maddr;
         }
     }
+    flush_fence();
+
+    VECTOR_FREE(&SLAB_DIRTY.buckets);
+    VECTOR_FREE(&SLAB_DIRTY.inners);
+    VECTOR_FREE(&SLAB_DIRTY.outers);
 }
 
 void slab_cpoint(unsigned int cid, int type)
 {
     struct slab_dir *sd;
+    struct slab_entry *se = NULL;
     sd = get_container(cid)->current_slab.maddr;
+
+    slab_lock(cid);
+    slab_cache_drain(cid);
+    Func_slab_collect_dirty(cid);
+
+    for (int i = 0; i < VECTOR_SIZE(&sd->sd_vector); ++i)
+        slab_update_pointers(cid, VECTOR_AT(&sd->sd_vector, i));
+    slab_ptr_commit(cid);
+
     slab_dir_cpoint(cid, sd, type);
 
+    /* the next write to a committed page must fault, so this cannot wait */
+    if (type == CPOINT_REGULAR || type == CPOINT_ASYNC)
+        slab_protect_modified(cid, sd);
+
     //TODO: here we need to flush both data and metadata pages
-    struct slab_entry *se = NULL;
     for (int i = 0; i < VECTOR_SIZE(&sd->sd_vector); ++i) {
         se = VECTOR_AT(&sd->sd_vector, i);
-        flush_memsegment(se->se_data.current.maddr, PAGE_SIZE, 0);
+        if (!SLAB_ENTRY_IS_INIT(se))
+            continue;
+        flush_memsegment(se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se), 0);
     }
+    flush_fence();
     VECTOR_FREE(&sd->sd_vector);
+    if (type == CPOINT_ASYNC)
+        slab_free_retired_async(cid);
+    else
+        slab_free_retired(cid);
+    slab_unlock(cid);
 }
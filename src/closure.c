@@ -1,7 +1,10 @@
 #include <utils/macros.h>
-#include <utils/tree.h>
 #include <utils/vector.h>
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "cont.h"
 #include "closure.h"
@@ -9,9 +12,19 @@
 #include "slab.h"
 #include "slabInt.h"
 #include "atomics.h"
+#include "out.h"
 
 #define PTR_REBASE(base, ploc, newbase) ((newbase) + ((ploc) - (base)))
 
+/* most threads used to compute the closure, and fewest items per thread */
+#define CLOSURE_MAX_THREADS     64
+#define CLOSURE_MIN_ITEMS       4096
+
+/* most allocations a thread takes from another at once */
+#define REACH_STEAL_MAX         256
+
+int CLOSURE_THREADS = 0;    ///< PMLIB_CLOSURE_THREADS, 0 for one per online CPU
+
 //TODO: keep track of some statistics
 struct closure_stats {
     uint64_t mallocat;
@@ -20,7 +33,7 @@ struct closure_stats {
 
 /*
  * 1. init subsystem
- * 2. build tree of mallocat
+ * 2. build the index of mallocat
  * 3. classify the pointers
  *      a. part of malloc
  *      b. persistent
@@ -28,6 +41,7 @@ struct closure_stats {
  * 4. walk the vector of persistent pointers and start moving allocations to PM
  * 5. walk the dirty slab_entries and check the target of their pptrs
  * 6. fix back-reference pointers, which are the ones left in the hashtable
+ * 7. free the index of mallocat
  *
  */
 
@@ -35,14 +49,39 @@ struct mallocat_entry {
     void *addr; //< original volatile address of the allocation
     size_t size; //< size of the allocation
     void *paddr; //< if not NULL, it points to the new persistent address
-    SPLAY_ENTRY(mallocat_entry) splay;
-    VECTOR_DECL(mallocat_pointers, void*) ptrs;
+    uint32_t first; //< first pointer located in the allocation (in mallocat_index.ptrs)
+    uint32_t nptrs; //< number of pointers located in the allocation
 };
 
+struct mallocat_ptr {
+    void **ptr_loc;
+    uint32_t entry;
+};
+
+VECTOR_DECL(mallocat_ptr_vector, struct mallocat_ptr);
+VECTOR_DECL(closure_ptr_vector, void*);
+
+/*
+ * The registered allocations are indexed once per checkpoint, in arrays
+ * sorted by address. Lookups search the array of start addresses, which is
+ * 8 bytes per allocation. The pointers located in the allocations are found
+ * by classify_pointers and grouped by allocation.
+ */
+static struct {
+    uintptr_t *addrs;
+    struct mallocat_entry *entries;
+    uint64_t count;
+    void **ptrs;
+    uint32_t *targets;  ///< the allocation each of ptrs points to, or MALLOCAT_NONE
+} mallocat_index;
+
+#define MALLOCAT_NONE   UINT32_MAX
+
 struct htable *ht_pointerat = NULL;
 struct htable *ht_mallocat = NULL;
+/* serializes the registration of pointers and allocations from many threads */
+static pthread_mutex_t closure_lock = PTHREAD_MUTEX_INITIALIZER;
 VECTOR_DECL(struct_pptr_vec, void*) pptr_vec;
-SPLAY_HEAD(mallocat_tree, mallocat_entry) mallocat_tree = SPLAY_INITIALIZER();
 
 void pointerat_aux(unsigned int cid, void **ptr_loc)
 {
@@ -55,79 +94,205 @@ void pointerat_aux(unsigned int cid, void **ptr_loc)
     pat->ptr_loc = ptr_loc;
     STAILQ_INSERT_TAIL(&cont->ptrat_head, pat, list);
 #endif
+    pthread_mutex_lock(&closure_lock);
     htable_insert(ht_pointerat, ptr_loc, ptr_loc);
+    pthread_mutex_unlock(&closure_lock);
 }
 
 void mallocat(void* addr, size_t size)
 {
-#if 0
-    struct mallocat_entry key = { .addr = addr };
-    struct mallocat_entry *e;
-
-    // check for duplicates
-    e = SPLAY_FIND(mallocat_tree, &mallocat_tree, &key);
-    if (e) {
-    } else {
-        e = mallocat_entry_alloc(addr, size);
-        SPLAY_INSERT(mallocat_tree, &mallocat_tree, e);
-    }
-#endif
     assert(addr && "registering a failed memory allocation");
+    pthread_mutex_lock(&closure_lock);
     htable_insert(ht_mallocat, addr, itop(size));
+    pthread_mutex_unlock(&closure_lock);
 }
 
+/*
+ * Free an allocation. If addr was registered with mallocat, we just forget
+ * about it and the caller frees it. Otherwise, addr must be an object in the
+ * container.
+ */
 void freeat(void *addr)
 {
-    handle_error("not implemented yet");
+    pthread_mutex_lock(&closure_lock);
+    void *size = htable_remove(ht_mallocat, addr);
+    pthread_mutex_unlock(&closure_lock);
+    if (size)
+        return;
+
+    //TODO: add support for multiple containers
+    slab_pfree(0, addr);
 }
 
-int mallocat_entry_cpm(struct mallocat_entry *a, struct mallocat_entry *b)
+static void add_mallocat_entry_callback(void *key, void *val, void *param)
 {
-    return (a->addr < b->addr) ?
-            -1 :
-            a->addr >= (b->addr + b->size);
+    struct mallocat_entry *e = &mallocat_index.entries[mallocat_index.count++];
+
+    e->addr = key;
+    e->size = ptoi(val);
+    e->paddr = NULL;
+    e->first = e->nptrs = 0;
 }
 
-SPLAY_PROTOTYPE(mallocat_tree, mallocat_entry, splay, mallocat_entry_cpm);
-SPLAY_GENERATE(mallocat_tree, mallocat_entry, splay, mallocat_entry_cpm);
+/*
+ * LSD radix sort of the entries by address, a byte at a time. The bytes
+ * shared by all the addresses (most of the high ones) are skipped.
+ */
+static void sort_mallocat_index()
+{
+    uint64_t n = mallocat_index.count;
+    struct mallocat_entry *src = mallocat_index.entries, *dst, *tmp;
+    uint64_t counts[8][256] = { { 0 } };
+    uint64_t sum, cnt;
+    int byte;
+
+    for (uint64_t i = 0; i < n; i++) {
+        for (byte = 0; byte < 8; byte++)
+            counts[byte][(ptoi(src[i].addr) >> (byte * 8)) & 0xff]++;
+    }
+
+    dst = malloc(n * sizeof(*dst));
+    assert(dst && "failed to allocate memory to sort the mallocat index");
+
+    for (byte = 0; byte < 8; byte++) {
+        if (counts[byte][(ptoi(src[0].addr) >> (byte * 8)) & 0xff] == n)
+            continue;
+
+        sum = 0;
+        for (int c = 0; c < 256; c++) {
+            cnt = counts[byte][c];
+            counts[byte][c] = sum;
+            sum += cnt;
+        }
+        for (uint64_t i = 0; i < n; i++)
+            dst[counts[byte][(ptoi(src[i].addr) >> (byte * 8)) & 0xff]++] = src[i];
 
-static struct mallocat_entry *mallocat_entry_alloc(void *addr, size_t size)
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    free(dst);
+    mallocat_index.entries = src;
+}
+
+/**
+ * Build the index of the registered volatile allocations. The hashtable
+ * guarantees that there are not duplicate entries
+ */
+void build_mallocat_index()
 {
-    struct mallocat_entry *e;
-    e = malloc(sizeof(*e));
-    assert(e && "failed to allocate mallocat_entry");
+    uint64_t n = htable_size(ht_mallocat);
+
+    mallocat_index.count = 0;
+    mallocat_index.entries = NULL;
+    mallocat_index.addrs = NULL;
+    mallocat_index.ptrs = NULL;
+    mallocat_index.targets = NULL;
+    if (n == 0)
+        return;
 
-    e->addr = addr;
-    e->size = size;
-    e->paddr = NULL;
-    VECTOR_INIT(&e->ptrs);
+    mallocat_index.entries = malloc(n * sizeof(struct mallocat_entry));
+    mallocat_index.addrs = malloc(n * sizeof(uintptr_t));
+    assert(mallocat_index.entries && mallocat_index.addrs && "failed to allocate the mallocat index");
 
-    return e;
+    htable_foreach(ht_mallocat, add_mallocat_entry_callback, NULL);
+    sort_mallocat_index();
+    for (uint64_t i = 0; i < n; i++)
+        mallocat_index.addrs[i] = ptoi(mallocat_index.entries[i].addr);
 }
 
-static void init_mallocat_tree_callback(void *key, void *val, void *_not_use_)
+void free_mallocat_index()
 {
-    void *addr = key;
-    size_t size = ptoi(val);
-    struct mallocat_entry *e = mallocat_entry_alloc(addr, size);
-    SPLAY_INSERT(mallocat_tree, &mallocat_tree, e);
+    free(mallocat_index.addrs);
+    free(mallocat_index.entries);
+    free(mallocat_index.ptrs);
+    free(mallocat_index.targets);
+    memset(&mallocat_index, 0, sizeof(mallocat_index));
 }
 
-/**
- * Create a mallocat_entry for every element of the mallocat hashtable.
- * The hashtable guarantees that there are not duplicate entries
+/*
+ * Return the allocation that contains addr, or NULL. The binary search
+ * finds the last allocation that starts at or before addr, and its
+ * comparison compiles to a conditional move.
  */
-void build_mallocat_tree()
+static struct mallocat_entry *find_mallocat_entry(void *addr)
 {
-    htable_foreach(ht_mallocat, init_mallocat_tree_callback, NULL);
+    const uintptr_t *base = mallocat_index.addrs;
+    uint64_t n = mallocat_index.count, half;
+    struct mallocat_entry *e;
+
+    if (n == 0 || ptoi(addr) < base[0])
+        return NULL;
+
+    while (n > 1) {
+        half = n / 2;
+        base = (base[half] <= ptoi(addr)) ? base + half : base;
+        n -= half;
+    }
+
+    e = &mallocat_index.entries[base - mallocat_index.addrs];
+    return addr < e->addr + e->size ? e : NULL;
 }
 
-void empty_mallocat_tree()
+/*
+ * The steps of the closure run on up to CLOSURE_THREADS threads. Each step
+ * splits its work in parts, one per thread, and the results of the parts are
+ * merged in the order of the parts. Volatile allocations are moved to the
+ * container in the order of their addresses, so the closure is the same
+ * whatever the number of threads.
+ */
+static int closure_nthreads(uint64_t n)
 {
-    while (SPLAY_EMPTY(&mallocat_tree)) {
-        struct mallocat_entry *root = SPLAY_ROOT(&mallocat_tree);
-        SPLAY_REMOVE(mallocat_tree, &mallocat_tree, root);
+    int nthreads = CLOSURE_THREADS ? CLOSURE_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+    return MAX(MIN(nthreads, MIN(CLOSURE_MAX_THREADS, n / CLOSURE_MIN_ITEMS)), 1);
+}
+
+struct closure_job {
+    void (*fun)(void *arg, int part);
+    void *arg;
+    int part;
+};
+
+static void *closure_worker(void *arg)
+{
+    struct closure_job *job = arg;
+    job->fun(job->arg, job->part);
+    return NULL;
+}
+
+/*
+ * Run fun(arg, part) for every part in [0, nparts), each on its own thread.
+ * The calling thread runs the first part, and the parts whose thread could
+ * not be started.
+ */
+static void closure_parallel(int nparts, void (*fun)(void *arg, int part), void *arg)
+{
+    struct closure_job jobs[CLOSURE_MAX_THREADS];
+    pthread_t tids[CLOSURE_MAX_THREADS];
+    int started[CLOSURE_MAX_THREADS] = { 0 };
+
+    for (int i = 1; i < nparts; i++) {
+        jobs[i] = (struct closure_job) { fun, arg, i };
+        started[i] = pthread_create(&tids[i], NULL, closure_worker, &jobs[i]) == 0;
     }
+
+    fun(arg, 0);
+
+    for (int i = 1; i < nparts; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            fun(arg, i);
+    }
+}
+
+/* the range [*first, *last) of the part-th of nparts parts of n items */
+static inline void closure_part_range(uint64_t n, int part, int nparts,
+                                      uint64_t *first, uint64_t *last)
+{
+    *first = n * part / nparts;
+    *last = n * (part + 1) / nparts;
 }
 
 /*
@@ -139,42 +304,147 @@ void empty_mallocat_tree()
  *      in the hashtable.
  *  Pointers that are classified as 2. are removed from the hashtable.
  */
-static int classify_pointers_callback(void *key, void *val, void *param)
+struct classify_part {
+    unsigned int cid;
+    int nparts;
+    struct mallocat_ptr_vector found;
+    struct closure_ptr_vector pptrs;
+    struct closure_ptr_vector removed;
+};
+
+static void classify_pointers_callback(void *key, void *val, void *param)
 {
+    struct classify_part *cp = param;
     void **ptr_loc = (void**)key;
-    uint32_t cid = (uint32_t)param;
 
     /*
      * first check on the volatile allocations, but don't remove because this
      * may be a back reference. This pointer can be remove once the allocation
      * it belongs to has been moved to the continaer
      */
-    struct mallocat_entry k = { .addr = ptr_loc };
-    struct mallocat_entry *e = SPLAY_FIND(mallocat_tree, &mallocat_tree, &k);
+    struct mallocat_entry *e = find_mallocat_entry(ptr_loc);
     if (e) {
-        VECTOR_APPEND(&e->ptrs, ptr_loc);
-        return 0;
+        struct mallocat_ptr mp = { ptr_loc, e - mallocat_index.entries };
+        VECTOR_APPEND(&cp->found, mp);
+        return;
     }
 
     /* second on the persistent data pages */
     struct slab_entry *se;
-    if ((se = slab_find(cid, ptr_loc))) {
+    if ((se = slab_find(cp->cid, ptr_loc))) {
+        VECTOR_APPEND(&cp->removed, ptr_loc);
+
+        /* the object holding this pointer has been freed */
+        if (!slab_entry_is_allocated(se, ptr_loc))
+            return;
+
         /*
          * these ptrs don't have a persistent target yet, so they cannot be
          * to the slab_ptr just yet. We do that after we move all volatile
          * allocations
          */
-        VECTOR_APPEND(&pptr_vec, ptr_loc);
-        return 1;
+        VECTOR_APPEND(&cp->pptrs, ptr_loc);
+        return;
     }
 
     /* most likely this is back reference pointer which needs fixing later */
-    return 0;
 }
 
+static void classify_part(void *arg, int part)
+{
+    struct classify_part *cp = &((struct classify_part*) arg)[part];
+
+    VECTOR_INIT(&cp->found);
+    VECTOR_INIT(&cp->pptrs);
+    VECTOR_INIT(&cp->removed);
+    htable_foreach_part(ht_pointerat, part, cp->nparts, classify_pointers_callback, cp);
+}
+
+static int cmp_pointers(const void *a, const void *b)
+{
+    uintptr_t pa = ptoi(*(void**) a), pb = ptoi(*(void**) b);
+    return (pa > pb) - (pa < pb);
+}
+
+static void sort_pointers(void **ptrs, uint32_t n)
+{
+    void *ptr;
+    uint32_t j;
+
+    if (n > 16) {
+        qsort(ptrs, n, sizeof(*ptrs), cmp_pointers);
+        return;
+    }
+
+    for (uint32_t i = 1; i < n; i++) {
+        ptr = ptrs[i];
+        for (j = i; j > 0 && ptrs[j - 1] > ptr; j--)
+            ptrs[j] = ptrs[j - 1];
+        ptrs[j] = ptr;
+    }
+}
+
+/*
+ * The hashtable is split in parts that are classified in parallel. The
+ * pointers found in volatile allocations are then grouped by allocation with
+ * a counting sort
+ */
 void classify_pointers(unsigned int cid)
 {
-    htable_filter(ht_pointerat, classify_pointers_callback, itop(cid));
+    int nparts = closure_nthreads(htable_size(ht_pointerat));
+    struct classify_part parts[CLOSURE_MAX_THREADS];
+    struct mallocat_entry *e;
+    struct mallocat_ptr mp;
+    uint64_t nfound = 0;
+    uint32_t first = 0;
+    void *ptr_loc;
+    int i;
+
+    LOG(4, "Classifying %u pointer(s) with %d thread(s)", htable_size(ht_pointerat), nparts);
+
+    for (int p = 0; p < nparts; p++) {
+        parts[p].cid = cid;
+        parts[p].nparts = nparts;
+    }
+    closure_parallel(nparts, classify_part, parts);
+
+    for (int p = 0; p < nparts; p++) {
+        VECTOR_FOREACH(&parts[p].removed, ptr_loc, i)
+            htable_remove(ht_pointerat, ptr_loc);
+        VECTOR_FOREACH(&parts[p].pptrs, ptr_loc, i)
+            VECTOR_APPEND(&pptr_vec, ptr_loc);
+        VECTOR_FOREACH(&parts[p].found, mp, i)
+            mallocat_index.entries[mp.entry].nptrs++;
+        nfound += VECTOR_SIZE(&parts[p].found);
+        VECTOR_FREE(&parts[p].removed);
+        VECTOR_FREE(&parts[p].pptrs);
+    }
+
+    if (nfound) {
+        mallocat_index.ptrs = malloc(nfound * sizeof(void*));
+        mallocat_index.targets = malloc(nfound * sizeof(uint32_t));
+        assert(mallocat_index.ptrs && mallocat_index.targets &&
+               "failed to allocate the pointers of the mallocat index");
+    }
+
+    for (e = mallocat_index.entries; e < mallocat_index.entries + mallocat_index.count; e++) {
+        e->first = first;
+        first += e->nptrs;
+        e->nptrs = 0;
+    }
+    for (int p = 0; p < nparts; p++) {
+        VECTOR_FOREACH(&parts[p].found, mp, i) {
+            e = &mallocat_index.entries[mp.entry];
+            mallocat_index.ptrs[e->first + e->nptrs++] = mp.ptr_loc;
+        }
+        VECTOR_FREE(&parts[p].found);
+    }
+
+    /* the pointers of an allocation are kept in the order of their location */
+    for (e = mallocat_index.entries; e < mallocat_index.entries + mallocat_index.count; e++) {
+        if (e->nptrs > 1)
+            sort_pointers(&mallocat_index.ptrs[e->first], e->nptrs);
+    }
 }
 
 /*
@@ -182,54 +452,287 @@ void classify_pointers(unsigned int cid)
  * registered volatile allocation, move the allocations to the container.
  *
  * Multiple persistent pointer may target the same allocation (e.g. mutile
- * objects pointing to the same object), but the allocation is moved only once
- * with the first of these pointers. Then all pointers are updated to point to
- * the new address in the container.
+ * objects pointing to the same object), but the allocation is moved only once.
+ * Then all pointers are updated to point to the new address in the container.
  *
- * If the allocation has pointers associated with it, then add the pointers to
- * the vector of persistent pointer to continue the discovery.
+ * The allocations are moved in four steps:
+ *  a) the allocations reachable from the persistent pointers are found by
+ *     threads that take the allocations to visit from each other when they
+ *     run out of them. The target of every pointer is kept.
+ *  b) the reachable allocations are put in the order of a depth-first walk
+ *     from the persistent pointers, which only follows the kept targets.
+ *  c) the allocations of the same size get their persistent addresses at
+ *     once, in that order, so the objects that point to each other are next
+ *     to each other.
+ *  d) the pointers of the allocations are updated and the allocations are
+ *     copied to the container with non-temporal stores, by parts.
  */
-static void persist_valloc(unsigned int cid, void **ptr_loc)
+/* the persistent pointers the reachable allocations are found from */
+struct closure_roots {
+    unsigned int cid;
+    struct closure_ptr_vector ptrs;
+};
+
+struct reach_stack {
+    pthread_mutex_t lock;
+    VECTOR_DECL(reach_entry_vector, uint32_t) entries;
+};
+
+struct reach_job {
+    int nparts;
+    uint64_t pending;           ///< allocations pushed but not visited yet
+    uint8_t *reached;           ///< set once an allocation has been pushed
+    struct closure_roots *roots;
+    uint32_t *root_targets;     ///< the allocation each root points to, or MALLOCAT_NONE
+    struct reach_stack stacks[CLOSURE_MAX_THREADS];
+};
+
+/* return the allocation addr points to, which is pushed the first time */
+static uint32_t reach_push(struct reach_job *job, int part, void *addr)
 {
-    struct mallocat_entry key = { .addr = *ptr_loc };
-    struct mallocat_entry *e = SPLAY_FIND(mallocat_tree, &mallocat_tree, &key);
+    struct mallocat_entry *e = find_mallocat_entry(addr);
+    struct reach_stack *s = &job->stacks[part];
+    uint32_t idx;
 
-    if (e) {
-        if (!e->paddr) {
-            /* now we move this allocation to the container */
-            e->paddr = container_palloc(cid, e->size);
-            pmemcpy(e->paddr, e->addr, e->size);
-            free(e->addr);
-
-            /* now we move every pointer to the vector of persistent ptrs */
-            void *ptr; int i;
-            VECTOR_FOREACH(&e->ptrs, ptr, i) {
-                VECTOR_APPEND(&pptr_vec, PTR_REBASE(e->addr, ptr, e->paddr));
-                htable_remove(ht_pointerat, ptr);
+    if (!e)
+        return MALLOCAT_NONE;
+
+    idx = e - mallocat_index.entries;
+    if (job->reached[idx] || !__sync_bool_compare_and_swap(&job->reached[idx], 0, 1))
+        return idx;
+
+    __sync_fetch_and_add(&job->pending, 1);
+    pthread_mutex_lock(&s->lock);
+    VECTOR_APPEND(&s->entries, idx);
+    pthread_mutex_unlock(&s->lock);
+
+    return idx;
+}
+
+static int reach_pop(struct reach_stack *s, uint32_t *idx)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (VECTOR_SIZE(&s->entries)) {
+        *idx = VECTOR_AT(&s->entries, --VECTOR_SIZE(&s->entries));
+        ret = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* take half of the allocations of another thread, up to REACH_STEAL_MAX */
+static int reach_steal(struct reach_job *job, int part, uint32_t *idx)
+{
+    struct reach_stack *s, *own = &job->stacks[part];
+    uint32_t stolen[REACH_STEAL_MAX];
+    int n = 0;
+
+    for (int i = 1; i < job->nparts && n == 0; i++) {
+        s = &job->stacks[(part + i) % job->nparts];
+        pthread_mutex_lock(&s->lock);
+        n = MIN((VECTOR_SIZE(&s->entries) + 1) / 2, REACH_STEAL_MAX);
+        VECTOR_SIZE(&s->entries) -= n;
+        memcpy(stolen, &VECTOR_AT(&s->entries, VECTOR_SIZE(&s->entries)), n * sizeof(stolen[0]));
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (n == 0)
+        return 0;
+
+    pthread_mutex_lock(&own->lock);
+    for (int i = 0; i < n - 1; i++)
+        VECTOR_APPEND(&own->entries, stolen[i]);
+    pthread_mutex_unlock(&own->lock);
+
+    *idx = stolen[n - 1];
+    return 1;
+}
+
+static void reach_roots_part(void *arg, int part)
+{
+    struct reach_job *job = arg;
+    uint64_t first, last;
+
+    closure_part_range(VECTOR_SIZE(&job->roots->ptrs), part, job->nparts, &first, &last);
+    for (uint64_t i = first; i < last; i++)
+        job->root_targets[i] = reach_push(job, part, *(void**) VECTOR_AT(&job->roots->ptrs, i));
+}
+
+static void reach_part(void *arg, int part)
+{
+    struct reach_job *job = arg;
+    struct mallocat_entry *e;
+    uint32_t idx;
+
+    while (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE)) {
+        if (!reach_pop(&job->stacks[part], &idx) && !reach_steal(job, part, &idx)) {
+            sched_yield();
+            continue;
+        }
+
+        e = &mallocat_index.entries[idx];
+        for (uint32_t i = e->first; i < e->first + e->nptrs; i++)
+            mallocat_index.targets[i] = reach_push(job, part, *(void**) mallocat_index.ptrs[i]);
+
+        __sync_fetch_and_sub(&job->pending, 1);
+    }
+}
+
+/*
+ * Put the reachable allocations in the order of a depth-first walk from the
+ * roots. Return the number of allocations in order.
+ */
+static uint64_t reach_order(struct reach_job *job, uint32_t *order)
+{
+    VECTOR_DECL(reach_order_vector, uint32_t) stack;
+    struct mallocat_entry *e;
+    uint32_t idx, target;
+    uint64_t n = 0;
+
+    VECTOR_INIT(&stack);
+
+    for (uint64_t r = 0; r < VECTOR_SIZE(&job->roots->ptrs); r++) {
+        if (job->root_targets[r] == MALLOCAT_NONE)
+            continue;
+
+        VECTOR_APPEND(&stack, job->root_targets[r]);
+        while (VECTOR_SIZE(&stack)) {
+            idx = VECTOR_AT(&stack, --VECTOR_SIZE(&stack));
+            if (job->reached[idx] != 1)
+                continue;
+
+            job->reached[idx] = 2;
+            order[n++] = idx;
+
+            /* the first pointer of the allocation is visited first */
+            e = &mallocat_index.entries[idx];
+            for (uint32_t i = e->first + e->nptrs; i > e->first; i--) {
+                target = mallocat_index.targets[i - 1];
+                if (target != MALLOCAT_NONE && job->reached[target] == 1)
+                    VECTOR_APPEND(&stack, target);
             }
         }
-        /* update the targe of the pointer */
-        *ptr_loc = PTR_REBASE(e->addr, *ptr_loc, e->paddr);
-    } else {
-        /**
-         * the target of this persistent pointer is not a registered
-         * volatile allocation, so nothing needs to be done
-         */
     }
+
+    VECTOR_FREE(&stack);
+    return n;
 }
 
-static void move_volatile_allocations_callback(struct slab_entry *se_loc, void *param)
+/* allocations up to a page are grouped by size, bigger ones are not */
+#define PLACE_CLASSES           (PAGE_SIZE / 8 + 2)
+#define PLACE_CLASS(size)       ((size) <= PAGE_SIZE ? ROUND8(size) / 8 : PLACE_CLASSES - 1)
+
+/*
+ * Give the allocations their persistent addresses. The allocations of each
+ * size are allocated at once, in the order they have in order.
+ */
+static void place_allocations(unsigned int cid, uint32_t *order, uint64_t n)
 {
-    struct slab_ptr *sp = se_loc->se_ptr.current.maddr;
-    struct slab_entry *se_val;
-    unsigned int cid = ptoi(param);
+    uint32_t *sorted = malloc(n * sizeof(*sorted));
+    void **maddrs = malloc(n * sizeof(*maddrs));
+    uint64_t counts[PLACE_CLASSES + 1] = { 0 };
+    struct mallocat_entry *e;
 
-    for (int i = 0; i < se_loc->se_ptr.current.idx; i++) {
-        void **ptr_loc = se_loc->se_data.current.maddr + sp->ptrs[i].ploc_offset;
-        persist_valloc(cid, ptr_loc);
+    assert(sorted && maddrs && "failed to allocate memory to place the allocations");
+
+    for (uint64_t i = 0; i < n; i++)
+        counts[PLACE_CLASS(mallocat_index.entries[order[i]].size) + 1]++;
+    for (int c = 1; c <= PLACE_CLASSES; c++)
+        counts[c] += counts[c - 1];
+    for (uint64_t i = 0; i < n; i++)
+        sorted[counts[PLACE_CLASS(mallocat_index.entries[order[i]].size)]++] = order[i];
+
+    /* counts[c] is now the end of class c */
+    for (int c = 0; c < PLACE_CLASSES; c++) {
+        uint64_t first = c ? counts[c - 1] : 0;
+
+        if (first == counts[c])
+            continue;
+
+        if (c == PLACE_CLASSES - 1) {
+            for (uint64_t i = first; i < counts[c]; i++)
+                maddrs[i] = container_palloc(cid, mallocat_index.entries[sorted[i]].size);
+        } else {
+            slab_palloc_bulk(cid, c * 8, counts[c] - first, &maddrs[first]);
+        }
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        e = &mallocat_index.entries[sorted[i]];
+        e->paddr = maddrs[i];
+    }
+
+    free(sorted);
+    free(maddrs);
+}
+
+static inline void rebase_target(void **ptr_loc, uint32_t target)
+{
+    struct mallocat_entry *e;
+
+    if (target != MALLOCAT_NONE) {
+        e = &mallocat_index.entries[target];
+        *ptr_loc = PTR_REBASE(e->addr, *ptr_loc, e->paddr);
     }
 }
 
+struct move_job {
+    int nparts;
+    struct closure_roots *roots;
+    uint32_t *root_targets;
+    uint32_t *order;
+    uint64_t norder;
+};
+
+/*
+ * The pointers of an allocation are updated before it is copied, so the
+ * copy is written once
+ */
+static void move_part(void *arg, int part)
+{
+    struct move_job *job = arg;
+    struct mallocat_entry *e;
+    uint64_t first, last;
+
+    closure_part_range(job->norder, part, job->nparts, &first, &last);
+    for (uint64_t i = first; i < last; i++) {
+        e = &mallocat_index.entries[job->order[i]];
+        for (uint32_t j = e->first; j < e->first + e->nptrs; j++)
+            rebase_target(mallocat_index.ptrs[j], mallocat_index.targets[j]);
+        pmemcpy_nt(e->paddr, e->addr, e->size);
+        free(e->addr);
+    }
+    store_fence();
+
+    closure_part_range(VECTOR_SIZE(&job->roots->ptrs), part, job->nparts, &first, &last);
+    for (uint64_t i = first; i < last; i++)
+        rebase_target(VECTOR_AT(&job->roots->ptrs, i), job->root_targets[i]);
+}
+
+static void add_root(void **ptr_loc, void *param)
+{
+    struct closure_roots *roots = param;
+    VECTOR_APPEND(&roots->ptrs, ptr_loc);
+}
+
+static void add_snapshot_roots(struct slab_entry *se_loc, void *param)
+{
+    struct closure_roots *roots = param;
+    struct slab_ptr_iter it;
+    struct slab_ptr *sp;
+
+    slab_ptr_iter_init(&it, se_loc);
+    while ((sp = slab_ptr_next(&it)))
+        add_root(se_loc->se_data.current.maddr + sp->ploc_offset, roots);
+
+    /* the pointers of typed objects are not registered */
+    if (se_loc->se_data.current.type)
+        slab_type_foreach_ptr(roots->cid, se_loc, se_loc->se_data.current.maddr, add_root, roots);
+}
+
 /*
  * Check the target of every persistent ptr and if it falls within a registered
  * volatile allocation, move the allocation and its ptrs to the container
@@ -242,16 +745,67 @@ static void move_volatile_allocations_callback(struct slab_entry *se_loc, void *
  */
 void move_volatile_allocations(unsigned int cid)
 {
+    struct closure_roots roots = { .cid = cid };
+    struct move_job mjob = { .roots = &roots };
+    struct reach_job *job;
+    struct mallocat_entry *e;
     void *ptr_loc;
+    int i;
 
-    for (int i = 0; i < VECTOR_SIZE(&pptr_vec); i++) {
-        ptr_loc = VECTOR_AT(&pptr_vec, i);
-        persist_valloc(cid, ptr_loc);
-        slab_insert_pointer(cid, ptr_loc);
+    VECTOR_INIT(&roots.ptrs);
+    for (i = 0; i < VECTOR_SIZE(&pptr_vec); i++)
+        VECTOR_APPEND(&roots.ptrs, VECTOR_AT(&pptr_vec, i));
+    slab_foreach_snapshot_entry(cid, add_snapshot_roots, &roots);
+
+    if (mallocat_index.count) {
+        job = calloc(1, sizeof(*job) + mallocat_index.count);
+        mjob.root_targets = malloc(MAX(VECTOR_SIZE(&roots.ptrs), 1) * sizeof(uint32_t));
+        mjob.order = malloc(mallocat_index.count * sizeof(uint32_t));
+        assert(job && mjob.root_targets && mjob.order &&
+               "failed to allocate memory to find the reachable allocations");
+        job->nparts = closure_nthreads(mallocat_index.count);
+        job->reached = (uint8_t*) (job + 1);
+        job->roots = &roots;
+        job->root_targets = mjob.root_targets;
+        for (int p = 0; p < job->nparts; p++) {
+            pthread_mutex_init(&job->stacks[p].lock, NULL);
+            VECTOR_INIT(&job->stacks[p].entries);
+        }
+
+        LOG(4, "Finding the reachable allocations with %d thread(s)", job->nparts);
+        closure_parallel(job->nparts, reach_roots_part, job);
+        closure_parallel(job->nparts, reach_part, job);
+        mjob.norder = reach_order(job, mjob.order);
+
+        for (int p = 0; p < job->nparts; p++) {
+            pthread_mutex_destroy(&job->stacks[p].lock);
+            VECTOR_FREE(&job->stacks[p].entries);
+        }
+        mjob.nparts = job->nparts;
+        free(job);
+
+        LOG(4, "Moving %lu allocation(s) to the container", mjob.norder);
+        place_allocations(cid, mjob.order, mjob.norder);
+        closure_parallel(mjob.nparts, move_part, &mjob);
+        free(mjob.root_targets);
     }
-    VECTOR_FREE(&pptr_vec);
 
-    slab_foreach_snapshot_entry(cid, move_volatile_allocations_callback, itop(cid));
+    /* the slab_ptr(s) are stored once the pointers have their persistent target */
+    for (i = 0; i < VECTOR_SIZE(&pptr_vec); i++)
+        slab_insert_pointer(cid, VECTOR_AT(&pptr_vec, i));
+    VECTOR_FREE(&pptr_vec);
+    VECTOR_FREE(&roots.ptrs);
+
+    for (uint64_t k = 0; k < mjob.norder; k++) {
+        e = &mallocat_index.entries[mjob.order[k]];
+        htable_remove(ht_mallocat, e->addr);
+        for (uint32_t i = e->first; i < e->first + e->nptrs; i++) {
+            ptr_loc = mallocat_index.ptrs[i];
+            slab_insert_pointer(cid, PTR_REBASE(e->addr, ptr_loc, e->paddr));
+            htable_remove(ht_pointerat, ptr_loc);
+        }
+    }
+    free(mjob.order);
 }
 
 static void fix_back_references_callback(void *key, void *val, void *_not_use_)
@@ -261,18 +815,25 @@ static void fix_back_references_callback(void *key, void *val, void *_not_use_)
     if (*ptr_loc == NULL)
         return;
 
-    struct mallocat_entry k = { .addr = *ptr_loc };
-    struct mallocat_entry *e = SPLAY_FIND(mallocat_tree, &mallocat_tree, &k);
+    struct mallocat_entry *e = find_mallocat_entry(*ptr_loc);
     if (e) {
-        *ptr_loc = PTR_REBASE(e->addr, *ptr_loc, e->paddr);
+        /* the target may be a volatile allocation that was not moved */
+        if (e->paddr)
+            *ptr_loc = PTR_REBASE(e->addr, *ptr_loc, e->paddr);
     } else {
         printf("back-ref ptr: %p with unknown target %p\n", ptr_loc, *ptr_loc);
     }
 }
 
+static void fix_back_references_part(void *arg, int part)
+{
+    htable_foreach_part(ht_pointerat, part, ptoi(arg), fix_back_references_callback, NULL);
+}
+
 void fix_back_references()
 {
-    htable_foreach(ht_pointerat, fix_back_references_callback, NULL);
+    int nparts = closure_nthreads(htable_size(ht_pointerat));
+    closure_parallel(nparts, fix_back_references_part, itop(nparts));
 }
 
 void closure_init()
@@ -292,20 +853,17 @@ void store_peristent_pointers(unsigned int cid)
     }
 }
 
-/* Print the contents of the tree with mallocat structs
+/* Print the contents of the index of mallocat structs
  * only for debugging */
 void mallocat_pprint()
 {
     struct mallocat_entry *e;
-    int i;
-    void *itr;
-
-    SPLAY_FOREACH(e, mallocat_tree, &mallocat_tree) {
-        printf("mallocat { addr: %p, size: %zu, "
-               "ptrs: { size: %d, capacity: %d, ptrs: [",
-               e->addr, e->size, e->ptrs.size, e->ptrs.capacity);
-        VECTOR_FOREACH(&e->ptrs, itr, i)
-            printf("%p, ", itr);
+
+    for (e = mallocat_index.entries; e < mallocat_index.entries + mallocat_index.count; e++) {
+        printf("mallocat { addr: %p, size: %zu, ptrs: { size: %u, ptrs: [",
+               e->addr, e->size, e->nptrs);
+        for (uint32_t i = e->first; i < e->first + e->nptrs; i++)
+            printf("%p, ", mallocat_index.ptrs[i]);
         printf(" ] } }\n");
     }
 }
@@ -10,15 +10,18 @@ struct ptrat {  ///< store the location of persistent pointers in memory until t
     STAILQ_ENTRY(ptrat) list;
 };
 
+extern int CLOSURE_THREADS;
+
 /* do not call this function directly */
 void pointerat_aux(unsigned int cid, void **ptr_loc);
 
 /* these functions must be called in this order */
 void closure_init();
-void build_mallocat_tree();
+void build_mallocat_index();
 void classify_pointers(unsigned int cid);
 void move_volatile_allocations(unsigned int cid);
 void fix_back_references();
+void free_mallocat_index();
 void store_peristent_pointers(unsigned int cid);
 
 #define pointerat(cid, ptr_loc) do { \
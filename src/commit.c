@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include "cont.h"
+#include "commit.h"
+#include "settings.h"
+#include "macros.h"
+#include "out.h"
+
+/*
+ * Group commit. A thread that wants its changes to be durable asks for a
+ * checkpoint and gets a ticket back, and a committer thread takes a single
+ * checkpoint for all the requests that arrive within the latency window that
+ * follows the first one. A ticket is done once a checkpoint that started
+ * after it was handed out is complete.
+ *
+ * The changes must be made between container_tx_begin and container_tx_end,
+ * so the committer never checkpoints a change that is half done.
+ */
+
+int COMMIT_WINDOW_US = 0;   ///< how long to wait for more requests
+int COMMIT_BATCH = 0;       ///< stop waiting once this many requests wait, 0 for no limit
+
+struct group_commit {
+    pthread_mutex_t lock;
+    pthread_cond_t requested_cond;
+    pthread_cond_t committed_cond;
+    pthread_rwlock_t tx_lock;   ///< shared by the changes, exclusive for the checkpoint
+    int running;                ///< whether the committer thread was started
+    uint64_t requested;         ///< last ticket handed out
+    uint64_t committed;         ///< last ticket that is durable
+};
+
+static struct group_commit COMMITTERS[CONTAINER_CNT];
+
+void group_commit_init(unsigned int cid)
+{
+    struct group_commit *gc = &COMMITTERS[cid];
+    pthread_condattr_t cattr;
+    pthread_rwlockattr_t rwattr;
+
+    pthread_mutex_init(&gc->lock, NULL);
+
+    /* the latency window is measured on the monotonic clock */
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&gc->requested_cond, &cattr);
+    pthread_cond_init(&gc->committed_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    /* a steady stream of changes must not keep the committer out */
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&gc->tx_lock, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+
+    gc->running = 0;
+    gc->requested = 0;
+    gc->committed = 0;
+}
+
+/* wait up to the latency window, or until the batch is full */
+static void group_commit_gather(struct group_commit *gc)
+{
+    struct timespec deadline;
+
+    if (COMMIT_WINDOW_US <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += COMMIT_WINDOW_US * 1000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    while (!COMMIT_BATCH || gc->requested - gc->committed < COMMIT_BATCH) {
+        if (pthread_cond_timedwait(&gc->requested_cond, &gc->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+}
+
+static void *group_committer(void *arg)
+{
+    unsigned int cid = ptoi(arg);
+    struct group_commit *gc = &COMMITTERS[cid];
+    uint64_t batch;
+
+    pthread_mutex_lock(&gc->lock);
+    for (;;) {
+        while (gc->requested == gc->committed)
+            pthread_cond_wait(&gc->requested_cond, &gc->lock);
+
+        group_commit_gather(gc);
+        batch = gc->requested;
+        pthread_mutex_unlock(&gc->lock);
+
+        pthread_rwlock_wrlock(&gc->tx_lock);
+        container_cpoint_async(cid);
+        pthread_rwlock_unlock(&gc->tx_lock);
+
+        pthread_mutex_lock(&gc->lock);
+        LOG(10, "Group commit of %lu request(s)", batch - gc->committed);
+        __atomic_store_n(&gc->committed, batch, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&gc->committed_cond);
+    }
+
+    return NULL;
+}
+
+void container_tx_begin(unsigned int cid)
+{
+    pthread_rwlock_rdlock(&COMMITTERS[cid].tx_lock);
+}
+
+void container_tx_end(unsigned int cid)
+{
+    pthread_rwlock_unlock(&COMMITTERS[cid].tx_lock);
+}
+
+/*
+ * Ask for the changes made so far to be durable. The committer thread is
+ * started by the first request.
+ */
+uint64_t container_commit_async(unsigned int cid)
+{
+    struct group_commit *gc = &COMMITTERS[cid];
+    pthread_t thread;
+    uint64_t ticket;
+
+    pthread_mutex_lock(&gc->lock);
+    if (!gc->running) {
+        if (pthread_create(&thread, NULL, group_committer, itop(cid)))
+            handle_error("failed to create the group commit thread\n");
+        pthread_detach(thread);
+        gc->running = 1;
+        LOG(3, "Group commit started, window: %d us, batch: %d", COMMIT_WINDOW_US, COMMIT_BATCH);
+    }
+
+    ticket = ++gc->requested;
+    pthread_cond_signal(&gc->requested_cond);
+    pthread_mutex_unlock(&gc->lock);
+
+    return ticket;
+}
+
+int container_commit_done(unsigned int cid, uint64_t ticket)
+{
+    return __atomic_load_n(&COMMITTERS[cid].committed, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+void container_commit_wait(unsigned int cid, uint64_t ticket)
+{
+    struct group_commit *gc = &COMMITTERS[cid];
+
+    pthread_mutex_lock(&gc->lock);
+    while (gc->committed < ticket)
+        pthread_cond_wait(&gc->committed_cond, &gc->lock);
+    pthread_mutex_unlock(&gc->lock);
+}
+
+void container_commit(unsigned int cid)
+{
+    container_commit_wait(cid, container_commit_async(cid));
+}
@@ -0,0 +1,9 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+extern int COMMIT_WINDOW_US;
+extern int COMMIT_BATCH;
+
+void group_commit_init(unsigned int cid);
+
+#endif /* end of include guard: COMMIT_H */
@@ -7,8 +7,10 @@
 #include "macros.h"
 #include "slab.h"
 #include "sfhandler.h"
+#include "wtracker.h"
 #include "page_alloc.h"
 #include "atomics.h"
+#include "commit.h"
 
 /**
  * This array contains pointer to the actual containers. There is fixed numbers
@@ -30,18 +32,18 @@ static int container_getid()
 
 static void dont_compute_closure(unsigned int cid) { }
 
+/*
+ * A pointer may be registered many times (e.g. once per transaction), but the
+ * slab keeps a single copy of it (see slab_ptr_add)
+ */
 static void compute_closure(unsigned int cid)
 {
-    /*
-     * TODO: with this implementation, we could get duplicates on the
-     * persistent list of persistent pointers. This shold not affect
-     * correctness, but it should be fixed!
-     */
     LOG(10, "Computing closure");
-    build_mallocat_tree();
+    build_mallocat_index();
     classify_pointers(cid);
     move_volatile_allocations(cid);
     fix_back_references();
+    free_mallocat_index();
 }
 
 static void (*Func_compute_closure)(unsigned int cid) = compute_closure;
@@ -56,7 +58,9 @@ static void init(void)
             PMLIB_MAJOR_VERSION, PMLIB_MINOR_VERSION);
     LOG(3, NULL);
 
+    atomics_init();
     register_sigsegv_handler();
+    write_tracker_init();
 
     char *ptr = getenv("PMLIB_CLOSURE");
     if (ptr) {
@@ -70,6 +74,24 @@ static void init(void)
         LOG(3, "Container closure is enabled");
     }
 
+    ptr = getenv("PMLIB_CLOSURE_THREADS");
+    if (ptr) {
+        CLOSURE_THREADS = MAX(atoi(ptr), 1);
+        LOG(3, "Computing the closure with up to %d thread(s)", CLOSURE_THREADS);
+    }
+
+    ptr = getenv("PMLIB_COMMIT_WINDOW_US");
+    if (ptr) {
+        COMMIT_WINDOW_US = MAX(atoi(ptr), 0);
+        LOG(3, "Group commit window is %d us", COMMIT_WINDOW_US);
+    }
+
+    ptr = getenv("PMLIB_COMMIT_BATCH");
+    if (ptr) {
+        COMMIT_BATCH = MAX(atoi(ptr), 0);
+        LOG(3, "Group commit batch is %d request(s)", COMMIT_BATCH);
+    }
+
     slab_init();
 }
 
@@ -89,10 +111,14 @@ struct container *container_init()
         handle_error("failed to get the expected laddr for container\n");
 
     closure_init();
+    group_commit_init(cid);
 
     CONTAINERS[cid] = cont;
     cont->id = cid;
     cont->pg_allocator = pallocator;
+    cont->base_addr = cont;
+    cont->typed_base = cont;
+    cont->ntypes = 0;
     cont->current_slab.maddr = slab_dir_init(cid, &cont->current_slab.laddr);
     cont->snapshot_slab.maddr = cont->current_slab.maddr;
     cont->snapshot_slab.laddr = cont->current_slab.laddr;
@@ -105,6 +131,21 @@ void *container_palloc(unsigned int cid, unsigned int size)
     return slab_palloc(cid, size);
 }
 
+unsigned int container_register_type(unsigned int cid, unsigned int size, const unsigned int *offsets, int nptrs)
+{
+    return slab_register_type(cid, size, offsets, nptrs);
+}
+
+void *container_palloc_typed(unsigned int cid, unsigned int type)
+{
+    return slab_palloc_typed(cid, type);
+}
+
+void container_pfree(unsigned int cid, void *maddr)
+{
+    slab_pfree(cid, maddr);
+}
+
 static void container_compute_closure(unsigned int cid)
 {
     Func_compute_closure(cid);
@@ -144,17 +185,42 @@ void container_cpoint(unsigned int cid)
     STATS_RESET_TRANSACTION_COUNTERS();
 }
 
+/*
+ * Return once the checkpoint is committed, and leave the freeing of the
+ * snapshot pages and the report of the stats to a background thread
+ */
+void container_cpoint_async(unsigned int cid)
+{
+    LOG(10, "Starting a new asynchronous checkpoint");
+
+    container_cpoint_aux(cid, CPOINT_ASYNC);
+
+    STATS_RESET_TRANSACTION_COUNTERS();
+}
+
+void container_cpoint_drain(unsigned int cid)
+{
+    slab_reclaim_drain(cid);
+}
+
 struct container *container_restore(unsigned int cid)
 {
     struct container *cont;
     struct page_allocator * pallocator;
+    int ptrs_valid;
 
     pallocator = page_allocator_init(cid);
     cont = page_allocator_mappage(cid, CONTAINER_LIMA_ADDRESS);
+
+    /* the pointers of the container are still valid if it is mapped at the same address */
+    ptrs_valid = cont->base_addr && page_allocator_relocate(cid, cont->base_addr) == 0;
+    if (ptrs_valid)
+        cont = page_allocator_mappage(cid, CONTAINER_LIMA_ADDRESS);
     CONTAINERS[cid] = cont;
     cont->pg_allocator = pallocator;
 
     closure_init();
+    group_commit_init(cid);
 
     //TODO: make sure that all changes to PM up to this point are durable
 
@@ -175,8 +241,19 @@ struct container *container_restore(unsigned int cid)
         cont->current_slab.laddr = cont->snapshot_slab.laddr;
     }
 
-    slab_fixptrs(cid);
-    slab_mprotect_datapgs(cid, PROT_READ);
+    /*
+     * The address of the container is cleared while its pointers are fixed,
+     * and recorded again once they are all fixed
+     */
+    if (ptrs_valid) {
+        LOG(3, "Container mapped at its base address %p, pointers are valid", cont);
+    } else {
+        LOG(3, "Container mapped at %p instead of %p, fixing pointers", cont, cont->base_addr);
+        atomic_set((uint64_t*) &cont->base_addr, 0);
+        if (slab_fixptrs(cid) == 0)
+            atomic_set((uint64_t*) &cont->base_addr, ptoi(cont));
+    }
+    slab_protect_datapgs(cid);
 
     register_sigsegv_handler();
     return cont;
@@ -8,6 +8,7 @@
 #include "page_alloc.h"
 #include "fixptr.h"
 #include "closure.h"
+#include "slab.h"
 
 #define CPOINT_IN_PROGRESS_BIT 0
 #define CFLAG_CPOINT_IN_PROGRESS    (1 << CPOINT_IN_PROGRESS_BIT)
@@ -24,12 +25,50 @@ struct container {
         size_t laddr;
     } snapshot_slab;
     unsigned char flags;
+    void *base_addr;    ///< address at which the persistent pointers are valid, or NULL
+    void *typed_base;   ///< address at which the pointers of typed objects are valid (see slab_fixptrs)
+    uint64_t ntypes;
+    struct slab_type types[SLAB_TYPE_MAX];
     //STAILQ_HEAD(ptrat_list, ptrat) ptrat_head; ///< keep all ptrs from pointerat to be added at cpoint
 };
 
 struct container *container_init();
 void *container_palloc(unsigned int cid, unsigned int size);
+void container_pfree(unsigned int cid, void *maddr);
+
+/*
+ * Register the layout of a type: objects of size bytes with a persistent
+ * pointer at each of the nptrs offsets. The pointers of typed objects are
+ * kept valid by the container without pointerat, but they must be NULL or
+ * point into the container. Return the id of the type, or 0 if the layout
+ * cannot be registered. Registering a layout again returns the same id.
+ */
+unsigned int container_register_type(unsigned int cid, unsigned int size, const unsigned int *offsets, int nptrs);
+void *container_palloc_typed(unsigned int cid, unsigned int type);
 void container_cpoint(unsigned int cid);
+
+/*
+ * Asynchronous checkpoint: the changes are durable once it returns, but the
+ * pages of their snapshots are freed in the background. container_cpoint_drain
+ * waits for them to be freed.
+ */
+void container_cpoint_async(unsigned int cid);
+void container_cpoint_drain(unsigned int cid);
+
+/*
+ * Group commit: many threads can ask for their changes to be durable, and a
+ * single checkpoint serves all the requests that arrive within the window set
+ * by PMLIB_COMMIT_WINDOW_US. Changes go between container_tx_begin and
+ * container_tx_end, and a ticket is asked for after container_tx_end. Wait
+ * for a ticket outside of a transaction, and do not call container_cpoint
+ * while the committer is running.
+ */
+void container_tx_begin(unsigned int cid);
+void container_tx_end(unsigned int cid);
+uint64_t container_commit_async(unsigned int cid);
+int container_commit_done(unsigned int cid, uint64_t ticket);
+void container_commit_wait(unsigned int cid, uint64_t ticket);
+void container_commit(unsigned int cid);
 struct container* container_restore(unsigned int cid);
 
 size_t container_setroot(unsigned int cid, void *maddr);
@@ -38,22 +38,17 @@ void slab_entry_print(unsigned int cid)
     }
 }
 
-void slab_ptr_pprint(struct slab_ptr *sp, int sp_idx, int level)
+void slab_ptr_pprint(struct slab_entry *se, int level)
 {
     int step = 2;
-    for (int i = 0; i < sp_idx; i++) {
-        printf("%*ssp [ploc_offset: %u, pval_seid: %u, pval_offset: %u]\n",
-               level + step, "", sp->ptrs[i].ploc_offset, sp->ptrs[i].pval_seid, sp->ptrs[i].pval_offset);
-    }
-}
+    struct slab_ptr_iter it;
+    struct slab_ptr *sp;
 
-int bitmap_set_count(bitstr_t *bm, int size)
-{
-    int count = 0;
-    for (int i = 0; i < size; ++i) {
-        count += bit_test(bm, i) ? 1 : 0;
+    slab_ptr_iter_init(&it, se);
+    while ((sp = slab_ptr_next(&it))) {
+        printf("%*ssp [ploc_offset: %u, pval_seid: %u, pval_offset: %u]\n",
+               level + step, "", sp->ploc_offset, sp->pval_seid, sp->pval_offset);
     }
-    return count;
 }
 
 void slab_entry_pprint(struct slab_entry *se, int level)
@@ -62,25 +57,27 @@ void slab_entry_pprint(struct slab_entry *se, int level)
     printf("%*sse (%p) [id: %u, size: %u]\n",
             level, "", se, se->se_id, se->se_size);
 
-    printf("%*sdata_c [maddr: %p, laddr: %zu bm: %d (%d)]\n", level + step, "",
+    printf("%*sdata_c [maddr: %p, laddr: %zu bm: %d (%d) free: %u]\n", level + step, "",
             se->se_data.current.maddr,
             se->se_data.current.laddr,
-            bitmap_set_count(SLAB_ENTRY_CBITMAP(se), SLAB_ENTRY_CAPACITY(se)),
-            SLAB_ENTRY_CAPACITY(se));
+            slab_bitmap_count(SLAB_ENTRY_CBITMAP(se), SLAB_ENTRY_CAPACITY(se)),
+            SLAB_ENTRY_CAPACITY(se),
+            se->se_data.current.nfree);
     if (se->se_data.current.laddr != se->se_data.snapshot.laddr || 1)
         printf("%*sdata_s [maddr: %p, laddr: %zu bm: %d (%d)]\n", level + step, "",
                 se->se_data.snapshot.maddr,
                 se->se_data.snapshot.laddr,
-                bitmap_set_count(SLAB_ENTRY_SBITMAP(se), SLAB_ENTRY_CAPACITY(se)),
+                slab_bitmap_count(SLAB_ENTRY_SBITMAP(se), SLAB_ENTRY_CAPACITY(se)),
                 SLAB_ENTRY_CAPACITY(se));
 
-    printf("%*sptr_c [idx: %u, maddr: %p, laddr: %zu]\n",
-            level + step, "", se->se_ptr.current.idx, se->se_ptr.current.maddr, se->se_ptr.current.laddr);
-    slab_ptr_pprint(se->se_ptr.current.maddr, se->se_ptr.current.idx, level + step);
+    printf("%*sptr_c [idx: %u, size: %u, maddr: %p, laddr: %zu]\n",
+            level + step, "", se->se_ptr.current.idx, se->se_ptr.current.size,
+            se->se_ptr.current.maddr, se->se_ptr.current.laddr);
+    slab_ptr_pprint(se, level + step);
     if (se->se_ptr.current.laddr != se->se_ptr.snapshot.laddr || 1) {
-        printf("%*sptr_s [idx: %u, maddr: %p, laddr: %zu]\n",
-                level + step, "", se->se_ptr.snapshot.idx, se->se_ptr.snapshot.maddr, se->se_ptr.snapshot.laddr);
-        slab_ptr_pprint(se->se_ptr.snapshot.maddr, se->se_ptr.snapshot.idx, level + step);
+        printf("%*sptr_s [idx: %u, size: %u, maddr: %p, laddr: %zu]\n",
+                level + step, "", se->se_ptr.snapshot.idx, se->se_ptr.snapshot.size,
+                se->se_ptr.snapshot.maddr, se->se_ptr.snapshot.laddr);
     }
 }
 
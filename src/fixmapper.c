@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
 #include <sys/mman.h>
@@ -10,7 +11,7 @@
 #include "page_alloc.h"
 #include "settings.h"
 #include "macros.h"
-#include <queue.h>
+#include <vector.h>
 #include "out.h"
 #include "stats.h"
 
@@ -22,44 +23,67 @@
 
 #define bytes2pgs(bytes) ((bytes) / PAGE_SIZE)
 
+/* older kernels ignore this flag and take the address as a hint */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 #define DEFAULT_MAPPING_PROT    (PA_PROT_READ)
 
 char cont_file_name[128];
 
-struct fixed_page {
-    uint64_t pgno;
-    int prot_flags;
-    LIST_ENTRY(fixed_page) free;
+/*
+ * Each kind of page is allocated from its own zone, so that pages of the
+ * same kind are packed together in the file: data pages form long runs that
+ * are protected with few calls, and the metadata is not scattered between
+ * them. A zone is made of extents of the file that are handed out in order,
+ * each one at least as large as the zone, so a zone has few extents.
+ */
+enum fixed_zone_type {
+    FM_ZONE_META,       //slab metadata, pointer pages, container header
+    FM_ZONE_DATA,       //slab data pages (PA_DATA)
+    FM_ZONE_SNAPSHOT,   //snapshots of slab data pages (PA_SNAPSHOT)
+    FM_ZONE_CNT
 };
 
-struct fixed_page *fixed_page_alloc(uint64_t pgno)
-{
-    struct fixed_page *p = malloc(sizeof(*p));
-    assert(p && "Failed to allocated memory for page");
-    p->pgno = pgno;
-    p->prot_flags = DEFAULT_MAPPING_PROT;
-    return p;
-}
+struct fixed_extent {
+    uint64_t first;     //first page of the extent
+    uint64_t npages;
+    int zone;
+};
 
-void fixed_page_free(struct fixed_page *p)
-{
-    assert(p && "Trying to free NULL pointer");
-    free(p);
-    p = NULL;
-}
+struct fixed_zone {
+    uint64_t npages;    //number of pages in the zone
+    uint64_t nfree;     //number of free pages in the zone
+    uint64_t next;      //page right after the last page allocated
+};
 
+/*
+ * The state of the pages is kept in two bitmaps with one bit per page:
+ *  - free_map: the page is free
+ *  - used_map: the page has been allocated since it was mapped, so its
+ *    protection is unknown; the other pages have DEFAULT_MAPPING_PROT
+ *
+ * The zone of a page is found from the extents, which are sorted by address
+ * since they are handed out in order.
+ */
 struct fixed_mapper {
     int fd;             //file descriptor
     size_t file_size;   //file size in bytes
     void *start_addr;   //address at which the entire file is mapped
-    struct {
-        uint64_t size;
-        LIST_HEAD(fixedpage_list_head, fixed_page) head;
-        struct fixed_page *last;
-    } free_list;                //keep track of all available pages
-    struct fixed_page **index;  //keep track of all pages here
+    size_t reserved_size;   //size of the address range reserved at start_addr
+    uint64_t tail;      //first page that does not belong to a zone
+    struct fixed_zone zones[FM_ZONE_CNT];
+    VECTOR_DECL(fixed_extent_vector, struct fixed_extent) extents;
+    uint64_t *free_map;
+    uint64_t *used_map;
 };
 
+#define map_words(npages)   (((npages) + 63) / 64)
+#define map_test(map, pgno) ((map)[(pgno) / 64] & (1ULL << ((pgno) % 64)))
+#define map_set(map, pgno)  ((map)[(pgno) / 64] |= (1ULL << ((pgno) % 64)))
+#define map_clear(map, pgno) ((map)[(pgno) / 64] &= ~(1ULL << ((pgno) % 64)))
+
 /*
  * map_hint -- (internal) use /proc to determine a hint address for mmap()
  *
@@ -120,22 +144,55 @@ void *map_hint(size_t len)
     return raddr;
 }
 
-static void update_mapping_prot(struct fixed_mapper *fm)
+/*
+ * map_find_run -- (internal) find n set bits in a row in [first, last), and
+ * return the first one, or last if there is none
+ *
+ * The bitmap is scanned a 64-bit word at a time, skipping words without any
+ * bit set and runs of bits set.
+ */
+static uint64_t map_find_run(uint64_t *map, uint64_t first, uint64_t last, size_t n)
 {
-    size_t pgs = bytes2pgs(fm->file_size);
-    struct fixed_page *p = NULL;
-    void *addr = NULL;
-
-    for (size_t i = 0; i < pgs; i++) {
-        p = fm->index[i];
-        addr = fm->start_addr + PAGE_SIZE * p->pgno;
-        page_allocator_mprotect_generic(addr, PAGE_SIZE, p->prot_flags);
+    uint64_t run = 0;   //bits set in a row right before i
+    uint64_t i = first;
+
+    while (i < last) {
+        uint64_t word = map[i / 64] >> (i % 64);
+
+        if (word == 0) {
+            run = 0;
+            i += 64 - i % 64;
+        } else if (word & 1) {
+            uint64_t ones = ~word ? __builtin_ctzll(~word) : 64;
+            if (run + ones >= n)
+                return (i - run + n <= last) ? i - run : last;
+            run += ones;
+            i += ones;
+        } else {
+            run = 0;
+            i += __builtin_ctzll(word);
+        }
     }
+
+    return last;
+}
+
+/* the bits beyond the end of the file must be clear in both bitmaps */
+static void map_resize(uint64_t **map, uint64_t old_npages, uint64_t new_npages)
+{
+    size_t old_words = map_words(old_npages), new_words = map_words(new_npages);
+
+    *map = realloc(*map, new_words * sizeof(**map));
+    assert(*map && "Failed to allocate memory for the page bitmap");
+    memset(*map + old_words, 0, (new_words - old_words) * sizeof(**map));
 }
 
+/*
+ * The new pages do not belong to any zone until a zone grows into them, see
+ * zone_grow.
+ */
 static void fixed_mapper_grow_file(struct fixed_mapper *fm, uint64_t new_size)
 {
-    assert(fm->free_list.size == 0 && "growing file while with free pages");
     LOG(5, "Growing container file from %lu to %lu", fm->file_size, new_size);
     STATS_INC_CONTGROW();
 
@@ -150,46 +207,207 @@ static void fixed_mapper_grow_file(struct fixed_mapper *fm, uint64_t new_size)
         case ESPIPE : handle_error("fd refers to a pipe.\n");
     }
 
-    uint64_t current_size_pgs = bytes2pgs(fm->file_size);
-    uint64_t new_size_pgs = bytes2pgs(new_size);
-    struct fixed_page *p = NULL;
+    map_resize(&fm->free_map, bytes2pgs(fm->file_size), bytes2pgs(new_size));
+    map_resize(&fm->used_map, bytes2pgs(fm->file_size), bytes2pgs(new_size));
+
+    fm->file_size = new_size;
+}
+
+/*
+ * index_file -- (internal) create the page bitmaps of a file that already exists
+ *
+ * The free space of the file is not persisted, so every page of an existing
+ * file is considered in use, and it is given to the metadata zone when freed.
+ * These pages are mapped writable; it is up to the slab to protect its data
+ * pages once the container has been restored.
+ */
+static void index_file(struct fixed_mapper *fm)
+{
+    uint64_t size_pgs = bytes2pgs(fm->file_size);
+    struct fixed_extent e = { .first = 0, .npages = size_pgs, .zone = FM_ZONE_META };
+
+    map_resize(&fm->free_map, 0, size_pgs);
+    map_resize(&fm->used_map, 0, size_pgs);
+    memset(fm->used_map, 0xff, map_words(size_pgs) * sizeof(uint64_t));
+    if (size_pgs % 64)
+        fm->used_map[size_pgs / 64] = (1ULL << (size_pgs % 64)) - 1;
+
+    VECTOR_APPEND(&fm->extents, e);
+    fm->zones[FM_ZONE_META].npages = size_pgs;
+    fm->tail = size_pgs;
+}
 
-    fm->index = realloc(fm->index, sizeof(void*) * new_size_pgs);
+/*
+ * reserve_mapping -- (internal) reserve the address range of the file
+ *
+ * The range is reserved once with an inaccessible mapping, which does not
+ * use any memory. The file is mapped over the beginning of the range, and
+ * grows into the rest of it.
+ */
+static void reserve_mapping(struct fixed_mapper *fm)
+{
+    size_t size = MAX(FM_RESERVE_SIZE, ROUND2GB(fm->file_size));
+    void *hint = map_hint(size);
+    assert(hint && "Could not find a big-enough region");
 
-    p = fm->index[current_size_pgs] = fixed_page_alloc(current_size_pgs);
-    LIST_INSERT_HEAD(&fm->free_list.head, p, free);
-    fm->free_list.last = p;
-    fm->free_list.size++;
-    current_size_pgs++;
+    void *addr = mmap(hint, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        handle_error("failed to reserve the address range of the container\n");
+    assert(addr == hint && "Could not mapped at the hinted address");
+
+    fm->start_addr = addr;
+    fm->reserved_size = size;
+}
 
-    for (uint64_t i = current_size_pgs; i < new_size_pgs; i++) {
-        p = fm->index[i] = fixed_page_alloc(i);
-        LIST_INSERT_AFTER(fm->free_list.last, p, free);
-        fm->free_list.size++;
-        fm->free_list.last = p;
+static void map_file(struct fixed_mapper *fm)
+{
+    reserve_mapping(fm);
+
+    void *addr = mmap(fm->start_addr, fm->file_size, DEFAULT_MAPPING_PROT,
+                      MAP_SHARED | MAP_FIXED, fm->fd, 0);
+    if (addr != fm->start_addr)
+        handle_error("failed to map the container\n");
+}
+
+/*
+ * grow_mapping -- (internal) map the pages added to the file right after the
+ * current mapping, in the reserved range
+ *
+ * The pages already in use keep their address and their protection, so
+ * other threads can keep accessing them while the file grows. The new pages
+ * are free and keep the default protection until they are allocated.
+ */
+static void grow_mapping(struct fixed_mapper *fm, size_t old_size)
+{
+    void *hint = fm->start_addr + old_size;
+
+    if (fm->file_size > fm->reserved_size)
+        handle_error("the container outgrew its reserved address range\n");
+
+    void *addr = mmap(hint, fm->file_size - old_size, DEFAULT_MAPPING_PROT,
+                      MAP_SHARED | MAP_FIXED, fm->fd, old_size);
+    if (addr != hint)
+        handle_error("failed to extend the mapping of the container in place\n");
+}
+
+static int zone_of(int flags)
+{
+    if (flags & PA_DATA)
+        return FM_ZONE_DATA;
+    if (flags & PA_SNAPSHOT)
+        return FM_ZONE_SNAPSHOT;
+    return FM_ZONE_META;
+}
+
+static int zone_of_page(struct fixed_mapper *fm, uint64_t pgno)
+{
+    int lo = 0, hi = VECTOR_SIZE(&fm->extents) - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (VECTOR_AT(&fm->extents, mid).first <= pgno)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
 
-    fm->file_size = new_size;
+    assert(pgno < fm->tail && "Page does not belong to a zone");
+    return VECTOR_AT(&fm->extents, lo).zone;
 }
 
-static void map_file(struct fixed_mapper *fm, int update_mappings)
+/*
+ * zone_grow -- (internal) add an extent of at least npages free pages to a
+ * zone, and return its first page
+ *
+ * The extent is taken right after the last one given to a zone, growing the
+ * file when needed. Its size doubles the zone, as the file does when it grows.
+ */
+static uint64_t zone_grow(struct fixed_mapper *fm, int zone, uint64_t npages)
 {
-    void *hint;
+    struct fixed_zone *z = &fm->zones[zone];
+    struct fixed_extent *last;
+    uint64_t first = fm->tail;
+
+    npages = MAX(npages, MAX(z->npages, bytes2pgs(FM_ZONE_SIZE)));
+    if (first + npages > bytes2pgs(fm->file_size)) {
+        size_t old_size = fm->file_size;
+        fixed_mapper_grow_file(fm, MAX(fm->file_size * 2, (first + npages) * PAGE_SIZE));
+        grow_mapping(fm, old_size);
+    }
+
+    LOG(5, "Adding pages [%lu, %lu) to zone %d", first, first + npages, zone);
 
-    if (fm->start_addr == 0)
-        hint = map_hint(fm->file_size);
-    else {
-        hint = fm->start_addr;
-        munmap(hint, fm->file_size);
+    last = VECTOR_SIZE(&fm->extents) ? &VECTOR_AT(&fm->extents, VECTOR_SIZE(&fm->extents) - 1) : NULL;
+    if (last && last->zone == zone) {
+        last->npages += npages;
+    } else {
+        struct fixed_extent e = { .first = first, .npages = npages, .zone = zone };
+        VECTOR_APPEND(&fm->extents, e);
     }
-    assert(hint && "Could not find a big-enough region");
 
-    void *addr = mmap(hint, fm->file_size, DEFAULT_MAPPING_PROT, MAP_SHARED, fm->fd, 0);
-    assert(addr == hint && "Could not mapped at the hinted address");
-    fm->start_addr = addr;
+    for (uint64_t i = first; i < first + npages; i++)
+        map_set(fm->free_map, i);
+    fm->tail += npages;
+    z->npages += npages;
+    z->nfree += npages;
 
-    if (update_mappings)
-        update_mapping_prot(fm);
+    return first;
+}
+
+/*
+ * zone_find_run -- (internal) find n free pages in a row in a zone
+ *
+ * This is a next fit: the extents of the zone are searched from the last
+ * page allocated to their end, and then from their beginning.
+ */
+static int zone_find_run(struct fixed_mapper *fm, int zone, size_t n, uint64_t *pgno)
+{
+    struct fixed_zone *z = &fm->zones[zone];
+    struct fixed_extent *e;
+
+    if (z->nfree < n)
+        return 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < VECTOR_SIZE(&fm->extents); i++) {
+            e = &VECTOR_AT(&fm->extents, i);
+            uint64_t first = e->first, last = e->first + e->npages;
+
+            if (e->zone != zone || (pass == 0 && last <= z->next))
+                continue;
+            if (pass == 0)
+                first = MAX(first, z->next);
+
+            *pgno = map_find_run(fm->free_map, first, last, n);
+            if (*pgno != last)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * zone_take -- (internal) remove n free pages from their zone, and return 1
+ * if the protection of any of them is unknown
+ */
+static int zone_take(struct fixed_mapper *fm, int zone, uint64_t first, size_t n)
+{
+    struct fixed_zone *z = &fm->zones[zone];
+    int used = 0;
+
+    for (uint64_t i = first; i < first + n; i++) {
+        assert(map_test(fm->free_map, i) && "Page is not free");
+        map_clear(fm->free_map, i);
+        if (map_test(fm->used_map, i))
+            used = 1;
+        map_set(fm->used_map, i);
+    }
+    z->nfree -= n;
+    z->next = first + n;
+
+    return used;
 }
 
 void *fixed_mapper_init()
@@ -201,7 +419,7 @@ void *fixed_mapper_init()
     char *ptr;
 
     assert(fm && "Failed to allocate memory");
-    LIST_INIT(&fm->free_list.head);
+    VECTOR_INIT(&fm->extents);
 
     ptr = getenv("PMLIB_CONT_FILE");
     if (ptr) {
@@ -229,9 +447,13 @@ void *fixed_mapper_init()
         }
 
         fixed_mapper_grow_file(fm, file_size);
+        map_file(fm);
+    } else {
+        index_file(fm);
+        map_file(fm);
+        page_allocator_mprotect_generic(fm->start_addr, fm->file_size, PA_PROT_RNW);
     }
 
-    map_file(fm, /* dont update mappings */ 0);
     return (void*)fm;
 }
 
@@ -239,51 +461,51 @@ int fixed_mapper_close(void *handler)
 {
     struct fixed_mapper *h = (struct fixed_mapper*) handler;
 
-    size_t size_pgs = bytes2pgs(h->file_size);
-    for (size_t i = 0; i < size_pgs; ++i) {
-        free(h->index[i]);
-    }
-    free(h->index);
+    free(h->free_map);
+    free(h->used_map);
+    VECTOR_FREE(&h->extents);
 
-    int ret = munmap(h->start_addr, h->file_size);
+    int ret = munmap(h->start_addr, h->reserved_size);
     assert(ret == 0 && "Failed to ummap the file");
     close(h->fd);
     return 0;
 }
 
-void *fixed_mapper_alloc_page(void *handler, size_t *laddr, int flags)
+/*
+ * Allocate a run of n contiguous pages. Each page of the run is released
+ * individually with fixed_mapper_freepages.
+ *
+ * Pages are placed right after the last page allocated from their zone when
+ * that page is free, so that pages allocated in a row form runs that can be
+ * protected with a single call.
+ */
+void *fixed_mapper_alloc_pages(void *handler, size_t n, size_t *laddr, int flags)
 {
     struct fixed_mapper *h = (struct fixed_mapper*) handler;
-    struct fixed_page *p;
+    int zone = zone_of(flags);
+    int prot = flags & PA_PROT_MASK;
+    uint64_t first;
     void *addr = NULL;
 
-    if (h->free_list.size == 0) {
-        fixed_mapper_grow_file(h, h->file_size * 2);
-        map_file(h, /* update mappings */ 1);
-    }
+    /* the pages of a new extent are free and contiguous */
+    if (!zone_find_run(h, zone, n, &first))
+        first = zone_grow(h, zone, n);
 
-    p = LIST_FIRST(&h->free_list.head);
-    LIST_REMOVE(p, free);
-    h->free_list.size--;
-    if (h->free_list.size == 0)
-        h->free_list.last = NULL;
+    int used = zone_take(h, zone, first, n);
 
-    addr = h->start_addr + (p->pgno * PAGE_SIZE);
+    addr = h->start_addr + (first * PAGE_SIZE);
     if (laddr)
-        *laddr = p->pgno * PAGE_SIZE;
-
-    if (flags & PA_PROT_WRITE)
-        page_allocator_mprotect_generic(addr, PAGE_SIZE, flags);
+        *laddr = first * PAGE_SIZE;
 
-    p->prot_flags = flags;
+    if (used || prot != DEFAULT_MAPPING_PROT)
+        page_allocator_mprotect_generic(addr, n * PAGE_SIZE, prot);
 
     return addr;
 }
 
-void *fixed_mapper_alloc_pages(void *handler, size_t n, size_t *laddr, int flags)
+void *fixed_mapper_alloc_page(void *handler, size_t *laddr, int flags)
 {
-    handle_error("not implemnted yet");
-    return NULL;
+    return fixed_mapper_alloc_pages(handler, 1, laddr, flags);
 }
 
 void fixed_mapper_freepages(void *handler, void *maddr)
@@ -293,15 +515,10 @@ void fixed_mapper_freepages(void *handler, void *maddr)
 
     struct fixed_mapper *h = (struct fixed_mapper*) handler;
     uint64_t pgno = (maddr - h->start_addr) / PAGE_SIZE;
-    struct fixed_page *p = h->index[pgno];
-
-    if (h->free_list.last)
-        LIST_INSERT_AFTER(h->free_list.last, p, free);
-    else
-        LIST_INSERT_HEAD(&h->free_list.head, p, free);
 
-    h->free_list.last = p;
-    h->free_list.size++;
+    assert(!map_test(h->free_map, pgno) && "Page is already free");
+    map_set(h->free_map, pgno);
+    h->zones[zone_of_page(h, pgno)].nfree++;
 }
 
 void *fixed_mapper_getaddress(void *handler, size_t laddr)
@@ -311,6 +528,39 @@ void *fixed_mapper_getaddress(void *handler, size_t laddr)
     return maddr;
 }
 
+/*
+ * fixed_mapper_relocate -- map the file of a restored container at addr
+ *
+ * The address range is reserved at addr only if it is unused, and then the
+ * range reserved when the file was opened is released. This must be called
+ * before any page of the file is accessed through its first address.
+ */
+int fixed_mapper_relocate(void *handler, void *addr)
+{
+    struct fixed_mapper *h = (struct fixed_mapper*) handler;
+    void *raddr;
+
+    if (addr == h->start_addr)
+        return 0;
+
+    raddr = mmap(addr, h->reserved_size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (raddr == MAP_FAILED)
+        return -1;
+    if (raddr != addr) {
+        munmap(raddr, h->reserved_size);
+        return -1;
+    }
+
+    if (mmap(addr, h->file_size, PA_PROT_RNW, MAP_SHARED | MAP_FIXED, h->fd, 0) != addr)
+        handle_error("failed to map the container at %p\n", addr);
+
+    munmap(h->start_addr, h->reserved_size);
+    h->start_addr = addr;
+
+    return 0;
+}
+
 void fixed_mapper_noope(void *handler)
 {
     //nothing to do here!
@@ -333,6 +583,7 @@ struct page_allocator_ops *fixed_mapper_ops()
         .map_page = fixed_mapper_getaddress,
         .swap_page_mapping = fixed_mapper_noswap,
         .protect_page = page_allocator_mprotect_generic,
+        .relocate = fixed_mapper_relocate,
     };
     return &ops;
 }
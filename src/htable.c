@@ -1,4 +1,3 @@
-#include "hash.h"
 #include "htable.h"
 
 #include <assert.h>
@@ -6,69 +5,116 @@
 #include <string.h>
 #include <stdio.h>
 
-struct htable_entry {
-    uint32_t hash;
+/*
+ * Open-addressing hash table with Robin Hood linear probing.
+ *
+ * Entries are kept in a flat array of slots, so inserting an entry does not
+ * allocate memory unless the array grows. Keys are pointers and NULL marks
+ * an empty slot, so NULL cannot be a key. An entry never sits further from
+ * its home slot than the entry that follows it (Robin Hood), which keeps
+ * probes short at high load and lets a failed lookup stop early. Removing
+ * an entry shifts the entries that follow it back by one slot, so there are
+ * no tombstones.
+ */
+#define HTABLE_MIN_LENGTH   16
+
+struct htable_slot {
     void *key;
     void *val;
-    struct htable_entry *next_hash;
 };
 
 struct htable {
-    uint32_t length;
+    uint32_t length;    ///< number of slots, a power of 2
     uint32_t elems;
-    struct htable_entry **list;
+    uint32_t shift;     ///< 64 - log2(length)
+    struct htable_slot *slots;
 };
 
-struct htable_entry *htable_entry_alloc(void *key, void *val, uint32_t hash)
+/*
+ * Fibonacci hashing: the top bits of the product depend on all the bits of
+ * the key, including the high ones that differ between nearby pointers.
+ */
+static inline uint32_t htable_home(struct htable *ht, void *key)
+{
+    return ((uint64_t)(uintptr_t) key * 0x9e3779b97f4a7c15ULL) >> ht->shift;
+}
+
+/* distance of the entry in slot i from its home slot */
+static inline uint32_t htable_dist(struct htable *ht, uint32_t i)
 {
-    struct htable_entry *e = malloc(sizeof(*e));
-    assert(e && "failed to allocate memory for htable_entry");
-    e->key = key;
-    e->val = val;
-    e->hash = hash;
-    e->next_hash = NULL;
-    return e;
+    return (i - htable_home(ht, ht->slots[i].key)) & (ht->length - 1);
 }
 
-static struct htable_entry **
-htable_find_pointer(struct htable *ht, void *key, uint32_t hash)
+/* put an entry whose key is not in the table */
+static void htable_place(struct htable *ht, void *key, void *val)
 {
-    struct htable_entry **ptr = &ht->list[hash & (ht->length - 1)];
-    while (*ptr != NULL && ((*ptr)->hash != hash || key != (*ptr)->key)) {
-        ptr = &(*ptr)->next_hash;
+    struct htable_slot cur = { key, val }, tmp;
+    uint32_t mask = ht->length - 1;
+    uint32_t i = htable_home(ht, key);
+    uint32_t d = 0, sd;
+
+    while (ht->slots[i].key) {
+        sd = htable_dist(ht, i);
+        if (sd < d) {
+            tmp = ht->slots[i];
+            ht->slots[i] = cur;
+            cur = tmp;
+            d = sd;
+        }
+        i = (i + 1) & mask;
+        d++;
     }
-    return ptr;
+    ht->slots[i] = cur;
 }
 
-static void htable_resize(struct htable *ht)
+static void htable_resize(struct htable *ht, uint32_t new_length)
 {
-    uint32_t new_length = 4;
-    while (new_length < ht->elems) {
-        new_length *= 2;
+    struct htable_slot *old = ht->slots;
+    uint32_t old_length = ht->length;
+
+    ht->slots = calloc(new_length, sizeof(*ht->slots));
+    assert(ht->slots && "failed to resize the array on the hash table");
+    ht->length = new_length;
+    ht->shift = 64 - __builtin_ctz(new_length);
+
+    for (uint32_t i = 0; i < old_length; i++) {
+        if (old[i].key)
+            htable_place(ht, old[i].key, old[i].val);
     }
+    free(old);
+}
 
-    struct htable_entry **new_list = malloc(sizeof(void*) * new_length);
-    assert(new_list && "failed to resize the array on the hash table");
-    memset(new_list, 0, sizeof(void*) * new_length);
+/* return the slot of key, or -1 if it is not in the table */
+static int64_t htable_find(struct htable *ht, void *key)
+{
+    uint32_t mask = ht->length - 1;
+    uint32_t i = htable_home(ht, key);
+    uint32_t d = 0;
 
-    int count = 0;
-    for (int i = 0; i < ht->length; i++) {
-        struct htable_entry *e = ht->list[i];
-        while (e != NULL) {
-            struct htable_entry *next = e->next_hash;
-            uint32_t hash = e->hash;
-            struct htable_entry **ptr = &new_list[hash & (new_length - 1)];
-            e->next_hash = *ptr;
-            *ptr = e;
-            e = next;
-            count++;
-        }
+    while (ht->slots[i].key) {
+        if (ht->slots[i].key == key)
+            return i;
+        if (htable_dist(ht, i) < d)
+            break;
+        i = (i + 1) & mask;
+        d++;
     }
+    return -1;
+}
 
-    assert(ht->elems == count);
-    free(ht->list);
-    ht->list = new_list;
-    ht->length = new_length;
+static void htable_remove_at(struct htable *ht, uint32_t i)
+{
+    uint32_t mask = ht->length - 1;
+    uint32_t j = (i + 1) & mask;
+
+    while (ht->slots[j].key && htable_dist(ht, j) > 0) {
+        ht->slots[i] = ht->slots[j];
+        i = j;
+        j = (j + 1) & mask;
+    }
+    ht->slots[i].key = NULL;
+    ht->slots[i].val = NULL;
+    ht->elems--;
 }
 
 struct htable* htable_init()
@@ -77,71 +123,72 @@ struct htable* htable_init()
     assert(ht && "failed to allocate htable");
     ht->length = 0;
     ht->elems = 0;
-    ht->list = NULL;
+    ht->slots = NULL;
 
-    htable_resize(ht);
+    htable_resize(ht, HTABLE_MIN_LENGTH);
     return ht;
 }
 
 void htable_free(struct htable *ht)
 {
-    int count = 0;
-    for (int i = 0; i < ht->length; i++) {
-        struct htable_entry *e = ht->list[i];
-        while (e != NULL) {
-            struct htable_entry *next = e->next_hash;
-            free(e);
-            e = next;
-            count++;
-        }
-    }
-
-    assert(ht->elems == count);
-    free(ht->list);
+    free(ht->slots);
     free(ht);
 }
 
+/*
+ * Remove all the entries but keep the slots, so a table that is refilled
+ * after every checkpoint does not grow again
+ */
+void htable_clear(struct htable *ht)
+{
+    memset(ht->slots, 0, ht->length * sizeof(*ht->slots));
+    ht->elems = 0;
+}
+
+uint32_t htable_size(struct htable *ht)
+{
+    return ht->elems;
+}
+
 int htable_insert(struct htable *ht, void *key, void *val)
 {
-    uint32_t hash = Hash((char*)&key, sizeof(void*), 0);
-    struct htable_entry **ptr = htable_find_pointer(ht, key, hash);
-    int ret = 0;
+    int64_t i;
 
-    if (*ptr == NULL) {
-        struct htable_entry *new_entry = htable_entry_alloc(key, val, hash);
-        *ptr = new_entry;
-        ret = 1;
+    assert(key && "NULL cannot be a key of the hash table");
 
-        ++ht->elems;
-        if (ht->elems > ht->length)
-            htable_resize(ht);
-    } else {
+    i = htable_find(ht, key);
+    if (i >= 0) {
         //NOTE: is val points to an allocated obj, it should be freed here!
-        (*ptr)->val = val;
+        ht->slots[i].val = val;
+        return 0;
     }
 
-    return ret;
+    /* keep the load below 7/8 */
+    if ((uint64_t)(ht->elems + 1) * 8 > (uint64_t) ht->length * 7)
+        htable_resize(ht, ht->length * 2);
+
+    htable_place(ht, key, val);
+    ht->elems++;
+    return 1;
 }
 
 void *htable_lookup(struct htable *ht, void *key)
 {
-    uint32_t hash = Hash((char*)&key, sizeof(void*), 0);
-    struct htable_entry **ptr = htable_find_pointer(ht, key, hash);
-    return (*ptr) != NULL ? (*ptr)->val : NULL;
+    int64_t i = htable_find(ht, key);
+    return i >= 0 ? ht->slots[i].val : NULL;
 }
 
 void *htable_remove(struct htable *ht, void *key)
 {
-    int ret = 0;
-    uint32_t hash = Hash((char*)&key, sizeof(void*), 0);
-    struct htable_entry **ptr = htable_find_pointer(ht, key, hash);
-    struct htable_entry *result = *ptr;
-    if (result != NULL) {
-        *ptr = result->next_hash;
-        ht->elems--;
-        return result->val;
-    }
-    return NULL;
+    int64_t i = htable_find(ht, key);
+    void *val;
+
+    if (i < 0)
+        return NULL;
+
+    val = ht->slots[i].val;
+    htable_remove_at(ht, i);
+    return val;
 }
 
 /* only for debugging */
@@ -149,13 +196,11 @@ void htable_print(struct htable *ht)
 {
     int count = 0;
     for (int i = 0; i < ht->length; i++) {
-        struct htable_entry *e = ht->list[i];
-        while (e != NULL) {
-            printf("htable_entry { hash: %x, key: %p, val: %p }\n",
-                    e->hash, e->key, e->val);
-            e = e->next_hash;
-            count++;
-        }
+        if (!ht->slots[i].key)
+            continue;
+        printf("htable_entry { slot: %d, key: %p, val: %p }\n",
+                i, ht->slots[i].key, ht->slots[i].val);
+        count++;
     }
 
     assert(ht->elems == count);
@@ -167,10 +212,8 @@ void htable_foreach(struct htable *ht,
 {
     int count = 0;
     for (int i = 0; i < ht->length; i++) {
-        struct htable_entry *e = ht->list[i];
-        while (e != NULL) {
-            fun(e->key, e->val, param);
-            e = e->next_hash;
+        if (ht->slots[i].key) {
+            fun(ht->slots[i].key, ht->slots[i].val, param);
             count++;
         }
     }
@@ -178,23 +221,41 @@ void htable_foreach(struct htable *ht,
     assert(ht->elems == count);
 }
 
+/*
+ * Visit the entries in the part-th of nparts ranges of slots. Different
+ * parts can be visited at the same time, as long as the table is not changed.
+ */
+void htable_foreach_part(struct htable *ht, uint32_t part, uint32_t nparts,
+                         void (*fun)(void *key, void *val, void *param),
+                         void *param)
+{
+    uint32_t first = (uint64_t) ht->length * part / nparts;
+    uint32_t last = (uint64_t) ht->length * (part + 1) / nparts;
+
+    for (uint32_t i = first; i < last; i++) {
+        if (ht->slots[i].key)
+            fun(ht->slots[i].key, ht->slots[i].val, param);
+    }
+}
+
+/*
+ * A removal shifts the entries of the rest of its cluster back by one slot,
+ * into the slot we just checked. The walk starts at an empty slot, so the
+ * shifted entries are always ahead of it and every entry is visited once.
+ */
 void htable_filter(struct htable *ht,
                     int (*fun)(void *key, void *val, void *param),
                     void *param)
 {
-    for (int i = 0; i < ht->length; i++) {
-        struct htable_entry *e = ht->list[i];
-        struct htable_entry **ptr = &ht->list[i];
-        while (e != NULL) {
-            if (fun(e->key, e->val, param)) {
-                ht->elems--;
-                *ptr = e->next_hash;
-                free(e);
-                e = *ptr;
-            } else {
-                ptr = &e->next_hash;
-                e = e->next_hash;
-            }
-        }
+    uint32_t mask = ht->length - 1;
+    uint32_t start = 0, i;
+
+    while (ht->slots[start].key)
+        start++;
+
+    for (uint32_t n = 0; n < ht->length; n++) {
+        i = (start + n) & mask;
+        while (ht->slots[i].key && fun(ht->slots[i].key, ht->slots[i].val, param))
+            htable_remove_at(ht, i);
     }
 }
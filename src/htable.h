@@ -5,14 +5,22 @@
 
 struct htable;
 
+/*
+ * Hash table keyed by pointers (NULL is not a valid key). Inserting does not
+ * allocate memory, except to grow the table.
+ */
 struct htable* htable_init();
 void htable_free(struct htable*);
+void htable_clear(struct htable*);
+uint32_t htable_size(struct htable*);
 
 void *htable_lookup(struct htable*, void *key);
 int htable_insert(struct htable*, void *key, void *val);
 void *htable_remove(struct htable*, void *key);
 
 void htable_foreach(struct htable*, void (*fun)(void *key, void *val, void *param), void *param);
+void htable_foreach_part(struct htable*, uint32_t part, uint32_t nparts,
+                         void (*fun)(void *key, void *val, void *param), void *param);
 void htable_filter(struct htable*, int (*fun)(void *key, void *val, void *param), void *param);
 
 #endif /* end of include guard: HTABLE_H */
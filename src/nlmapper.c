@@ -51,7 +51,7 @@ struct nlm_page {
     unsigned int is_nonlinear : 1;
 
     union {
-        LIST_ENTRY(nlm_page) free;
+        TAILQ_ENTRY(nlm_page) free;
         RB_ENTRY(nlm_page) inuse;
     } index;
 };
@@ -67,8 +67,7 @@ struct nlm {
     size_t pgcnt;
     struct {
         uint64_t size;
-        LIST_HEAD(free_list_head, nlm_page) head;
-        struct nlm_page *last;
+        TAILQ_HEAD(free_list_head, nlm_page) head;
     } free_list; // all free pages are here
 
     RB_HEAD(nlm_tree, nlm_page) root; // all in_use pages are here
@@ -94,13 +93,7 @@ static void __nlm_free_page(struct nlm *nlm, struct nlm_page *p, int update_in_u
         RB_REMOVE(nlm_tree, &nlm->root, p);
     }
 
-    if (nlm->free_list.size == 0) {
-        LIST_INSERT_HEAD(&nlm->free_list.head, p, index.free);
-        assert(nlm->free_list.last == NULL && "Invalid last pointer");
-    } else
-        LIST_INSERT_AFTER(nlm->free_list.last, p, index.free);
-
-    nlm->free_list.last = p;
+    TAILQ_INSERT_TAIL(&nlm->free_list.head, p, index.free);
     nlm->free_list.size++;
     MARK_PAGE_AS_FREE(p);
 }
@@ -112,12 +105,9 @@ static void __nlm_free_page(struct nlm *nlm, struct nlm_page *p, int update_in_u
 static void __nlm_use_page(struct nlm *nlm, struct nlm_page *p)
 {
     assert(p->is_free && "invalid page status");
-    LIST_REMOVE(p, index.free);
+    TAILQ_REMOVE(&nlm->free_list.head, p, index.free);
     nlm->free_list.size--;
 
-    if (!nlm->free_list.size)
-        nlm->free_list.last = NULL;
-
     RB_INSERT(nlm_tree, &nlm->root, p);
     MARK_PAGE_AS_INUSE(p);
 }
@@ -216,7 +206,6 @@ void (*Func_map_file)(struct nlm *nlm, int update_free_list) = map_appending;
 
 void nlm_grow_file(struct nlm *nlm, size_t new_size)
 {
-    assert(nlm->free_list.size == 0 && "growing file while with free pages");
     LOG(5, "Growing container file from %lu (pgs: %lu) to %lu (pgs: %lu)",
             nlm->file_size, nlm->file_size/PAGE_SIZE, new_size, new_size/PAGE_SIZE);
     STATS_INC_CONTGROW();
@@ -237,12 +226,78 @@ void nlm_grow_file(struct nlm *nlm, size_t new_size)
     nlm->is_fully_mapped = 0;
 }
 
-void *nlm_alloc_pages(void *handler, size_t n, size_t *laddr, int flags)
+/*
+ * Return the first page of a run of n free pages that are linearly mapped at
+ * contiguous addresses, or NULL if there is no such run in the free list.
+ *
+ * Pages are added to the free list in address order when the file grows, so
+ * we only look for runs of consecutive entries in the free list.
+ */
+static struct nlm_page *nlm_find_run(struct nlm *nlm, size_t n)
 {
-    handle_error("not implemented yet");
+    struct nlm_page *first = NULL;
+    struct nlm_page *prev = NULL;
+    struct nlm_page *p;
+    size_t len = 0;
+
+    TAILQ_FOREACH(p, &nlm->free_list.head, index.free) {
+        if (is_nonlinear(nlm, p)) {
+            len = 0;
+            prev = NULL;
+            continue;
+        }
+
+        if (prev && p->addr == prev->addr + PAGE_SIZE) {
+            len++;
+        } else {
+            first = p;
+            len = 1;
+        }
+
+        if (len == n)
+            return first;
+        prev = p;
+    }
+
     return NULL;
 }
 
+/*
+ * Allocate a run of n contiguous pages. Each page of the run is released
+ * individually with nlm_free_pages.
+ */
+void *nlm_alloc_pages(void *handler, size_t n, size_t *laddr, int flags)
+{
+    struct nlm *h = (struct nlm*) handler;
+    struct nlm_page *first, *p, *next;
+
+    first = nlm_find_run(h, n);
+    if (!first) {
+        nlm_grow_file(h, MAX(DOUBLE_FILE_SIZE(h), h->file_size + n * PAGE_SIZE));
+        Func_map_file(h, UPDATE_FREE_LIST);
+        first = nlm_find_run(h, n);
+        assert(first && "Failed to find a run of pages after growing the file");
+    }
+
+    p = first;
+    for (size_t i = 0; i < n; i++) {
+        next = TAILQ_NEXT(p, index.free);
+        __nlm_use_page(h, p);
+        p = next;
+    }
+
+    LOG(25, "Allocing %lu new pages {addr: %p, offset: %lu, pgno: %lu}",
+            n, first->addr, first->pgoff, first->pgoff/PAGE_SIZE);
+
+    if (laddr)
+        *laddr = first->pgoff;
+
+    if (flags & PA_PROT_WRITE)
+        page_allocator_mprotect_generic(first->addr, n * PAGE_SIZE, flags & PA_PROT_MASK);
+
+    return first->addr;
+}
+
 void *nlm_alloc_page(void *handler, size_t *laddr, int flags)
 {
     struct nlm *h = (struct nlm*) handler;
@@ -253,7 +308,7 @@ void *nlm_alloc_page(void *handler, size_t *laddr, int flags)
         Func_map_file(h, UPDATE_FREE_LIST);
     }
 
-    p = LIST_FIRST(&h->free_list.head);
+    p = TAILQ_FIRST(&h->free_list.head);
     __nlm_use_page(h, p);
     LOG(25, "Allocing new page {addr: %p, offset: %lu, pgno: %lu}",
             p->addr, p->pgoff, p->pgoff/PAGE_SIZE);
@@ -262,7 +317,7 @@ void *nlm_alloc_page(void *handler, size_t *laddr, int flags)
         *laddr = p->pgoff;
 
     if (flags & PA_PROT_WRITE)
-        page_allocator_mprotect_generic(p->addr, PAGE_SIZE, flags);
+        page_allocator_mprotect_generic(p->addr, PAGE_SIZE, flags & PA_PROT_MASK);
 
     return p->addr;
 }
@@ -291,6 +346,11 @@ void *nlm_get_address(void *handler, size_t laddr)
     return maddr;
 }
 
+int nlm_norelocate(void *handler, void *addr)
+{
+    return -1;
+}
+
 int nlm_close(void *handler)
 {
     struct nlm *h = (struct nlm*) handler;
@@ -308,9 +368,9 @@ int nlm_close(void *handler)
     }
 
     while (h->free_list.size) {
-        p = LIST_FIRST(&h->free_list.head);
+        p = TAILQ_FIRST(&h->free_list.head);
         assert(p->is_free && "invalid page status");
-        LIST_REMOVE(p, index.free);
+        TAILQ_REMOVE(&h->free_list.head, p, index.free);
         LOG(50, "Freeing page {addr: %p, pgoff: %lu, pgno: %lu}", p->addr, p->pgoff, p->pgoff/PAGE_SIZE);
         free(p);
         h->free_list.size--;
@@ -331,7 +391,7 @@ void *nlm_init()
     char *ptr;
 
     assert(nlm && "Failed to allocate memory");
-    LIST_INIT(&nlm->free_list.head);
+    TAILQ_INIT(&nlm->free_list.head);
     RB_INIT(&nlm->root);
 
     ptr = getenv("PMLIB_CONT_FILE");
@@ -429,6 +489,7 @@ struct page_allocator_ops *nonlinear_mapper_ops()
         .map_page = nlm_get_address,
         .swap_page_mapping = nlm_swap_pages,
         .protect_page = page_allocator_mprotect_generic,
+        .relocate = nlm_norelocate,
     };
     return &ops;
 }
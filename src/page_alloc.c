@@ -98,6 +98,13 @@ void page_allocator_mprotect(unsigned int cid, void *maddr, size_t size, int fla
     pa->pa_ops->protect_page(maddr, size, flags);
 }
 
+int page_allocator_relocate(unsigned int cid, void *addr)
+{
+    struct page_allocator *pa;
+    pa = get_page_allocator(cid);
+    return pa->pa_ops->relocate(pa->pa_handler, addr);
+}
+
 void page_allocator_mprotect_generic(void *maddr, size_t size, int flags)
 {
     STATS_INC_MPROTECT();
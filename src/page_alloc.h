@@ -4,9 +4,15 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 
+#define PA_PROT_NONE    PROT_NONE
 #define PA_PROT_READ    PROT_READ
 #define PA_PROT_WRITE   PROT_WRITE
 #define PA_PROT_RNW     (PROT_READ|PROT_WRITE)
+#define PA_PROT_MASK    (PA_PROT_RNW)
+
+/* placement hints, the fixed mapper keeps each kind of page in its own zone */
+#define PA_DATA         (1 << 8)    ///< slab data pages
+#define PA_SNAPSHOT     (1 << 9)    ///< snapshots of slab data pages
 
 struct page_allocator_ops {
     const char *name;
@@ -18,6 +24,7 @@ struct page_allocator_ops {
     void* (*map_page)(void*, size_t);
     void (*swap_page_mapping)(void*, void*, size_t, void*, size_t);
     void (*protect_page)(void*, size_t, int);
+    int (*relocate)(void*, void*);
 };
 
 struct page_allocator {
@@ -36,6 +43,9 @@ void page_allocator_init_complete(unsigned int cid);
 void page_allocator_swap_mappings(unsigned int cid, void *xaddr, size_t ypgoff, void *yaddr, size_t xpgoff);
 void page_allocator_mprotect(unsigned int cid, void *maddr, size_t size, int flags);
 
+/* map the container at addr instead; return 0 on success */
+int page_allocator_relocate(unsigned int cid, void *addr);
+
 void page_allocator_mprotect_generic(void *maddr, size_t size, int flags);
 
 #endif /* end of include guard: PAGE_ALLOC_H */
@@ -1,89 +1,217 @@
+#include <pthread.h>
+#include <unistd.h>
+
 #include "slabInt.h"
 #include "cont.h"
 #include "atomics.h"
 #include "page_alloc.h"
+#include "out.h"
+
+/* most threads used to restore a container, and fewest items per thread */
+#define RESTORE_MAX_THREADS     64
+#define RESTORE_MIN_ITEMS       64
+
+int RESTORE_THREADS = 0;    ///< PMLIB_RESTORE_THREADS, 0 for one per online CPU
+
+struct restore_job {
+    const char *what;
+    uint64_t n;
+    uint64_t next;      ///< next item to run
+    uint64_t done;      ///< number of items done, for the progress reports
+    void (*fun)(void *arg, uint64_t i);
+    void *arg;
+};
+
+static void *restore_worker(void *arg)
+{
+    struct restore_job *job = arg;
+    uint64_t i, done, step = MAX(job->n / 10, 1);
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+        job->fun(job->arg, i);
+        done = __sync_add_and_fetch(&job->done, 1);
+        if (done % step == 0)
+            LOG(4, "Restored %lu/%lu %s", done, job->n, job->what);
+    }
+
+    return NULL;
+}
+
+/*
+ * Run fun(arg, i) for every i in [0, n) on up to nthreads threads, the
+ * calling thread being one of them. With a single thread, the items are run
+ * in order.
+ */
+void slab_restore_parallel(uint64_t n, int nthreads, void (*fun)(void *arg, uint64_t i),
+                           void *arg, const char *what)
+{
+    struct restore_job job = { .what = what, .n = n, .fun = fun, .arg = arg };
+    pthread_t tids[RESTORE_MAX_THREADS];
+    int started = 0;
+
+    if (nthreads == 0)
+        nthreads = RESTORE_THREADS ? RESTORE_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MIN(nthreads, MIN(RESTORE_MAX_THREADS, n / RESTORE_MIN_ITEMS));
+
+    LOG(4, "Restoring %lu %s with %d thread(s)", n, what, MAX(nthreads, 1));
+
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[started], NULL, restore_worker, &job) == 0)
+            started++;
+    }
+
+    restore_worker(&job);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+}
 
 static void index_slab_entry(unsigned int cid, struct slab_dir *sd, struct slab_entry *se)
 {
     struct slab_entry_size *es;
+    struct slab_entry_size key = SLAB_ENTRY_SIZE_KEY(se);
 
-    if (SLAB_ENTRY_IS_INIT(se)) {
-        struct slab_entry_size key = { .es_size = se->se_size };
-        es = RB_FIND(sizes_slab_entry_tree, &sd->sd_size_root, &key);
-        if (es) {
-            //TODO: consider caching the size to avoid calling slab_entry_full again. It's slow!
-            if (slab_entry_full(se))
-                STAILQ_INSERT_TAIL(&es->es_list, se, se_list);
-            else
-                STAILQ_INSERT_HEAD(&es->es_list, se, se_list);
-        } else {
-            es = slab_entry_size_init(se->se_size);
-            RB_INSERT(sizes_slab_entry_tree, &sd->sd_size_root, es);
+    es = RB_FIND(sizes_slab_entry_tree, &sd->sd_size_root, &key);
+    if (es) {
+        if (SLAB_ENTRY_FULL(se))
             STAILQ_INSERT_TAIL(&es->es_list, se, se_list);
-        }
-        RB_INSERT(used_slab_entry_tree, &sd->sd_maddr_root, se);
+        else
+            STAILQ_INSERT_HEAD(&es->es_list, se, se_list);
     } else {
-        STAILQ_INSERT_TAIL(&sd->sd_free_list, se, se_list);
+        es = slab_entry_size_init(se->se_size, se->se_data.current.type);
+        RB_INSERT(sizes_slab_entry_tree, &sd->sd_size_root, es);
+        STAILQ_INSERT_TAIL(&es->es_list, se, se_list);
+    }
+    RB_INSERT(used_slab_entry_tree, &sd->sd_maddr_root, se);
+}
+
+/*
+ * The slab_bucket(s) are mapped by the restore threads. Each one is a task,
+ * which keeps the entries of its bucket in lists (linked by se_list) until
+ * the tasks are done. The lists are then merged into the slab_dir indexes in
+ * the order of the tasks, so the indexes are the same as when the buckets
+ * are mapped one after the other.
+ */
+struct bucket_task {
+    size_t laddr;
+    int indexing;
+    struct slab_bucket **maddr;         ///< where the bucket address goes
+    struct slab_bucket **maddr_copy;    ///< where it goes as well, or NULL
+    struct slab_entry_free_list used;   ///< filled by the task
+    struct slab_entry_free_list free;   ///< filled by the task
+};
+
+struct restore_ctx {
+    unsigned int cid;
+    int type;
+    VECTOR_DECL(bucket_task_vector, struct bucket_task) tasks;
+};
+
+static void queue_bucket(struct restore_ctx *ctx, size_t laddr, int indexing,
+                         struct slab_bucket **maddr, struct slab_bucket **maddr_copy)
+{
+    struct bucket_task t = {
+        .laddr = laddr,
+        .indexing = indexing,
+        .maddr = maddr,
+        .maddr_copy = maddr_copy,
+    };
+
+    VECTOR_APPEND(&ctx->tasks, t);
+}
+
+extern void (*Func_slab_entry_commit)(unsigned int cid, struct slab_entry *se);
+
+/*
+ * A slab_entry checkpointed in the soft-dirty mode keeps the version of the
+ * checkpoint in a redo copy, and its data pages may hold later changes. The
+ * redo copy is written back to the data pages. In the soft-dirty mode the
+ * redo copy remains the version of the checkpoint; otherwise the data pages
+ * become the version of the checkpoint again.
+ */
+static void slab_entry_redo(unsigned int cid, struct slab_entry *se)
+{
+    se->se_data.current.maddr = page_allocator_mappage(cid, se->se_data.current.laddr);
+    se->se_data.snapshot.maddr = page_allocator_mappage(cid, se->se_data.snapshot.laddr);
+
+    pmemcpy(se->se_data.current.maddr, se->se_data.snapshot.maddr, SLAB_ENTRY_DATASIZE(se));
+
+    if (Func_slab_entry_commit != slab_entry_redo_commit) {
+        atomic_set(&se->se_data.snapshot.laddr, se->se_data.current.laddr);
+        se->se_data.snapshot.maddr = se->se_data.current.maddr;
     }
 }
 
-static struct slab_bucket *slab_bucket_map(unsigned int cid, struct slab_dir *sd, size_t laddr, int type, int indexing)
+static void slab_bucket_map(void *arg, uint64_t i)
 {
+    struct restore_ctx *ctx = arg;
+    struct bucket_task *t = &VECTOR_AT(&ctx->tasks, i);
+    unsigned int cid = ctx->cid;
+    int type = ctx->type;
     struct slab_bucket *sb;
     struct slab_entry *se;
-    int i;
 
-    sb = page_allocator_mappage(cid, laddr);
+    sb = page_allocator_mappage(cid, t->laddr);
+    STAILQ_INIT(&t->used);
+    STAILQ_INIT(&t->free);
 
-    for (i = 0; i < SLAB_BUCKET_ENTRIES; i++) {
-        se = &sb->sb_entries[i];
+    for (int j = 0; j < SLAB_BUCKET_ENTRIES; j++) {
+        se = &sb->sb_entries[j];
         if (SLAB_ENTRY_IS_INIT(se)) {
             if (type == CPOINT_INCOMPLETE) {
                 se->se_data.current.maddr = page_allocator_mappage(cid, se->se_data.current.laddr);
                 se->se_data.snapshot.maddr = page_allocator_mappage(cid, se->se_data.snapshot.laddr);
 
-                se->se_ptr.current.maddr = page_allocator_mappage(cid, se->se_ptr.current.laddr);
-                se->se_ptr.snapshot.maddr = page_allocator_mappage(cid, se->se_ptr.snapshot.laddr);
+                se->se_ptr.current.maddr = slab_ptr_map(cid, se->se_ptr.current.laddr);
+                se->se_ptr.snapshot.maddr = slab_ptr_map(cid, se->se_ptr.snapshot.laddr);
             } else if (type == CPOINT_COMPLETE) {
-                assert(se->se_data.current.laddr == se->se_data.snapshot.laddr && "Inconsistent state on slab_entry data");
-                se->se_data.current.maddr = page_allocator_mappage(cid, se->se_data.snapshot.laddr);
-                se->se_data.snapshot.maddr = se->se_data.current.maddr;
-                se->se_data.current.laddr = se->se_data.snapshot.laddr;
+                if (se->se_data.current.laddr != se->se_data.snapshot.laddr) {
+                    slab_entry_redo(cid, se);
+                } else {
+                    se->se_data.current.maddr = page_allocator_mappage(cid, se->se_data.snapshot.laddr);
+                    se->se_data.snapshot.maddr = se->se_data.current.maddr;
+                }
 
                 assert(se->se_ptr.current.laddr == se->se_ptr.snapshot.laddr && "Inconsistent state on slab_entry ptrs");
-                se->se_ptr.current.maddr = page_allocator_mappage(cid, se->se_ptr.snapshot.laddr);
+                se->se_ptr.current.maddr = slab_ptr_map(cid, se->se_ptr.snapshot.laddr);
                 se->se_ptr.snapshot.maddr = se->se_ptr.current.maddr;
                 se->se_ptr.current.laddr = se->se_ptr.snapshot.laddr;
             } else
                 handle_error("invalid restore type\n");
         }
 
-        if (indexing)
-            index_slab_entry(cid, sd, se);
+        if (t->indexing) {
+            if (SLAB_ENTRY_IS_INIT(se))
+                STAILQ_INSERT_TAIL(&t->used, se, se_list);
+            else
+                STAILQ_INSERT_TAIL(&t->free, se, se_list);
+        }
     }
 
-    return sb;
+    *t->maddr = sb;
+    if (t->maddr_copy)
+        *t->maddr_copy = sb;
 }
 
 
-static struct slab_inner* slab_inner_map(unsigned int cid, struct slab_dir *sd, size_t laddr, int type)
+static struct slab_inner* slab_inner_map(struct restore_ctx *ctx, size_t laddr)
 {
     struct slab_inner *si;
     int i;
 
-    si = page_allocator_mappage(cid, laddr);
+    si = page_allocator_mappage(ctx->cid, laddr);
 
     for (i = 0; i < si->si_index; i++) {
         if (NOT_CS_CONSISTENT(si->si_current[i].laddr,  si->si_snapshot[i].laddr))
             handle_error("found inconsistent state while restoring inner\n");
 
         if (si->si_current[i].laddr) {
-            if (type == CPOINT_INCOMPLETE) {
-                si->si_current[i].maddr = slab_bucket_map(cid, sd, si->si_current[i].laddr, type, 1);
-                si->si_snapshot[i].maddr = slab_bucket_map(cid, sd, si->si_snapshot[i].laddr, type, 0);
-            } else if (type == CPOINT_COMPLETE) {
-                si->si_current[i].maddr = slab_bucket_map(cid, sd, si->si_snapshot[i].laddr, type, 1);
-                si->si_snapshot[i].maddr = si->si_current[i].maddr;
+            if (ctx->type == CPOINT_INCOMPLETE) {
+                queue_bucket(ctx, si->si_current[i].laddr, 1, &si->si_current[i].maddr, NULL);
+                queue_bucket(ctx, si->si_snapshot[i].laddr, 0, &si->si_snapshot[i].maddr, NULL);
+            } else if (ctx->type == CPOINT_COMPLETE) {
+                queue_bucket(ctx, si->si_snapshot[i].laddr, 1,
+                             &si->si_current[i].maddr, &si->si_snapshot[i].maddr);
                 si->si_current[i].laddr = si->si_snapshot[i].laddr;
             } else
                 handle_error("invalid restore type\n");
@@ -94,12 +222,13 @@ static struct slab_inner* slab_inner_map(unsigned int cid, struct slab_dir *sd,
 }
 
 
-static struct slab_outer* slab_outer_map(unsigned int cid, struct slab_dir *sd, size_t laddr, int type)
+static struct slab_outer* slab_outer_map(struct restore_ctx *ctx, size_t laddr)
 {
     struct slab_outer *so;
+    int type = ctx->type;
     int i;
 
-    so = page_allocator_mappage(cid, laddr);
+    so = page_allocator_mappage(ctx->cid, laddr);
 
     for (i = 0; i < so->so_index; i++) {
         if (NOT_CS_CONSISTENT(so->so_current[i].laddr, so->so_snapshot[i].laddr))
@@ -107,10 +236,10 @@ static struct slab_outer* slab_outer_map(unsigned int cid, struct slab_dir *sd,
 
         if (so->so_current[i].laddr) {
             if (type == CPOINT_INCOMPLETE) {
-                so->so_current[i].maddr = slab_inner_map(cid, sd, so->so_current[i].laddr, type);
-                so->so_snapshot[i].maddr = slab_inner_map(cid, sd, so->so_snapshot[i].laddr, type);
+                so->so_current[i].maddr = slab_inner_map(ctx, so->so_current[i].laddr);
+                so->so_snapshot[i].maddr = slab_inner_map(ctx, so->so_snapshot[i].laddr);
             } else if (type == CPOINT_COMPLETE) {
-                so->so_current[i].maddr = slab_inner_map(cid, sd, so->so_snapshot[i].laddr, type);
+                so->so_current[i].maddr = slab_inner_map(ctx, so->so_snapshot[i].laddr);
                 so->so_snapshot[i].maddr = so->so_current[i].maddr;
                 so->so_current[i].laddr = so->so_snapshot[i].laddr;
             } else
@@ -121,15 +250,26 @@ static struct slab_outer* slab_outer_map(unsigned int cid, struct slab_dir *sd,
     return so;
 }
 
+/*
+ * The slab is mapped in three steps: the slab_dir, slab_outer(s) and
+ * slab_inner(s) are mapped first, which queues their buckets; then the
+ * buckets are mapped in parallel; and finally the entries of the buckets are
+ * indexed. A checkpoint that did not complete is restored on a single thread,
+ * as the current and snapshot trees may share buckets.
+ */
 struct slab_dir* slab_map(unsigned int cid, size_t laddr, int type)
 {
+    struct restore_ctx ctx = { .cid = cid, .type = type };
     struct slab_dir *sd;
+    struct slab_entry *se;
+    struct bucket_task *t;
     int i;
 
     sd = page_allocator_mappage(cid, laddr);
     RB_INIT(&sd->sd_maddr_root);
     RB_INIT(&sd->sd_size_root);
     STAILQ_INIT(&sd->sd_free_list);
+    VECTOR_INIT(&ctx.tasks);
 
     for (i = 0; i < sd->sd_index; i++) {
         if (NOT_CS_CONSISTENT(sd->sd_current[i].laddr, sd->sd_snapshot[i].laddr))
@@ -137,10 +277,10 @@ struct slab_dir* slab_map(unsigned int cid, size_t laddr, int type)
 
         if (sd->sd_current[i].laddr) {
             if (type == CPOINT_INCOMPLETE) {
-                sd->sd_current[i].maddr = slab_outer_map(cid, sd, sd->sd_current[i].laddr, type);
-                sd->sd_snapshot[i].maddr = slab_outer_map(cid, sd, sd->sd_snapshot[i].laddr, type);
+                sd->sd_current[i].maddr = slab_outer_map(&ctx, sd->sd_current[i].laddr);
+                sd->sd_snapshot[i].maddr = slab_outer_map(&ctx, sd->sd_snapshot[i].laddr);
             } else if (type == CPOINT_COMPLETE) {
-                sd->sd_current[i].maddr = slab_outer_map(cid, sd, sd->sd_snapshot[i].laddr, type);
+                sd->sd_current[i].maddr = slab_outer_map(&ctx, sd->sd_snapshot[i].laddr);
                 sd->sd_snapshot[i].maddr = sd->sd_current[i].maddr;
                 sd->sd_current[i].laddr = sd->sd_snapshot[i].laddr;
             } else
@@ -148,5 +288,38 @@ struct slab_dir* slab_map(unsigned int cid, size_t laddr, int type)
         }
     }
 
+    slab_restore_parallel(VECTOR_SIZE(&ctx.tasks), type == CPOINT_COMPLETE ? 0 : 1,
+                          slab_bucket_map, &ctx, "slab_bucket(s)");
+
+    for (i = 0; i < VECTOR_SIZE(&ctx.tasks); i++) {
+        t = &VECTOR_AT(&ctx.tasks, i);
+        if (!t->indexing)
+            continue;
+        /* the checkpoint only visits the dirty set, so rebuild it */
+        if ((*t->maddr)->sb_has_snapshot)
+            slab_dirty_add_bucket(*t->maddr);
+        while ((se = STAILQ_FIRST(&t->used))) {
+            STAILQ_REMOVE_HEAD(&t->used, se_list);
+            index_slab_entry(cid, sd, se);
+        }
+        STAILQ_CONCAT(&sd->sd_free_list, &t->free);
+    }
+    VECTOR_FREE(&ctx.tasks);
+
+    if (type == CPOINT_INCOMPLETE) {
+        for (i = 0; i < sd->sd_index; i++) {
+            struct slab_outer *so = sd->sd_current[i].maddr;
+            for (int j = 0; j < so->so_index; j++)
+                slab_dirty_add_inner(i, j);
+            slab_dirty_add_outer(i);
+        }
+    }
+
+    /* new buckets are numbered after the last bucket of the slab */
+    struct slab_outer *so = sd->sd_current[sd->sd_index - 1].maddr;
+    struct slab_inner *si = so->so_current[so->so_index - 1].maddr;
+    slab_bucket_set_next_id(((sd->sd_index - 1) * SLAB_OUTER_ENTRIES + (so->so_index - 1)) *
+                            SLAB_INNER_ENTRIES + si->si_index);
+
     return sd;
 }
@@ -9,6 +9,8 @@
 
 /* file mapper settings */
 #define FM_FILE_SIZE    (PAGE_SIZE * 2)
+#define FM_ZONE_SIZE    (PAGE_SIZE * 16)    ///< smallest extent added to a zone
+#define FM_RESERVE_SIZE (1UL << 40)         ///< address range reserved for the file
 
 #define FM_FILE_NAME_PREFIX "/tmp/container"
 
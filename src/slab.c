@@ -1,12 +1,16 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "slab.h"
 #include "slabInt.h"
 #include "cont.h"
 #include "page_alloc.h"
+#include "wtracker.h"
+#include "softdirty.h"
 #include "macros.h"
 #include "atomics.h"
 
@@ -14,11 +18,29 @@
 #include "stats.h"
 
 static unsigned int NEXT_SLAB_BUCKET_ID = 0;
-static unsigned int NEXT_SLAB_ENTRY_ID = 0;
 
-//TODO: this will need a lock
-#define GET_NEXT_BUCKET_ID()            (NEXT_SLAB_BUCKET_ID++)
-#define GET_NEXT_SLAB_ENTRY_ID()        (NEXT_SLAB_ENTRY_ID++)
+#define GET_NEXT_BUCKET_ID()            __sync_fetch_and_add(&NEXT_SLAB_BUCKET_ID, 1)
+
+/*
+ * The slab lock serializes changes to the structures shared by all threads:
+ * the slab tree, the lists and trees of slab_entry(s), and the page
+ * allocator. It is recursive because a thread that holds it may fault on a
+ * data page, and the SIGSEGV handler takes it as well. With the userfaultfd
+ * write tracker the fault is handled by another thread, so code that holds
+ * the lock must unprotect data pages before writing to them.
+ * TODO: add support for multiple containers
+ */
+static pthread_mutex_t SLAB_LOCK;
+
+void slab_lock(unsigned int cid)
+{
+    pthread_mutex_lock(&SLAB_LOCK);
+}
+
+void slab_unlock(unsigned int cid)
+{
+    pthread_mutex_unlock(&SLAB_LOCK);
+}
 
 #define OFFSET_SIZE_BITS    (sizeof(uint16_t) << 3)
 
@@ -47,7 +69,7 @@ int slab_entry_compare_by_maddr(struct slab_entry *a, struct slab_entry *b)
     if (SLAB_ENTRY_SEARCH_TYPE(a) == SE_SEARCH_MADDR)
         return (a->se_data.current.maddr < b->se_data.current.maddr ?
                 -1 :
-                a->se_data.current.maddr >= b->se_data.current.maddr + PAGE_SIZE);
+                a->se_data.current.maddr >= b->se_data.current.maddr + SLAB_ENTRY_DATASIZE(b));
     else {
         return (a->se_data.current.maddr < b->se_data.current.maddr ?
                 -1 :
@@ -59,40 +81,111 @@ int slab_entry_compare_by_maddr(struct slab_entry *a, struct slab_entry *b)
 
 int slab_entry_size_compare_by_size(struct slab_entry_size *a, struct slab_entry_size *b)
 {
-    return (a->es_size < b->es_size ? -1 : a->es_size > b->es_size);
+    if (a->es_size != b->es_size)
+        return (a->es_size < b->es_size ? -1 : 1);
+    return (a->es_type < b->es_type ? -1 : a->es_type > b->es_type);
 }
 
-struct slab_entry_size *slab_entry_size_init(int size)
+struct slab_entry_size *slab_entry_size_init(int size, int type)
 {
     struct slab_entry_size *es;
     es = calloc(1, sizeof(*es));
     es->es_size = size;
+    es->es_type = type;
     STAILQ_INIT(&es->es_list);
     return es;
 }
 
-int slab_entry_init(unsigned int cid, struct slab_entry *se, int size)
+int slab_entry_init(unsigned int cid, struct slab_entry *se, int size, int type)
 {
     assert(se && "Invalid pointer");
 
     STATS_INC_SEINIT();
 
-    se->se_data.current.maddr = page_allocator_getpage(cid, &se->se_data.current.laddr, PA_PROT_READ);
+    se->se_size = size;
+    se->se_data.current.type = type;
+    se->se_data.current.maddr = write_tracker_alloc_pages(cid, SLAB_ENTRY_NPAGES(se),
+                                                          &se->se_data.current.laddr);
     se->se_data.snapshot.maddr = se->se_data.current.maddr;
     se->se_data.snapshot.laddr = se->se_data.current.laddr;
+    se->se_data.current.nfree = SLAB_ENTRY_CAPACITY(se);
+
+    /* a recycled data page may hold the bitmap of its previous owner */
+    if (se->se_size < SLAB_LARGE_ALLOC) {
+        if (slab_bitmap_count(SLAB_ENTRY_CBITMAP(se), SLAB_ENTRY_CAPACITY(se))) {
+            write_tracker_unprotect(cid, se->se_data.current.maddr, PAGE_SIZE);
+            memset(se->se_data.current.maddr, 0, SLAB_ENTRY_DATAOFFSET(se));
+            write_tracker_protect(cid, se->se_data.current.maddr, PAGE_SIZE);
+        }
+    } else {
+        memset(se->se_data.current.bitmap, 0, sizeof(se->se_data.current.bitmap));
+    }
+
     se->se_ptr.current.idx = se->se_ptr.snapshot.idx = 0;
+    se->se_ptr.current.size = se->se_ptr.snapshot.size = 0;
     se->se_ptr.current.maddr = se->se_ptr.snapshot.maddr = NULL;
     se->se_ptr.current.laddr = se->se_ptr.snapshot.laddr = 0;
-    se->se_size = size;
-    se->se_id = GET_NEXT_SLAB_ENTRY_ID();
+    se->se_id = SLAB_ENTRY_ID(se);
     return 0;
 }
 
+/*
+ * Buckets are numbered in the order they are added to the slab. After a
+ * restore, numbering continues after the last bucket found in the container.
+ */
+void slab_bucket_set_next_id(unsigned int sb_id)
+{
+    if (sb_id > NEXT_SLAB_BUCKET_ID)
+        NEXT_SLAB_BUCKET_ID = sb_id;
+}
+
+/*
+ * Return the data run at maddr, which belongs to se, to the page allocator
+ */
+void slab_entry_freepages(unsigned int cid, struct slab_entry *se, void *maddr)
+{
+    for (size_t off = 0; off < SLAB_ENTRY_DATASIZE(se); off += PAGE_SIZE)
+        page_allocator_freepages(cid, maddr + off);
+}
+
+/*
+ * Return an empty slab_entry to the free list of the slab. This is only
+ * called at checkpoint time, once the snapshot of the data run is no longer
+ * needed, so the data and ptr pages can be given back to the page allocator.
+ */
+void slab_entry_release(unsigned int cid, struct slab_entry *se)
+{
+    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
+    struct slab_entry_size *es;
+
+    assert(SLAB_ENTRY_EMPTY(se) && "Releasing a slab_entry with allocated objects");
+
+    STATS_INC_SERELEASE();
+
+    struct slab_entry_size key = SLAB_ENTRY_SIZE_KEY(se);
+    es = RB_FIND(sizes_slab_entry_tree, &sd->sd_size_root, &key);
+    if (es)
+        STAILQ_REMOVE(&es->es_list, se, slab_entry, se_list);
+    RB_REMOVE(used_slab_entry_tree, &sd->sd_maddr_root, se);
+
+    /* the pages may be reused for metadata, which is never write-protected */
+    write_tracker_unprotect(cid, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+    slab_entry_freepages(cid, se, se->se_data.current.maddr);
+    slab_ptr_release(cid, se);
+
+    se->se_size = 0;
+    memset(&se->se_data, 0, sizeof(se->se_data));
+    memset(&se->se_ptr, 0, sizeof(se->se_ptr));
+
+    STAILQ_INSERT_TAIL(&sd->sd_free_list, se, se_list);
+}
+
 struct slab_outer* slab_outer_init(unsigned int cid, size_t *laddr)
 {
     struct slab_outer *so;
     STATS_INC_SOINIT();
     so = (struct slab_outer*) page_allocator_getpage(cid, laddr, PA_PROT_WRITE);
+    memset(so, 0, PAGE_SIZE);   // the page may have been used before
     return so;
 }
 
@@ -101,6 +194,7 @@ struct slab_inner* slab_inner_init(unsigned int cid, size_t *laddr)
     struct slab_inner *si;
     STATS_INC_SIINIT();
     si = (struct slab_inner*) page_allocator_getpage(cid, laddr, PA_PROT_WRITE);
+    memset(si, 0, PAGE_SIZE);   // the page may have been used before
     return si;
 }
 
@@ -179,33 +273,37 @@ struct slab_dir* slab_dir_init(unsigned int cid, size_t *laddr)
     return sd;
 }
 
-void slab_mprotect_datapgs(unsigned int cid, int prot)
+static int slab_entry_is_unfixed(struct slab_entry *se);
+
+/*
+ * The tree of used slab_entry(s) is sorted by address, so adjacent data runs
+ * are protected with a single call. The data runs whose pointers are fixed
+ * lazily are made inaccessible on top of that.
+ */
+void slab_protect_datapgs(unsigned int cid)
 {
     struct slab_dir *sd = get_container(cid)->current_slab.maddr;
-    struct slab_outer *so;
-    struct slab_inner *si;
-    struct slab_bucket *sb;
+    struct write_tracker_batch batch;
     struct slab_entry *se;
-    int i, j, k, l;
-
-    for (i = 0; i < sd->sd_index; i++) {
-        so = sd->sd_current[i].maddr;
-        for (j = 0; j < so->so_index; j++) {
-            si = so->so_current[j].maddr;
-            for (k = 0; k < si->si_index; k++) {
-                sb = si->si_current[k].maddr;
-                for (l = 0; l < SLAB_BUCKET_ENTRIES; l++) {
-                    se = &sb->sb_entries[l];
-
-                    if (!SLAB_ENTRY_IS_INIT(se))
-                        continue;
-
-                    //TODO: handle the case for allocation bigger than a page
-                    page_allocator_mprotect(cid, se->se_data.current.maddr, PAGE_SIZE, prot);
-                }
-            }
+    void *start = NULL, *end = NULL;
+
+    write_tracker_batch_init(&batch, cid);
+    RB_FOREACH(se, used_slab_entry_tree, &sd->sd_maddr_root)
+        write_tracker_batch_protect(&batch, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+    write_tracker_batch_flush(&batch);
+
+    RB_FOREACH(se, used_slab_entry_tree, &sd->sd_maddr_root) {
+        if (!slab_entry_is_unfixed(se))
+            continue;
+        if (se->se_data.current.maddr != end) {
+            if (end)
+                page_allocator_mprotect(cid, start, end - start, PA_PROT_NONE);
+            start = se->se_data.current.maddr;
         }
+        end = se->se_data.current.maddr + SLAB_ENTRY_DATASIZE(se);
     }
+    if (end)
+        page_allocator_mprotect(cid, start, end - start, PA_PROT_NONE);
 }
 
 static struct slab_entry *get_slab_entry_by_id(unsigned int cid, unsigned int seid)
@@ -227,51 +325,238 @@ static struct slab_entry *get_slab_entry_by_id(unsigned int cid, unsigned int se
     return se;
 }
 
-static void do_fixptrs(unsigned int cid)
+/*
+ * Write the pointers of se into its data run, which is mapped at data
+ */
+static void slab_entry_fixptrs(unsigned int cid, struct slab_entry *se_loc, void *data)
+{
+    struct slab_ptr_iter it;
+    struct slab_ptr *sp;
+    struct slab_entry *se_val = NULL;
+    void **ptr_loc;
+
+    slab_ptr_iter_init(&it, se_loc);
+    while ((sp = slab_ptr_next(&it))) {
+        ptr_loc = data + sp->ploc_offset;
+
+        /* When the targe of the pointer is NULL, we use a special value for it */
+        if (sp->pval_seid == SLAB_PTR_SEID_NULL)
+            *ptr_loc = NULL;
+        else {
+            /* consecutive pointers often point to the same slab_entry */
+            if (!se_val || se_val->se_id != sp->pval_seid)
+                se_val = get_slab_entry_by_id(cid, sp->pval_seid);
+            *ptr_loc = se_val->se_data.current.maddr + sp->pval_offset;
+        }
+    }
+}
+
+struct fixptrs_ctx {
+    unsigned int cid;
+    VECTOR_DECL(slab_bucket_vector, struct slab_bucket*) buckets;
+};
+
+static void slab_collect_buckets(unsigned int cid, struct fixptrs_ctx *ctx)
 {
     struct slab_dir *sd = get_container(cid)->current_slab.maddr;
-    struct slab_entry *se_loc, *se_val;
     struct slab_outer *so;
     struct slab_inner *si;
-    struct slab_bucket *sb;
-    struct slab_ptr *sp;
-    void **ptr_loc;
 
+    ctx->cid = cid;
+    VECTOR_INIT(&ctx->buckets);
     for (int i = 0; i < sd->sd_index; i++) {
         so = sd->sd_current[i].maddr;
         for (int j = 0; j < so->so_index; j++) {
             si = so->so_current[j].maddr;
-            for (int k = 0; k < si->si_index; k++) {
-                sb = si->si_current[k].maddr;
-                for (int l = 0; l < SLAB_BUCKET_ENTRIES; l++) {
-                    se_loc = &sb->sb_entries[l];
-
-                    if (!SLAB_ENTRY_IS_INIT(se_loc))
-                        continue;
-
-                    sp = se_loc->se_ptr.current.maddr;
-                    for (int m = 0; m < se_loc->se_ptr.current.idx; m++) {
-                        ptr_loc = se_loc->se_data.current.maddr + sp->ptrs[m].ploc_offset;
-
-                        /* When the targe of the pointer is NULL, we use a special value for it */
-                        if (sp->ptrs[m].pval_seid == SLAB_PTR_SEID_NULL &&
-                                sp->ptrs[m].pval_offset == SLAB_PTR_OFFSET_NULL)
-                            *ptr_loc = NULL;
-                        else {
-                            se_val = get_slab_entry_by_id(cid, sp->ptrs[m].pval_seid);
-                            *ptr_loc = se_val->se_data.current.maddr + sp->ptrs[m].pval_offset;
-                        }
-                    }
-                }
-            }
+            for (int k = 0; k < si->si_index; k++)
+                VECTOR_APPEND(&ctx->buckets, si->si_current[k].maddr);
+        }
+    }
+}
+
+/*
+ * The pointers of a bucket are stored in the data pages of its entries, so
+ * buckets can be fixed in parallel
+ */
+static void fixptrs_bucket(void *arg, uint64_t i)
+{
+    struct fixptrs_ctx *ctx = arg;
+    struct slab_bucket *sb = VECTOR_AT(&ctx->buckets, i);
+    struct slab_entry *se;
+
+    for (int l = 0; l < SLAB_BUCKET_ENTRIES; l++) {
+        se = &sb->sb_entries[l];
+        if (SLAB_ENTRY_IS_INIT(se))
+            slab_entry_fixptrs(ctx->cid, se, se->se_data.current.maddr);
+    }
+}
+
+static int do_fixptrs(unsigned int cid)
+{
+    struct fixptrs_ctx ctx;
+
+    slab_collect_buckets(cid, &ctx);
+    slab_restore_parallel(VECTOR_SIZE(&ctx.buckets), 0, fixptrs_bucket, &ctx, "pointer bucket(s)");
+    VECTOR_FREE(&ctx.buckets);
+
+    return 0;
+}
+
+/*
+ * Lazy pointer fixing (PMLIB_LAZY_FIXPTRS=1)
+ *
+ * The entries with pointers are only marked at restore, and their data runs
+ * are made inaccessible (see slab_protect_datapgs). The first access to one
+ * of them faults, and its pointers are fixed then (see slab_handle_write),
+ * so the work is proportional to the data actually used. The marks are kept
+ * in a bitmap indexed by the id of the entries.
+ */
+static bitstr_t *UNFIXED = NULL;
+static int UNFIXED_NBITS = 0;
+
+static int lazy_fixptrs(unsigned int cid)
+{
+    struct fixptrs_ctx ctx;
+    struct slab_bucket *sb;
+    struct slab_entry *se;
+    int i;
+
+    slab_collect_buckets(cid, &ctx);
+
+    UNFIXED_NBITS = 0;
+    VECTOR_FOREACH(&ctx.buckets, sb, i)
+        UNFIXED_NBITS = MAX(UNFIXED_NBITS, (sb->sb_id + 1) * SLAB_BUCKET_ENTRIES);
+
+    free(UNFIXED);
+    UNFIXED = bit_alloc(UNFIXED_NBITS);
+    assert(UNFIXED && "Failed to allocate the bitmap of unfixed entries");
+
+    VECTOR_FOREACH(&ctx.buckets, sb, i) {
+        for (int l = 0; l < SLAB_BUCKET_ENTRIES; l++) {
+            se = &sb->sb_entries[l];
+            if (SLAB_ENTRY_IS_INIT(se) && se->se_ptr.current.idx)
+                bit_set(UNFIXED, SLAB_ENTRY_ID(se));
         }
     }
+
+    VECTOR_FREE(&ctx.buckets);
+
+    /* the pointers are not fixed yet */
+    return -1;
+}
+
+static int slab_entry_is_unfixed(struct slab_entry *se)
+{
+    return UNFIXED && SLAB_ENTRY_ID(se) < UNFIXED_NBITS && bit_test(UNFIXED, SLAB_ENTRY_ID(se));
+}
+
+/*
+ * Fix the pointers of an entry marked by lazy_fixptrs; return 0 if it was
+ * not marked. The data run stays inaccessible while its pointers are
+ * written through a second mapping of the same pages, so other threads
+ * cannot see it half fixed. Then it gets the protection of the write
+ * tracker. The caller holds the slab lock.
+ */
+int slab_entry_fixptrs_lazy(unsigned int cid, struct slab_entry *se)
+{
+    void *maddr = se->se_data.current.maddr;
+    size_t size = SLAB_ENTRY_DATASIZE(se);
+    void *alias;
+
+    if (!slab_entry_is_unfixed(se))
+        return 0;
+
+    alias = mremap(maddr, 0, size, MREMAP_MAYMOVE);
+    if (alias == MAP_FAILED)
+        handle_error("failed to map the data pages of %p to fix their pointers\n", maddr);
+    page_allocator_mprotect_generic(alias, size, PA_PROT_RNW);
+
+    slab_entry_fixptrs(cid, se, alias);
+
+    munmap(alias, size);
+    page_allocator_mprotect(cid, maddr, size, write_tracker_prot());
+    bit_clear(UNFIXED, SLAB_ENTRY_ID(se));
+
+    return 1;
+}
+
+static int dont_fixptrs(unsigned int cid) { return -1; }
+static int (*Func_fixptrs)(unsigned int cid) = do_fixptrs;
+
+/*
+ * Typed objects have no pointer metadata, so their pointers are rebased
+ * when the container moves, in two passes: first to offsets from the start
+ * of the container, then to its new address. typed_base is NULL between the
+ * passes. A pass leaves alone the pointers it has already rebased, so it
+ * can run again after a crash. Containers are mapped above their largest
+ * size (see map_hint), so offsets and addresses do not overlap.
+ */
+struct rebase_ctx {
+    struct fixptrs_ctx f;
+    uint64_t from;
+    uint64_t to;
+};
+
+static void rebase_ptr(void **ptr_loc, void *arg)
+{
+    struct rebase_ctx *ctx = arg;
+    uint64_t v = ptoi(*ptr_loc);
+
+    if (v && v - ctx->from < FM_RESERVE_SIZE)
+        *ptr_loc = itop(v - ctx->from + ctx->to);
+}
+
+static void rebase_bucket(void *arg, uint64_t i)
+{
+    struct rebase_ctx *ctx = arg;
+    struct slab_bucket *sb = VECTOR_AT(&ctx->f.buckets, i);
+    struct slab_entry *se;
+
+    for (int l = 0; l < SLAB_BUCKET_ENTRIES; l++) {
+        se = &sb->sb_entries[l];
+        if (!SLAB_ENTRY_IS_INIT(se) || !se->se_data.current.type)
+            continue;
+        slab_type_foreach_ptr(ctx->f.cid, se, se->se_data.current.maddr, rebase_ptr, ctx);
+    }
 }
 
-static void dont_fixptrs(unsigned int cid) {}
-static void (*Func_fixptrs)(unsigned int cid) = do_fixptrs;
+static void slab_rebase_typed(unsigned int cid)
+{
+    struct container *cont = get_container(cid);
+    struct rebase_ctx ctx;
+
+    if (cont->typed_base == cont || cont->ntypes == 0) {
+        atomic_set((uint64_t*) &cont->typed_base, ptoi(cont));
+        return;
+    }
+
+    slab_collect_buckets(cid, &ctx.f);
+    if (cont->typed_base) {
+        ctx.from = ptoi(cont->typed_base);
+        ctx.to = 0;
+        slab_restore_parallel(VECTOR_SIZE(&ctx.f.buckets), 0, rebase_bucket, &ctx, "typed bucket(s)");
+        //TODO: make sure that all changes to PM up to this point are durable
+        atomic_set((uint64_t*) &cont->typed_base, 0);
+    }
+    ctx.from = 0;
+    ctx.to = ptoi(cont);
+    slab_restore_parallel(VECTOR_SIZE(&ctx.f.buckets), 0, rebase_bucket, &ctx, "typed bucket(s)");
+    //TODO: make sure that all changes to PM up to this point are durable
+    atomic_set((uint64_t*) &cont->typed_base, ptoi(cont));
+    VECTOR_FREE(&ctx.f.buckets);
+}
 
-void slab_fixptrs(unsigned int cid) { Func_fixptrs(cid); }
+/*
+ * Return 0 if all the pointers of the container are valid at its current
+ * address when this returns. The pointers of typed objects are always
+ * rebased here, even if the others are fixed lazily.
+ */
+int slab_fixptrs(unsigned int cid)
+{
+    if (Func_fixptrs != dont_fixptrs)
+        slab_rebase_typed(cid);
+    return Func_fixptrs(cid);
+}
 
 static void do_insert_pointer(unsigned int cid, void **ptr_loc)
 {
@@ -283,32 +568,26 @@ static void do_insert_pointer(unsigned int cid, void **ptr_loc)
 
     assert(ptr_loc && "The location of the pointer must not be NULL");
 
-    void *rounded_ptr_loc = itop(ROUND_DWNPG(ptoi(ptr_loc)));
-    struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(rounded_ptr_loc, SE_SEARCH_NORMAL);
+    /* offsets are relative to the data run since objects may span several pages */
+    struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(ptr_loc, SE_SEARCH_MADDR);
     se_loc = RB_FIND(used_slab_entry_tree, &sd->sd_maddr_root, &key);
     if (se_loc) {
-        ploc_offset = (ptoi(ptr_loc) - ROUND_DWNPG(ptoi(ptr_loc)));
-        if (!se_loc->se_ptr.current.maddr) {
-            se_loc->se_ptr.current.maddr = page_allocator_getpage(cid, &se_loc->se_ptr.current.laddr, PA_PROT_WRITE);
-        }
+        ploc_offset = ptoi(ptr_loc) - ptoi(se_loc->se_data.current.maddr);
+        /* the type of the object tells where its pointers are already */
+        if (se_loc->se_data.current.type && slab_type_has_ptr(cid, se_loc, ploc_offset))
+            return;
         if (ptr_val != NULL) {
-            key.se_data.current.maddr = itop(ROUND_DWNPG(ptoi(ptr_val)));
+            key.se_data.current.maddr = ptr_val;
             se_val = RB_FIND(used_slab_entry_tree, &sd->sd_maddr_root, &key);
             if (se_val) {
-                pval_offset = (ptoi(ptr_val) - ROUND_DWNPG(ptoi(ptr_val)));
-                struct slab_ptr *sptr = se_loc->se_ptr.current.maddr;
-                sptr->ptrs[se_loc->se_ptr.current.idx].ploc_offset = ploc_offset;
-                sptr->ptrs[se_loc->se_ptr.current.idx].pval_seid = se_val->se_id;
-                sptr->ptrs[se_loc->se_ptr.current.idx].pval_offset = pval_offset;
-                se_loc->se_ptr.current.idx++;
+                pval_offset = ptoi(ptr_val) - ptoi(se_val->se_data.current.maddr);
+                struct slab_ptr sp = { ploc_offset, se_val->se_id, pval_offset };
+                slab_ptr_add(slab_ptr_edit(se_loc), &sp);
             } else
                 handle_error("failed to find the target slab_entry for the given pointer\n");
         } else {
-            struct slab_ptr *sptr = se_loc->se_ptr.current.maddr;
-            sptr->ptrs[se_loc->se_ptr.current.idx].ploc_offset = ploc_offset;
-            sptr->ptrs[se_loc->se_ptr.current.idx].pval_seid = SLAB_PTR_SEID_NULL;
-            sptr->ptrs[se_loc->se_ptr.current.idx].pval_offset = SLAB_PTR_OFFSET_NULL;
-            se_loc->se_ptr.current.idx++;
+            struct slab_ptr sp = { ploc_offset, SLAB_PTR_SEID_NULL, 0 };
+            slab_ptr_add(slab_ptr_edit(se_loc), &sp);
         }
     } else
         handle_error("failed to find the slab entry for the given pointer location\n");
@@ -316,6 +595,56 @@ static void do_insert_pointer(unsigned int cid, void **ptr_loc)
 
 static void dont_insert_pointer(unsigned int cid, void **ptr_loc) {}
 
+/*
+ * The target of a persistent pointer may change after the pointer has been
+ * registered (e.g. rebalancing a tree), so the metadata of the pointers in a
+ * modified slab_entry is refreshed before the slab_entry is checkpointed.
+ */
+static void do_update_pointers(unsigned int cid, struct slab_entry *se)
+{
+    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
+    struct slab_ptr_edit *e = slab_ptr_edit(se);
+    struct slab_ptr *sp;
+    struct slab_entry *se_val;
+    void **ptr_loc;
+
+    for (int m = 0; m < VECTOR_SIZE(&e->sps); m++) {
+        sp = &VECTOR_AT(&e->sps, m);
+        ptr_loc = se->se_data.current.maddr + sp->ploc_offset;
+
+        /* the object holding this pointer was freed, so we drop the pointer */
+        if (!slab_entry_is_allocated(se, ptr_loc)) {
+            slab_ptr_remove(e, m);
+            m--;
+            continue;
+        }
+
+        if (*ptr_loc == NULL) {
+            sp->pval_seid = SLAB_PTR_SEID_NULL;
+            sp->pval_offset = 0;
+            continue;
+        }
+
+        struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(*ptr_loc, SE_SEARCH_MADDR);
+        se_val = RB_FIND(used_slab_entry_tree, &sd->sd_maddr_root, &key);
+        if (se_val) {
+            sp->pval_seid = se_val->se_id;
+            sp->pval_offset = ptoi(*ptr_loc) - ptoi(se_val->se_data.current.maddr);
+        } else
+            LOG(5, "persistent pointer at %p has a target outside the container", ptr_loc);
+    }
+}
+
+static void dont_update_pointers(unsigned int cid, struct slab_entry *se) {}
+
+static void (*Func_update_pointers)(unsigned int, struct slab_entry *) = do_update_pointers;
+
+void slab_update_pointers(unsigned int cid, struct slab_entry *se)
+{
+    if (se->se_ptr.current.idx)
+        Func_update_pointers(cid, se);
+}
+
 static void (*Func_insert_pointer)(unsigned int, void **) = do_insert_pointer;
 
 void slab_insert_pointer(unsigned int cid, void **ptr_loc)
@@ -330,12 +659,13 @@ size_t slab_setroot(unsigned int cid, void *maddr)
     size_t ret = 0; /* error */
     uint64_t new_cont_root;
 
-    void *rounded_maddr = itop(ROUND_DWNPG(ptoi(maddr)));
-    struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(rounded_maddr, SE_SEARCH_NORMAL);
+    slab_lock(cid);
+    struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(maddr, SE_SEARCH_MADDR);
     se = RB_FIND(used_slab_entry_tree, &sd->sd_maddr_root, &key);
+    slab_unlock(cid);
     if (se) {
         //TODO: what should we do if there is a root already?
-        PACK_CONT_ROOT(&new_cont_root, se->se_id, ROUND_DWNPG(ptoi(maddr)) - ptoi(maddr));
+        PACK_CONT_ROOT(&new_cont_root, se->se_id, ptoi(maddr) - ptoi(se->se_data.current.maddr));
         atomic_set(&sd->sd_cont_root, new_cont_root);
         ret = 1;
     }
@@ -368,27 +698,53 @@ struct slab_entry *slab_find(unsigned int cid, void *maddr)
     return se;
 }
 
+static void dont_snapshot_entry(unsigned int cid, struct slab_entry *se) {}
+static void dont_collect_dirty(unsigned int cid) {}
+
 void (*Func_slab_entry_snapshot)(unsigned int cid, struct slab_entry *se) = slab_entry_snapshot;
 int (*Func_slab_bucket_snapshot)(unsigned int cid, struct slab_bucket *sb) = slab_bucket_snapshot;
+void (*Func_slab_entry_commit)(unsigned int cid, struct slab_entry *se) = slab_entry_cow_commit;
+void (*Func_slab_collect_dirty)(unsigned int cid) = dont_collect_dirty;
 
 void slab_init()
 {
+    pthread_mutexattr_t attr;
+
     LOG(3, "Initializing slab");
 
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&SLAB_LOCK, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     char *ptr = getenv("PMLIB_FIX_PTRS");
     if (ptr) {
         int val = atoi(ptr);
         if (val == 0) {
             Func_fixptrs = dont_fixptrs;
             Func_insert_pointer = dont_insert_pointer;
+            Func_update_pointers = dont_update_pointers;
             LOG(3, "Pointer fixing has been disabled");
         }
     } else {
         Func_fixptrs = do_fixptrs;
         Func_insert_pointer = do_insert_pointer;
+        Func_update_pointers = do_update_pointers;
         LOG(3, "Pointer fixing is enabled");
     }
 
+    ptr = getenv("PMLIB_LAZY_FIXPTRS");
+    if (ptr && atoi(ptr) == 1 && Func_fixptrs == do_fixptrs) {
+        Func_fixptrs = lazy_fixptrs;
+        LOG(3, "Pointers are fixed on the first access to their page");
+    }
+
+    ptr = getenv("PMLIB_RESTORE_THREADS");
+    if (ptr) {
+        RESTORE_THREADS = MAX(atoi(ptr), 1);
+        LOG(3, "Restoring containers with up to %d thread(s)", RESTORE_THREADS);
+    }
+
     ptr = getenv("PMLIB_USE_NLMAPPER");
     if (ptr) {
         int val = atoi(ptr);
@@ -399,4 +755,23 @@ void slab_init()
             LOG(3, "Using slab_bucket_copynswap");
         }
     }
+
+    /*
+     * Soft-dirty mode: data pages are always writable and the pages written
+     * since the last checkpoint are found by scanning their soft-dirty bits
+     */
+    ptr = getenv("PMLIB_USE_SOFTDIRTY");
+    if (ptr && atoi(ptr) == 1) {
+        if (Func_slab_entry_snapshot == slab_entry_copynswap) {
+            LOG(3, "The soft-dirty mode does not support the nonlinear mapper");
+        } else if (softdirty_init()) {
+            LOG(3, "The kernel does not support soft-dirty bits, using copy-on-write");
+        } else {
+            Func_slab_entry_snapshot = dont_snapshot_entry;
+            Func_slab_entry_commit = slab_entry_redo_commit;
+            Func_slab_collect_dirty = slab_collect_dirty;
+            write_tracker_disable();
+            LOG(3, "Using soft-dirty bits to find modified data pages");
+        }
+    }
 }
@@ -2,10 +2,26 @@
 #define SLAB_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 struct slab_dir;
 struct slab_entry;
 
+/*
+ * Objects of a registered type have their persistent pointers at fixed
+ * offsets, so the slab finds them from the type of their slab_entry and they
+ * need not be registered one by one. The descriptors are kept in the
+ * container and type ids start at 1.
+ */
+#define SLAB_TYPE_MAX       64  ///< number of types per container
+#define SLAB_TYPE_MAX_PTRS  15  ///< number of pointers per type
+
+struct slab_type {
+    uint32_t st_size;
+    uint16_t st_nptrs;
+    uint16_t st_offsets[SLAB_TYPE_MAX_PTRS];
+};
+
 /* init the slab subsystem */
 void slab_init();
 
@@ -16,9 +32,19 @@ struct slab_dir* slab_dir_init(unsigned int cid, size_t *laddr);
 void *slab_palloc(unsigned int cid, unsigned int size);
 void slab_pfree(unsigned int cid, void *maddr);
 
+/* allocate n objects of size bytes, next to each other whenever possible */
+void slab_palloc_bulk(unsigned int cid, unsigned int size, int n, void **maddrs);
+
+/* register a type and allocate objects of a registered type */
+unsigned int slab_register_type(unsigned int cid, unsigned int size, const unsigned int *offsets, int nptrs);
+void *slab_palloc_typed(unsigned int cid, unsigned int type);
+
 /* checkpoint/commit changes in current transaction */
 void slab_cpoint(unsigned int cid, int type);
 
+/* wait for the pages retired by asynchronous checkpoints to be freed */
+void slab_reclaim_drain(unsigned int cid);
+
 /* restore (mmap) the entire slab_dir */
 struct slab_dir* slab_map(unsigned int cid, size_t laddr, int type);
 
@@ -27,10 +53,10 @@ size_t slab_setroot(unsigned int cid, void *maddr);
 void *slab_getroot(unsigned int cid);
 
 /* fix the target addresses of all persistent pointers */
-void slab_fixptrs(unsigned int cid);
+int slab_fixptrs(unsigned int cid);
 
-/* make all data pages read-only */
-void slab_mprotect_datapgs(unsigned int cid, int prot);
+/* track the writes to all data pages */
+void slab_protect_datapgs(unsigned int cid);
 
 /* store metadata for the persistent pointer located at ptr_loc */
 void slab_insert_pointer(unsigned int cid, void **ptr_loc);
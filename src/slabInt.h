@@ -10,25 +10,60 @@
 #include <vector.h>
 #include "settings.h"
 
-/* When the target of a persistent pointer is NULL, we use these values as its metadata */
+/* When the target of a persistent pointer is NULL, we use this value as its seid */
 #define SLAB_PTR_SEID_NULL      0xffffffff
-#define SLAB_PTR_OFFSET_NULL    0xffff
 
 /*
  * slab_ptr stores metadata about persistent pointers.
  * This metadata is use to fix the pointers after restoring a container
+ *
+ * The pointers of a slab_entry are kept encoded in a block of a few bytes per
+ * pointer (see slabptr.c), and the blocks of many slab_entry(s) share pages.
+ * A block is never modified: the pointers that change during a checkpoint
+ * are written to a new block, so blocks need no snapshot.
  */
-#define SLAB_PTR_SIZE   (PAGE_SIZE / (sizeof(uint16_t) * 2 + sizeof(uint32_t)))
 struct slab_ptr {
-    struct {
-        uint16_t ploc_offset;
-        uint32_t pval_seid;
-        uint16_t pval_offset;
-    } ptrs[SLAB_PTR_SIZE];
+    uint16_t ploc_offset;
+    uint32_t pval_seid;
+    uint16_t pval_offset;
+};
+
+VECTOR_DECL(slab_ptr_vector, struct slab_ptr);
+
+/*
+ * Changes to the pointers of a slab_entry are made on a decoded copy of its
+ * pointers, which is encoded into a new block at checkpoint time. Two
+ * pointers cannot start in the same pointer-sized slot of a data run, so a
+ * bitmap of the slots in use keeps the pointers unique.
+ */
+#define SLAB_PTR_SLOT(ploc_offset)  ((ploc_offset) / sizeof(void*))
+struct slab_ptr_edit {
+    struct slab_entry *se;
+    struct slab_ptr_vector sps;
+    bitstr_t *slots;
+};
+
+/* decode the pointers of a slab_entry in order of location */
+struct slab_ptr_iter {
+    const uint8_t *next;
+    unsigned int left;
+    uint32_t seid;          ///< seid of the last non-NULL target
+    struct slab_ptr sp;
 };
 
 #define SLAB_LARGE_ALLOC 512
 
+/*
+ * Allocations bigger than a page are served by a run of contiguous pages that
+ * holds a single object. Offsets within the run are stored as uint16_t in
+ * slab_ptr, which limits the size of these allocations to 64KB.
+ */
+#define SLAB_MAX_ALLOC  (1 << 16)
+
+/* number of pages (and bytes) of the data run described by a slab_entry */
+#define SLAB_ENTRY_NPAGES(se)   (ROUNDPG((se)->se_size) / PAGE_SIZE)
+#define SLAB_ENTRY_DATASIZE(se) (ROUNDPG((se)->se_size))
+
 /*
  * These macros return a pointer to the in-use bitmap.
  * Based on se_size, we use the bitmap defined in current/snapshot anonymous
@@ -45,19 +80,29 @@ struct slab_ptr {
         (se)->se_data.snapshot.maddr
 
 /*
- * This macro computes an approximate capacity of a data page
+ * Get the address of the first object in the data page
+ */
+#define SLAB_ENTRY_DATAOFFSET(se) \
+        (((se)->se_size >= SLAB_LARGE_ALLOC) ? 0 : \
+    bitstr_size(PAGE_SIZE / (se)->se_size))
+
+/*
+ * This macro computes the number of objects that fit in a data page after
+ * the in-use bitmap
  */
 #define SLAB_ENTRY_CAPACITY(se) \
-        ((se)->se_size < SLAB_LARGE_ALLOC) ? \
-            ((PAGE_SIZE - bitstr_size((se)->se_size)) / (se)->se_size) : \
-            (PAGE_SIZE / (se)->se_size)
+        (((se)->se_size < SLAB_LARGE_ALLOC) ? \
+            ((PAGE_SIZE - SLAB_ENTRY_DATAOFFSET(se)) / (se)->se_size) : \
+            (((se)->se_size > PAGE_SIZE) ? 1 : (PAGE_SIZE / (se)->se_size)))
 
 /*
- * Get the address of the first object in the data page
+ * The number of free objects is kept next to the bitmap so that checking if
+ * a slab_entry is full does not require a scan of the bitmap.
+ * It is persisted with the slab_bucket, which is snapshot before every change
+ * to the bitmap.
  */
-#define SLAB_ENTRY_DATAOFFSET(se) \
-        ((se)->se_size >= SLAB_LARGE_ALLOC) ? 0 : \
-    bitstr_size(PAGE_SIZE / (se)->se_size)
+#define SLAB_ENTRY_FULL(se) ((se)->se_data.current.nfree == 0)
+#define SLAB_ENTRY_EMPTY(se) ((se)->se_data.current.nfree == SLAB_ENTRY_CAPACITY(se))
 
 /*
  * slab_entry describes data pages.
@@ -73,6 +118,8 @@ struct slab_entry {
             void *maddr;
             size_t laddr;
             bitstr_t bitmap[1];
+            uint16_t nfree;     ///< number of free objects in the data page
+            uint16_t type;      ///< type of the objects (see slab_type), 0 if untyped
         } current;
         struct {
             void *maddr;
@@ -82,13 +129,15 @@ struct slab_entry {
     } se_data;
     struct {
         struct {
-            uint16_t idx;
-            struct slab_ptr *maddr;
+            uint16_t idx;       ///< number of pointers
+            uint32_t size;      ///< size (bytes) of the block of pointers
+            uint8_t *maddr;
             size_t laddr;
         } current;
         struct {
             uint16_t idx;
-            struct slab_ptr *maddr;
+            uint32_t size;
+            uint8_t *maddr;
             size_t laddr;
         } snapshot;
     } se_ptr;
@@ -104,14 +153,19 @@ struct slab_entry {
  * The slab_entry(s) are ordered by size and kept in a list where
  * the head of the list is checked first when allocation a new obj. If the head
  * is full, then all others slab_entry(s) are also full and a new one needs to
- * be created and init.
+ * be created and init. Objects of a registered type only share slab_entry(s)
+ * with objects of the same type.
  */
 struct slab_entry_size {
     unsigned int es_size;
+    unsigned int es_type;
     STAILQ_HEAD(list, slab_entry) es_list;
     RB_ENTRY(slab_entry_size) es_splay;
 };
 
+#define SLAB_ENTRY_SIZE_KEY(se) \
+    { .es_size = (se)->se_size, .es_type = (se)->se_data.current.type }
+
 /*
  * SLAB_ENTRY_IS_INIT checks if the slab_entry pointed by pse is initialized
  * TODO: add consistency check to this macro
@@ -122,6 +176,15 @@ struct slab_entry_size {
 #define SLAB_ENTRY_INDEX(pse) \
     ((ptoi((pse)) - ROUND_DWNPG(ptoi((pse)))) / sizeof(struct slab_entry))
 
+/*
+ * The id of a slab_entry is given by its position in the slab, which lets us
+ * find the entry by id (see get_slab_entry_by_id) even after a restore
+ */
+#define SLAB_ENTRY_BUCKET(pse) ((struct slab_bucket*) ROUND_DWNPG(ptoi((pse))))
+#define SLAB_ENTRY_ID(pse) \
+    (SLAB_ENTRY_BUCKET(pse)->sb_id * SLAB_BUCKET_ENTRIES + \
+        ((pse) - SLAB_ENTRY_BUCKET(pse)->sb_entries))
+
 /*
  * slab_bucket packs as many slab_entry(s) as possible wihtin a page
  */
@@ -218,14 +281,49 @@ RB_PROTOTYPE(sizes_slab_entry_tree, slab_entry_size, es_splay, slab_entry_size_c
     { .se_data.current.maddr = (key), .se_data.snapshot.maddr = type }
 #define SLAB_ENTRY_SEARCH_TYPE(se) ((se)->se_data.snapshot.maddr)
 
+/* serialize changes to the shared structures of the slab */
+void slab_lock(unsigned int cid);
+void slab_unlock(unsigned int cid);
+
+/* give the slab_entry(s) cached by threads back to the slab */
+void slab_cache_drain(unsigned int cid);
+
 /* utility functions */
-struct slab_entry_size *slab_entry_size_init(int size);
+struct slab_entry_size *slab_entry_size_init(int size, int type);
 struct slab_entry *slab_find(unsigned int cid, void *maddr);
 int slab_entry_full(struct slab_entry *se);
+int slab_bitmap_ffc(bitstr_t *bm, int nbits);
+int slab_bitmap_count(bitstr_t *bm, int nbits);
 struct slab_outer* slab_outer_init(unsigned int cid, size_t *laddr);
 struct slab_inner* slab_inner_init(unsigned int cid, size_t *laddr);
 struct slab_bucket* slab_bucket_init(unsigned int cid, size_t *laddr);
-int slab_entry_init(unsigned int cid, struct slab_entry *se, int size);
+void slab_bucket_set_next_id(unsigned int sb_id);
+int slab_entry_init(unsigned int cid, struct slab_entry *se, int size, int type);
+void slab_entry_freepages(unsigned int cid, struct slab_entry *se, void *maddr);
+void slab_entry_release(unsigned int cid, struct slab_entry *se);
+int slab_entry_is_allocated(struct slab_entry *se, void *maddr);
+void slab_update_pointers(unsigned int cid, struct slab_entry *se);
+
+/*
+ * pointer metadata functions
+ */
+void slab_ptr_iter_init(struct slab_ptr_iter *it, struct slab_entry *se);
+struct slab_ptr *slab_ptr_next(struct slab_ptr_iter *it);
+struct slab_ptr_edit *slab_ptr_edit(struct slab_entry *se);
+int slab_ptr_add(struct slab_ptr_edit *e, struct slab_ptr *sp);
+void slab_ptr_remove(struct slab_ptr_edit *e, int m);
+void slab_ptr_commit(unsigned int cid);
+void slab_ptr_release_snapshot(unsigned int cid, struct slab_entry *se);
+void slab_ptr_release(unsigned int cid, struct slab_entry *se);
+uint8_t *slab_ptr_map(unsigned int cid, size_t laddr);
+
+/*
+ * type functions
+ */
+struct slab_type *slab_type_get(unsigned int cid, unsigned int type);
+int slab_type_has_ptr(unsigned int cid, struct slab_entry *se, uint16_t ploc_offset);
+void slab_type_foreach_ptr(unsigned int cid, struct slab_entry *se, void *data,
+                           void (*fun)(void **ptr_loc, void *arg), void *arg);
 
 /*
  * snapshot functions
@@ -238,6 +336,41 @@ struct slab_dir* slab_dir_snapshot(unsigned int cid, struct slab_dir *sd, size_t
 void slab_foreach_snapshot_entry(unsigned int cid, void (*fun)(struct slab_entry *se, void *param), void *param);
 void slab_entry_copynswap(unsigned int cid, struct slab_entry *se);
 int slab_bucket_copynswap(unsigned int cid, struct slab_bucket *sb);
+void slab_entry_redo_copy(unsigned int cid, struct slab_entry *se);
+struct slab_inner *slab_bucket_inner(unsigned int cid, struct slab_bucket *sb, int *si_idx);
+
+/*
+ * The dirty set: the slab_bucket(s), slab_inner(s) and slab_outer(s) that got
+ * a snapshot since the last checkpoint, which are the only ones visited by
+ * the checkpoint. Inners are numbered sd_idx * SLAB_OUTER_ENTRIES + so_idx,
+ * and outers by their index in the slab_dir. The slab lock must be held.
+ */
+struct slab_dirty_set {
+    VECTOR_DECL(dirty_bucket_vector, struct slab_bucket*) buckets;
+    VECTOR_DECL(dirty_inner_vector, int) inners;
+    VECTOR_DECL(dirty_outer_vector, int) outers;
+};
+extern struct slab_dirty_set SLAB_DIRTY;
+
+void slab_bucket_make_dirty(unsigned int cid, struct slab_bucket *sb);
+void slab_dirty_add_bucket(struct slab_bucket *sb);
+void slab_dirty_add_inner(int sd_idx, int so_idx);
+void slab_dirty_add_outer(int sd_idx);
+
+/*
+ * restore functions
+ */
+extern int RESTORE_THREADS;
+void slab_restore_parallel(uint64_t n, int nthreads, void (*fun)(void *arg, uint64_t i),
+                           void *arg, const char *what);
+int slab_entry_fixptrs_lazy(unsigned int cid, struct slab_entry *se);
+
+/*
+ * checkpoint functions
+ */
+void slab_entry_cow_commit(unsigned int cid, struct slab_entry *se);
+void slab_entry_redo_commit(unsigned int cid, struct slab_entry *se);
+void slab_collect_dirty(unsigned int cid);
 
 /* only for debugging */
 void print_splay_tree();
@@ -0,0 +1,445 @@
+#include <assert.h>
+#include <string.h>
+
+#include "slabInt.h"
+#include "cont.h"
+#include "atomics.h"
+#include "page_alloc.h"
+#include "htable.h"
+#include "macros.h"
+#include "out.h"
+
+extern int (*Func_slab_bucket_snapshot)(unsigned int cid, struct slab_bucket *sb);
+
+/*
+ * Encoding of the pointers of a slab_entry
+ *
+ * The pointers are sorted by location and stored as a sequence of unsigned
+ * LEB128 varints, three per pointer:
+ *
+ *  - the distance from the location of the previous pointer,
+ *  - the target seid: 0 for NULL, otherwise 1 + the zigzag-encoded distance
+ *    from the previous non-NULL target (the first one is relative to the
+ *    entry itself),
+ *  - the offset of the target, only present if the target is not NULL.
+ *
+ * Pointers to objects of nearby entries take 4 bytes or less.
+ */
+#define SLAB_PTR_MAX_ENCODED    (3 + 5 + 3)
+
+/* blocks at least this big get pages of their own */
+#define SLAB_PTR_RUN_MIN        (PAGE_SIZE / 4)
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t) v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *p, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    do {
+        *v |= (uint64_t) (*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    return p;
+}
+
+#define ZIGZAG(d)   (((uint64_t) (d) << 1) ^ (uint64_t) ((d) >> 63))
+#define UNZIGZAG(v) ((int64_t) ((v) >> 1) ^ -(int64_t) ((v) & 1))
+
+static size_t slab_ptr_encode(uint8_t *buf, unsigned int seid, struct slab_ptr *sps, int n)
+{
+    uint8_t *p = buf;
+    uint16_t ploc = 0;
+    int64_t d;
+
+    for (int i = 0; i < n; i++) {
+        p = put_varint(p, sps[i].ploc_offset - ploc);
+        ploc = sps[i].ploc_offset;
+
+        if (sps[i].pval_seid == SLAB_PTR_SEID_NULL) {
+            p = put_varint(p, 0);
+            continue;
+        }
+
+        d = (int64_t) sps[i].pval_seid - seid;
+        p = put_varint(p, ZIGZAG(d) + 1);
+        p = put_varint(p, sps[i].pval_offset);
+        seid = sps[i].pval_seid;
+    }
+
+    return p - buf;
+}
+
+void slab_ptr_iter_init(struct slab_ptr_iter *it, struct slab_entry *se)
+{
+    it->next = se->se_ptr.current.maddr;
+    it->left = se->se_ptr.current.idx;
+    it->seid = se->se_id;
+    it->sp.ploc_offset = 0;
+}
+
+struct slab_ptr *slab_ptr_next(struct slab_ptr_iter *it)
+{
+    uint64_t v;
+
+    if (it->left == 0)
+        return NULL;
+    it->left--;
+
+    it->next = get_varint(it->next, &v);
+    it->sp.ploc_offset += v;
+
+    it->next = get_varint(it->next, &v);
+    if (v == 0) {
+        it->sp.pval_seid = SLAB_PTR_SEID_NULL;
+        it->sp.pval_offset = 0;
+        return &it->sp;
+    }
+
+    it->seid += UNZIGZAG(v - 1);
+    it->sp.pval_seid = it->seid;
+    it->next = get_varint(it->next, &v);
+    it->sp.pval_offset = v;
+
+    return &it->sp;
+}
+
+/*
+ * Blocks of pointers
+ *
+ * Small blocks are packed into shared pages in the order they are written.
+ * The live bytes of the pages filled by this process are counted, and a page
+ * is given back to the page allocator when it holds no live block. Pages
+ * written before a restore are never given back, like the rest of the free
+ * space of a restored container.
+ * TODO: add support for multiple containers
+ */
+static struct {
+    uint8_t *maddr;
+    size_t laddr;
+    size_t used;
+} PTR_PAGE;
+static struct htable *PTR_LIVE = NULL;
+
+static uint8_t *slab_ptr_alloc(unsigned int cid, size_t size, size_t *laddr)
+{
+    uint8_t *maddr;
+    uint64_t live;
+
+    if (!PTR_LIVE)
+        PTR_LIVE = htable_init();
+
+    if (size >= SLAB_PTR_RUN_MIN) {
+        if (size > PAGE_SIZE)
+            maddr = page_allocator_getpages(cid, ROUNDPG(size) / PAGE_SIZE, laddr, PA_PROT_WRITE);
+        else
+            maddr = page_allocator_getpage(cid, laddr, PA_PROT_WRITE);
+        if (maddr == NULL)
+            handle_error("failed to allocate memory for slab_entry ptrs\n");
+        htable_insert(PTR_LIVE, maddr, itop(size));
+        return maddr;
+    }
+
+    if (!PTR_PAGE.maddr || PTR_PAGE.used + size > PAGE_SIZE) {
+        PTR_PAGE.maddr = page_allocator_getpage(cid, &PTR_PAGE.laddr, PA_PROT_WRITE);
+        if (PTR_PAGE.maddr == NULL)
+            handle_error("failed to allocate memory for slab_entry ptrs\n");
+        PTR_PAGE.used = 0;
+    }
+
+    maddr = PTR_PAGE.maddr + PTR_PAGE.used;
+    *laddr = PTR_PAGE.laddr + PTR_PAGE.used;
+    PTR_PAGE.used += size;
+
+    live = ptoi(htable_lookup(PTR_LIVE, PTR_PAGE.maddr));
+    htable_insert(PTR_LIVE, PTR_PAGE.maddr, itop(live + size));
+
+    return maddr;
+}
+
+static void slab_ptr_free(unsigned int cid, uint8_t *maddr, size_t size)
+{
+    uint8_t *page = (uint8_t*) ROUND_DWNPG(ptoi(maddr));
+    uint64_t live;
+
+    if (!maddr || !PTR_LIVE)
+        return;
+
+    live = ptoi(htable_lookup(PTR_LIVE, page));
+    if (live == 0)
+        return;
+
+    assert(live >= size && "Freeing more pointer metadata than was allocated");
+    live -= size;
+    if (live) {
+        htable_insert(PTR_LIVE, page, itop(live));
+        return;
+    }
+
+    htable_remove(PTR_LIVE, page);
+    if (page == PTR_PAGE.maddr)
+        PTR_PAGE.maddr = NULL;
+
+    if (size < SLAB_PTR_RUN_MIN)
+        size = PAGE_SIZE;
+    for (size_t off = 0; off < size; off += PAGE_SIZE)
+        page_allocator_freepages(cid, page + off);
+}
+
+/*
+ * Give back the block of the last checkpoint, once it has been replaced
+ */
+void slab_ptr_release_snapshot(unsigned int cid, struct slab_entry *se)
+{
+    if (se->se_ptr.snapshot.maddr != se->se_ptr.current.maddr)
+        slab_ptr_free(cid, se->se_ptr.snapshot.maddr, se->se_ptr.snapshot.size);
+}
+
+void slab_ptr_release(unsigned int cid, struct slab_entry *se)
+{
+    slab_ptr_release_snapshot(cid, se);
+    slab_ptr_free(cid, se->se_ptr.current.maddr, se->se_ptr.current.size);
+}
+
+uint8_t *slab_ptr_map(unsigned int cid, size_t laddr)
+{
+    return laddr ? page_allocator_mappage(cid, laddr) : NULL;
+}
+
+static VECTOR_DECL(ptr_edit_vector, struct slab_ptr_edit*) PTR_EDITS;
+static struct htable *PTR_EDIT_INDEX = NULL;
+
+struct slab_ptr_edit *slab_ptr_edit(struct slab_entry *se)
+{
+    struct slab_ptr_edit *e;
+    struct slab_ptr_iter it;
+    struct slab_ptr *sp;
+
+    if (!PTR_EDIT_INDEX)
+        PTR_EDIT_INDEX = htable_init();
+
+    e = htable_lookup(PTR_EDIT_INDEX, se);
+    if (e)
+        return e;
+
+    e = malloc(sizeof(*e));
+    assert(e && "failed to allocate memory for slab_ptr_edit");
+    e->se = se;
+    VECTOR_INITAT(&e->sps, MAX(se->se_ptr.current.idx, INIT_SIZE));
+    e->slots = bit_alloc(SLAB_PTR_SLOT(SLAB_ENTRY_DATASIZE(se)));
+    assert(e->slots && "failed to allocate memory for the slots of slab_ptr_edit");
+
+    slab_ptr_iter_init(&it, se);
+    while ((sp = slab_ptr_next(&it)))
+        slab_ptr_add(e, sp);
+
+    htable_insert(PTR_EDIT_INDEX, se, e);
+    VECTOR_APPEND(&PTR_EDITS, e);
+
+    return e;
+}
+
+/*
+ * Add a pointer unless there is one at its location already; return 1 if it
+ * was added. The target of a known pointer does not need to be updated here:
+ * it can only change if its data run is written, and the pointers of
+ * modified data runs are refreshed before the checkpoint (see
+ * slab_update_pointers).
+ */
+int slab_ptr_add(struct slab_ptr_edit *e, struct slab_ptr *sp)
+{
+    int slot = SLAB_PTR_SLOT(sp->ploc_offset);
+
+    if (bit_test(e->slots, slot))
+        return 0;
+
+    bit_set(e->slots, slot);
+    VECTOR_APPEND(&e->sps, *sp);
+    return 1;
+}
+
+void slab_ptr_remove(struct slab_ptr_edit *e, int m)
+{
+    bit_clear(e->slots, SLAB_PTR_SLOT(VECTOR_AT(&e->sps, m).ploc_offset));
+    VECTOR_AT(&e->sps, m) = VECTOR_AT(&e->sps, VECTOR_SIZE(&e->sps) - 1);
+    VECTOR_SIZE(&e->sps)--;
+}
+
+static int slab_ptr_edit_cmp(const void *a, const void *b)
+{
+    const struct slab_ptr_edit *x = *(struct slab_ptr_edit * const *) a;
+    const struct slab_ptr_edit *y = *(struct slab_ptr_edit * const *) b;
+
+    return (x->se->se_id > y->se->se_id) - (x->se->se_id < y->se->se_id);
+}
+
+static int slab_ptr_cmp(const void *a, const void *b)
+{
+    const struct slab_ptr *x = a;
+    const struct slab_ptr *y = b;
+
+    return (x->ploc_offset > y->ploc_offset) - (x->ploc_offset < y->ploc_offset);
+}
+
+static void slab_ptr_write(unsigned int cid, struct slab_ptr_edit *e, uint8_t **buf, size_t *bufsize)
+{
+    struct slab_entry *se = e->se;
+    struct slab_bucket *sb = SLAB_ENTRY_BUCKET(se);
+    int n = VECTOR_SIZE(&e->sps);
+    size_t size = 0, laddr = 0;
+    uint8_t *maddr = NULL;
+
+    assert(n <= UINT16_MAX && "Too many pointers in a slab_entry");
+
+    if (n) {
+        if (*bufsize < n * SLAB_PTR_MAX_ENCODED) {
+            *bufsize = n * SLAB_PTR_MAX_ENCODED;
+            *buf = realloc(*buf, *bufsize);
+            assert(*buf && "failed to allocate memory to encode slab_entry ptrs");
+        }
+
+        qsort(e->sps.buffer, n, sizeof(struct slab_ptr), slab_ptr_cmp);
+        size = slab_ptr_encode(*buf, se->se_id, e->sps.buffer, n);
+        maddr = slab_ptr_alloc(cid, size, &laddr);
+        pmemcpy(maddr, *buf, size);
+    }
+
+    /* the slab_entry is about to change, so its bucket needs a snapshot */
+    slab_bucket_make_dirty(cid, sb);
+
+    /* a block written since the last checkpoint is not referenced anymore */
+    if (se->se_ptr.current.maddr != se->se_ptr.snapshot.maddr)
+        slab_ptr_free(cid, se->se_ptr.current.maddr, se->se_ptr.current.size);
+
+    se->se_ptr.current.idx = n;
+    se->se_ptr.current.size = size;
+    se->se_ptr.current.maddr = maddr;
+    atomic_set(&se->se_ptr.current.laddr, laddr);
+}
+
+/*
+ * Write a block for every slab_entry whose pointers changed. Blocks are
+ * written in the order of the entries, so the blocks of a bucket share pages.
+ */
+void slab_ptr_commit(unsigned int cid)
+{
+    struct slab_ptr_edit *e;
+    uint8_t *buf = NULL;
+    size_t bufsize = 0;
+    int i;
+
+    qsort(PTR_EDITS.buffer, VECTOR_SIZE(&PTR_EDITS), sizeof(struct slab_ptr_edit*), slab_ptr_edit_cmp);
+
+    for (i = 0; i < VECTOR_SIZE(&PTR_EDITS); i++) {
+        e = VECTOR_AT(&PTR_EDITS, i);
+        slab_ptr_write(cid, e, &buf, &bufsize);
+        VECTOR_FREE(&e->sps);
+        free(e->slots);
+        free(e);
+    }
+
+    free(buf);
+    VECTOR_FREE(&PTR_EDITS);
+    if (PTR_EDIT_INDEX)
+        htable_clear(PTR_EDIT_INDEX);
+}
+
+/*
+ * Type descriptors
+ *
+ * The table of descriptors lives in the container page and only grows: a
+ * descriptor is written before the number of types is updated, so a crash
+ * cannot leave half of one. Offsets are kept sorted, and registering the
+ * same layout again (e.g. after a restore) returns the id it already has.
+ */
+unsigned int slab_register_type(unsigned int cid, unsigned int size, const unsigned int *offsets, int nptrs)
+{
+    struct container *cont = get_container(cid);
+    struct slab_type st = { .st_size = size, .st_nptrs = nptrs };
+    unsigned int type = 0;
+    uint16_t off;
+    int i, j;
+
+    if (size == 0 || size > SLAB_MAX_ALLOC || nptrs < 0 || nptrs > SLAB_TYPE_MAX_PTRS)
+        return 0;
+
+    for (i = 0; i < nptrs; i++) {
+        if (offsets[i] + sizeof(void*) > size)
+            return 0;
+        off = offsets[i];
+        for (j = i; j > 0 && st.st_offsets[j - 1] > off; j--)
+            st.st_offsets[j] = st.st_offsets[j - 1];
+        st.st_offsets[j] = off;
+    }
+    for (i = 1; i < nptrs; i++) {
+        if (st.st_offsets[i] - st.st_offsets[i - 1] < sizeof(void*))
+            return 0;
+    }
+
+    slab_lock(cid);
+    for (i = 0; i < cont->ntypes && !type; i++) {
+        if (memcmp(&cont->types[i], &st, sizeof(st)) == 0)
+            type = i + 1;
+    }
+    if (!type && cont->ntypes < SLAB_TYPE_MAX) {
+        pmemcpy(&cont->types[cont->ntypes], &st, sizeof(st));
+        atomic_set(&cont->ntypes, cont->ntypes + 1);
+        type = cont->ntypes;
+    }
+    slab_unlock(cid);
+
+    if (!type)
+        LOG(3, "failed to register a type of %u bytes, the container has %d types already",
+            size, SLAB_TYPE_MAX);
+
+    return type;
+}
+
+struct slab_type *slab_type_get(unsigned int cid, unsigned int type)
+{
+    return &get_container(cid)->types[type - 1];
+}
+
+/*
+ * Return 1 if the type of se has a pointer at ploc_offset of its data run
+ */
+int slab_type_has_ptr(unsigned int cid, struct slab_entry *se, uint16_t ploc_offset)
+{
+    struct slab_type *st = slab_type_get(cid, se->se_data.current.type);
+    long off = ((long) ploc_offset - SLAB_ENTRY_DATAOFFSET(se)) % se->se_size;
+
+    for (int i = 0; i < st->st_nptrs; i++) {
+        if (st->st_offsets[i] == off)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Call fun on the location of every pointer of the allocated objects of a
+ * typed slab_entry, whose data run is mapped at data
+ */
+void slab_type_foreach_ptr(unsigned int cid, struct slab_entry *se, void *data,
+                           void (*fun)(void **ptr_loc, void *arg), void *arg)
+{
+    struct slab_type *st = slab_type_get(cid, se->se_data.current.type);
+    bitstr_t *bitmap = (se->se_size >= SLAB_LARGE_ALLOC) ? se->se_data.current.bitmap : data;
+    void *obj = data + SLAB_ENTRY_DATAOFFSET(se);
+
+    for (int idx = 0; idx < SLAB_ENTRY_CAPACITY(se); idx++, obj += se->se_size) {
+        if (!bit_test(bitmap, idx))
+            continue;
+        for (int i = 0; i < st->st_nptrs; i++)
+            fun(obj + st->st_offsets[i], arg);
+    }
+}
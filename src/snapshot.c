@@ -6,42 +6,80 @@
 #include "cont.h"
 #include "atomics.h"
 #include "page_alloc.h"
+#include "wtracker.h"
 #include "stats.h"
 #include "out.h"
 
 extern void (*Func_slab_entry_snapshot)(unsigned int cid, struct slab_entry *se);
+extern int (*Func_slab_bucket_snapshot)(unsigned int cid, struct slab_bucket *sb);
 
-void handle_memory_update(int sigid, siginfo_t *sig, void *unused)
+/*
+ * Called on the first write to a data page after a checkpoint, either from
+ * the SIGSEGV handler or from the thread of the userfaultfd write tracker.
+ */
+void slab_handle_write(unsigned int cid, void *addr)
 {
-    //TODO: add support for multiple containers
-    unsigned int cid = 0;
-    void *pgaddr;
     struct slab_dir *sd = get_container(cid)->current_slab.maddr;
     struct slab_entry *se;
+    struct slab_bucket *sb;
 
     STATS_INC_FAULTS();
-    LOG(20, "Fault at location %p", sig->si_addr);
+    LOG(20, "Fault at location %p", addr);
 
-    pgaddr = itop(ROUND_DWNPG(ptoi(sig->si_addr)));
-    struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(pgaddr, SE_SEARCH_NORMAL);
+    slab_lock(cid);
+    struct slab_entry key = SLAB_ENTRY_SEARCH_KEY(addr, SE_SEARCH_MADDR);
     se = RB_FIND(used_slab_entry_tree, &sd->sd_maddr_root, &key);
     if (se) {
+        /* the first access to a page whose pointers are fixed lazily */
+        if (slab_entry_fixptrs_lazy(cid, se)) {
+            slab_unlock(cid);
+            return;
+        }
+
+        /* another thread may have taken the snapshot while we were waiting */
+        if (se->se_data.current.maddr != se->se_data.snapshot.maddr) {
+            write_tracker_unprotect(cid, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+            slab_unlock(cid);
+            return;
+        }
+
+        /* the slab_entry is about to change, so its bucket needs a snapshot */
+        sb = SLAB_ENTRY_BUCKET(se);
+        slab_bucket_make_dirty(cid, sb);
+
+        /* the snapshot covers the entire data run of the slab_entry */
         Func_slab_entry_snapshot(cid, se);
-        //TODO: handle the case of allocation bigger than a page
-        page_allocator_mprotect(cid, se->se_data.current.maddr, PAGE_SIZE, PA_PROT_READ | PA_PROT_WRITE);
+        write_tracker_unprotect(cid, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+        slab_unlock(cid);
     } else {
-        LOG(5, "No slab_entry found for address %p", sig->si_addr);
-        handle_error("Got SIGSEGV at address: 0x%lx\n", (long) sig->si_addr);
+        LOG(5, "No slab_entry found for address %p", addr);
+        handle_error("Got a write fault at address: 0x%lx\n", (long) addr);
     }
 }
 
+void handle_memory_update(int sigid, siginfo_t *sig, void *unused)
+{
+    //TODO: add support for multiple containers
+    slab_handle_write(0, sig->si_addr);
+}
+
+/*
+ * Allocate the pages needed to snapshot the data run of a slab_entry
+ */
+static void *slab_entry_getpages(unsigned int cid, struct slab_entry *se, size_t *laddr)
+{
+    if (SLAB_ENTRY_NPAGES(se) > 1)
+        return page_allocator_getpages(cid, SLAB_ENTRY_NPAGES(se), laddr, PA_PROT_WRITE | PA_SNAPSHOT);
+    return page_allocator_getpage(cid, laddr, PA_PROT_WRITE | PA_SNAPSHOT);
+}
+
 void slab_entry_snapshot(unsigned int cid, struct slab_entry *se)
 {
     size_t data_laddr;
-    void *data_maddr = page_allocator_getpage(cid, &data_laddr, PA_PROT_WRITE);
+    void *data_maddr = slab_entry_getpages(cid, se, &data_laddr);
     if (data_maddr == NULL)
         handle_error("failed to allocate memory for slab_entry (data page) snapshot\n");
-    pmemcpy(data_maddr, se->se_data.current.maddr, ROUNDPG(se->se_size));
+    pmemcpy(data_maddr, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
 
     STATS_INC_COWDATA();
 
@@ -49,19 +87,34 @@ void slab_entry_snapshot(unsigned int cid, struct slab_entry *se)
     struct slab_dir *sd = get_container(cid)->current_slab.maddr;
     VECTOR_APPEND(&sd->sd_vector, se);
 
-    // if there are pointers in this page, then we need to snapshot them as well
-    if (se->se_ptr.snapshot.maddr != NULL) {
-        size_t ptr_laddr;
-        void *ptr_maddr = page_allocator_getpage(cid, &ptr_laddr, PA_PROT_WRITE);
-        if (ptr_maddr == NULL)
-            handle_error("failed to allocate memory for slab_entry (ptr page) snapshot\n");
-        pmemcpy(ptr_maddr, se->se_ptr.snapshot.maddr, ROUNDPG(se->se_size));
-        se->se_ptr.current.idx = se->se_ptr.snapshot.idx;
-        atomic_set(&ptr_laddr, se->se_ptr.current.laddr);
-        se->se_ptr.current.maddr = ptr_maddr;
+    se->se_data.snapshot.maddr = data_maddr;
+    atomic_set(&se->se_data.snapshot.laddr, data_laddr);
+}
 
-        STATS_INC_COWMETA();
-    }
+/*
+ * In the soft-dirty mode the data pages are modified in place, so the
+ * version of the data that belongs to the last checkpoint is kept in a redo
+ * copy of the data run (se_data.snapshot), taken when the checkpoint is
+ * created. The caller takes care of the previous redo copy.
+ */
+void slab_entry_redo_copy(unsigned int cid, struct slab_entry *se)
+{
+    size_t data_laddr;
+    struct slab_bucket *sb = SLAB_ENTRY_BUCKET(se);
+    void *data_maddr = slab_entry_getpages(cid, se, &data_laddr);
+
+    if (data_maddr == NULL)
+        handle_error("failed to allocate memory for slab_entry (data page) redo copy\n");
+
+    /* the slab_entry is about to change, so its bucket needs a snapshot */
+    slab_bucket_make_dirty(cid, sb);
+
+    pmemcpy(data_maddr, se->se_data.current.maddr, SLAB_ENTRY_DATASIZE(se));
+
+    STATS_INC_COWDATA();
+
+    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
+    VECTOR_APPEND(&sd->sd_vector, se);
 
     se->se_data.snapshot.maddr = data_maddr;
     atomic_set(&se->se_data.snapshot.laddr, data_laddr);
@@ -70,51 +123,38 @@ void slab_entry_snapshot(unsigned int cid, struct slab_entry *se)
 void slab_entry_copynswap(unsigned int cid, struct slab_entry *se)
 {
     size_t data_laddr;
-    void *data_maddr = page_allocator_getpage(cid, &data_laddr, PA_PROT_WRITE);
+    void *data_maddr = slab_entry_getpages(cid, se, &data_laddr);
 
     if (data_maddr == NULL)
         handle_error("failed to allocate memory for slab_entry (data page) snapshot\n");
 
     // copy the contents of the snapshot page into the new current page (no clflush)
-    memcpy(data_maddr, se->se_data.snapshot.maddr, ROUNDPG(se->se_size));
+    memcpy(data_maddr, se->se_data.snapshot.maddr, SLAB_ENTRY_DATASIZE(se));
 
     se->se_data.snapshot.maddr = data_maddr;
     atomic_set(&se->se_data.current.laddr, data_laddr);
 
-    // now we swap the mappings for current and snapshot pages
-    page_allocator_swap_mappings(cid,
-                                 data_maddr,                    // current address
-                                 se->se_data.snapshot.laddr,    // snapshot offset
-                                 se->se_data.snapshot.maddr,    // snapshot address
-                                 data_laddr);                   // current offset
+    // now we swap the mappings for current and snapshot pages, one page at a time
+    for (size_t off = 0; off < SLAB_ENTRY_DATASIZE(se); off += PAGE_SIZE) {
+        page_allocator_swap_mappings(cid,
+                                     data_maddr + off,                  // current address
+                                     se->se_data.snapshot.laddr + off,  // snapshot offset
+                                     se->se_data.snapshot.maddr + off,  // snapshot address
+                                     data_laddr + off);                 // current offset
+    }
 
     STATS_INC_COWDATA();
 
     // keep track of snapshotted slab_entries. We free this vector on slab_cpoint!
     struct slab_dir *sd = get_container(cid)->current_slab.maddr;
     VECTOR_APPEND(&sd->sd_vector, se);
-
-    // if there are pointers in this page, then we need to snapshot them as well
-    if (se->se_ptr.snapshot.maddr != NULL) {
-        assert(0 && "TODO: implement this later");
-        size_t ptr_laddr;
-        void *ptr_maddr = page_allocator_getpage(cid, &ptr_laddr, PA_PROT_WRITE);
-        if (ptr_maddr == NULL)
-            handle_error("failed to allocate memory for slab_entry (ptr page) snapshot\n");
-        pmemcpy(ptr_maddr, se->se_ptr.snapshot.maddr, ROUNDPG(se->se_size));
-        se->se_ptr.current.idx = se->se_ptr.snapshot.idx;
-        atomic_set(&ptr_laddr, se->se_ptr.current.laddr);
-        se->se_ptr.current.maddr = ptr_maddr;
-
-        STATS_INC_COWMETA();
-    }
-
 }
 
-int slab_bucket_snapshot(unsigned int cid, struct slab_bucket *sb)
+/*
+ * Return the slab_inner that points to sb, and the index of sb in it
+ */
+struct slab_inner *slab_bucket_inner(unsigned int cid, struct slab_bucket *sb, int *si_idx)
 {
-    int bucket_was_snapshoted = 0;
-
     int si_id = sb->sb_id / SLAB_INNER_ENTRIES;
     int so_id = si_id / SLAB_OUTER_ENTRIES;
     int so_idx = si_id % SLAB_OUTER_ENTRIES;
@@ -122,18 +162,27 @@ int slab_bucket_snapshot(unsigned int cid, struct slab_bucket *sb)
 
     struct slab_dir *sd = get_container(cid)->current_slab.maddr;
     struct slab_outer *so = sd->sd_current[sd_idx].maddr;
-    struct slab_inner *si = so->so_current[so_idx].maddr;
 
-    if (si->si_current[si_id].maddr == si->si_snapshot[si_id].maddr) {
+    *si_idx = sb->sb_id % SLAB_INNER_ENTRIES;
+    return so->so_current[so_idx].maddr;
+}
+
+int slab_bucket_snapshot(unsigned int cid, struct slab_bucket *sb)
+{
+    int bucket_was_snapshoted = 0;
+    int si_idx;
+    struct slab_inner *si = slab_bucket_inner(cid, sb, &si_idx);
+
+    if (si->si_current[si_idx].maddr == si->si_snapshot[si_idx].maddr) {
         size_t snapshot_laddr;
         struct slab_bucket * sbs = (struct slab_bucket*) page_allocator_getpage(cid, &snapshot_laddr, PA_PROT_WRITE);
         if (sbs == NULL)
             handle_error("failed to allocate memory for slab_bucket snapshot\n");
         pmemcpy(sbs, sb, ROUNDPG(sizeof(*sb)));
 
-        atomic_set(&si->si_snapshot[si_id].laddr, snapshot_laddr);
+        atomic_set(&si->si_snapshot[si_idx].laddr, snapshot_laddr);
 
-        si->si_snapshot[si_id].maddr = sbs;
+        si->si_snapshot[si_idx].maddr = sbs;
         bucket_was_snapshoted = 1;
 
         STATS_INC_COWMETA();
@@ -145,17 +194,10 @@ int slab_bucket_snapshot(unsigned int cid, struct slab_bucket *sb)
 int slab_bucket_copynswap(unsigned int cid, struct slab_bucket *sb)
 {
     int bucket_was_snapshoted = 0;
+    int si_idx;
+    struct slab_inner *si = slab_bucket_inner(cid, sb, &si_idx);
 
-    int si_id = sb->sb_id / SLAB_INNER_ENTRIES;
-    int so_id = si_id / SLAB_OUTER_ENTRIES;
-    int so_idx = si_id % SLAB_OUTER_ENTRIES;
-    int sd_idx = so_id % SLAB_DIR_ENTRIES;
-
-    struct slab_dir *sd = get_container(cid)->current_slab.maddr;
-    struct slab_outer *so = sd->sd_current[sd_idx].maddr;
-    struct slab_inner *si = so->so_current[so_idx].maddr;
-
-    if (si->si_current[si_id].maddr == si->si_snapshot[si_id].maddr) {
+    if (si->si_current[si_idx].maddr == si->si_snapshot[si_idx].maddr) {
         size_t snapshot_laddr;
         struct slab_bucket *sbs = (struct slab_bucket*) page_allocator_getpage(cid, &snapshot_laddr, PA_PROT_WRITE);
         if (sbs == NULL)
@@ -166,13 +208,13 @@ int slab_bucket_copynswap(unsigned int cid, struct slab_bucket *sb)
 
         // now we swap the mappins for current and snapshot pages
         page_allocator_swap_mappings(cid,
-                                     si->si_current[si_id].maddr,   // current addr
+                                     si->si_current[si_idx].maddr,   // current addr
                                      snapshot_laddr,                // snapshot offset
                                      sbs,                           // snapshot addr
-                                     si->si_current[si_id].laddr);  // current offset
+                                     si->si_current[si_idx].laddr);  // current offset
 
-        atomic_set(&si->si_current[si_id].laddr, snapshot_laddr);
-        si->si_snapshot[si_id].maddr = sbs;
+        atomic_set(&si->si_current[si_idx].laddr, snapshot_laddr);
+        si->si_snapshot[si_idx].maddr = sbs;
         bucket_was_snapshoted = 1;
 
         STATS_INC_COWMETA();
@@ -181,6 +223,39 @@ int slab_bucket_copynswap(unsigned int cid, struct slab_bucket *sb)
     return bucket_was_snapshoted;
 }
 
+/*
+ * The dirty set
+ */
+//TODO: add support for multiple containers
+struct slab_dirty_set SLAB_DIRTY;
+
+void slab_dirty_add_bucket(struct slab_bucket *sb)
+{
+    VECTOR_APPEND(&SLAB_DIRTY.buckets, sb);
+}
+
+void slab_dirty_add_inner(int sd_idx, int so_idx)
+{
+    VECTOR_APPEND(&SLAB_DIRTY.inners, sd_idx * (int) SLAB_OUTER_ENTRIES + so_idx);
+}
+
+void slab_dirty_add_outer(int sd_idx)
+{
+    VECTOR_APPEND(&SLAB_DIRTY.outers, sd_idx);
+}
+
+/*
+ * Take the snapshot of a slab_bucket the first time it changes after a
+ * checkpoint, which adds it to the dirty set
+ */
+void slab_bucket_make_dirty(unsigned int cid, struct slab_bucket *sb)
+{
+    if (!sb->sb_has_snapshot && Func_slab_bucket_snapshot(cid, sb)) {
+        sb->sb_has_snapshot = 1;
+        slab_dirty_add_bucket(sb);
+    }
+}
+
 struct slab_inner* slab_inner_snapshot(unsigned int cid, struct slab_inner *si, size_t *laddr)
 {
     struct slab_inner *sis = NULL;
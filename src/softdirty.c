@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "softdirty.h"
+#include "settings.h"
+#include "macros.h"
+#include "out.h"
+
+#define PM_SOFT_DIRTY   (1ULL << 55)
+#define PM_SWAP         (1ULL << 62)
+#define PM_PRESENT      (1ULL << 63)
+
+static int SOFTDIRTY_SUPPORTED = -1;
+
+static uint64_t pagemap_entry(int fd, void *maddr)
+{
+    uint64_t entry = 0;
+
+    if (pread(fd, &entry, sizeof(entry), ptoi(maddr) / PAGE_SIZE * sizeof(entry)) != sizeof(entry))
+        return 0;
+    return entry;
+}
+
+void softdirty_clear()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+
+    if (fd < 0 || write(fd, "4", 1) != 1)
+        handle_error("failed to clear the soft-dirty bits\n");
+    close(fd);
+}
+
+/*
+ * The kernel may be built without CONFIG_MEM_SOFT_DIRTY, in which case the
+ * bit is never set. We write to a page, clear the bits, and check that only
+ * the second write is reported.
+ */
+static int softdirty_probe()
+{
+    volatile char *page;
+    int fd, ret = -1;
+    uint64_t before, after;
+
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        goto out;
+
+    page[0] = 1;
+    softdirty_clear();
+    before = pagemap_entry(fd, (void*) page);
+    page[0] = 2;
+    after = pagemap_entry(fd, (void*) page);
+
+    if (!(before & PM_SOFT_DIRTY) && (after & PM_SOFT_DIRTY))
+        ret = 0;
+
+    munmap((void*) page, PAGE_SIZE);
+out:
+    close(fd);
+    return ret;
+}
+
+int softdirty_init()
+{
+    if (SOFTDIRTY_SUPPORTED == -1)
+        SOFTDIRTY_SUPPORTED = (softdirty_probe() == 0);
+    return SOFTDIRTY_SUPPORTED ? 0 : -1;
+}
+
+void softdirty_scan_begin(struct softdirty_scan *scan)
+{
+    scan->fd = open("/proc/self/pagemap", O_RDONLY);
+    if (scan->fd < 0)
+        handle_error("failed to open /proc/self/pagemap\n");
+    scan->first = 0;
+    scan->count = 0;
+}
+
+static void softdirty_read_window(struct softdirty_scan *scan, uint64_t pgno)
+{
+    ssize_t n = pread(scan->fd, scan->entries, sizeof(scan->entries),
+                      pgno * sizeof(scan->entries[0]));
+    if (n <= 0)
+        handle_error("failed to read /proc/self/pagemap\n");
+
+    scan->first = pgno;
+    scan->count = n / sizeof(scan->entries[0]);
+}
+
+/*
+ * Pages that are not present are reported as dirty: the kernel drops the
+ * soft-dirty bit of a shared page when the page is reclaimed.
+ */
+int softdirty_test(struct softdirty_scan *scan, void *maddr, size_t size)
+{
+    uint64_t first = ptoi(maddr) / PAGE_SIZE;
+    uint64_t last = (ptoi(maddr) + size - 1) / PAGE_SIZE;
+    uint64_t entry;
+
+    for (uint64_t pgno = first; pgno <= last; pgno++) {
+        if (pgno < scan->first || pgno >= scan->first + scan->count)
+            softdirty_read_window(scan, pgno);
+
+        entry = scan->entries[pgno - scan->first];
+        if (!(entry & (PM_PRESENT | PM_SWAP)) || (entry & PM_SOFT_DIRTY))
+            return 1;
+    }
+
+    return 0;
+}
+
+void softdirty_scan_end(struct softdirty_scan *scan)
+{
+    close(scan->fd);
+    scan->fd = -1;
+}
@@ -0,0 +1,38 @@
+#ifndef SOFTDIRTY_H
+#define SOFTDIRTY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Soft-dirty bits tell which pages have been written since they were last
+ * cleared (see Documentation/admin-guide/mm/soft-dirty.rst). They are read
+ * from /proc/self/pagemap and cleared for the whole process through
+ * /proc/self/clear_refs.
+ */
+
+/* number of pagemap entries read at once */
+#define SOFTDIRTY_WINDOW    512
+
+struct softdirty_scan {
+    int fd;
+    uint64_t first;     ///< page number of the first entry in the window
+    uint64_t count;     ///< number of valid entries in the window
+    uint64_t entries[SOFTDIRTY_WINDOW];
+};
+
+/* return 0 if the kernel keeps track of soft-dirty bits */
+int softdirty_init();
+
+/* clear the soft-dirty bits of every page of the process */
+void softdirty_clear();
+
+/*
+ * Test if any page in a range is dirty. The ranges of a scan should be
+ * tested in increasing order of addresses, so pagemap is read sequentially.
+ */
+void softdirty_scan_begin(struct softdirty_scan *scan);
+int softdirty_test(struct softdirty_scan *scan, void *maddr, size_t size);
+void softdirty_scan_end(struct softdirty_scan *scan);
+
+#endif /* end of include guard: SOFTDIRTY_H */
@@ -11,35 +11,41 @@ struct global_stats GLOBAL_STATS = {0};
     "   alloc_cont_pg: %lu\n" \
     "   free_cont_pg: %lu\n" \
     "   pallocations: %lu\n" \
+    "   pfrees: %lu\n" \
     "   cpu_cache_flushes: %lu\n" \
+    "   cpu_cache_fences: %lu\n" \
     "   memprotects: %lu\n" \
     "   se_init: %lu\n" \
+    "   se_release: %lu\n" \
     "   sb_init: %lu\n" \
     "   so_init: %lu\n" \
     "   si_init: %lu\n" \
     "   sd_init: %lu\n" \
     "}"
 
-char *stats_pt_report()
+char *stats_pt_report_of(const struct global_stats *s)
 {
 #ifdef STATS_ENABLED
-    static char msg[512];
+    static __thread char msg[1024];
     sprintf(msg, PT_TEMPLATE,
-        GLOBAL_STATS.general.transactions,
-        GLOBAL_STATS.per_transaction.cont_grow,
-        GLOBAL_STATS.per_transaction.cow_data_pg,
-        GLOBAL_STATS.per_transaction.cow_meta_pg,
-        GLOBAL_STATS.per_transaction.faults,
-        GLOBAL_STATS.per_transaction.alloc_cont_pg,
-        GLOBAL_STATS.per_transaction.free_cont_pg,
-        GLOBAL_STATS.per_transaction.pallocations,
-        GLOBAL_STATS.per_transaction.cpu_cache_flushes,
-        GLOBAL_STATS.per_transaction.memprotects,
-        GLOBAL_STATS.per_transaction.se_init,
-        GLOBAL_STATS.per_transaction.sb_init,
-        GLOBAL_STATS.per_transaction.so_init,
-        GLOBAL_STATS.per_transaction.si_init,
-        GLOBAL_STATS.per_transaction.sd_init
+        s->general.transactions,
+        s->per_transaction.cont_grow,
+        s->per_transaction.cow_data_pg,
+        s->per_transaction.cow_meta_pg,
+        s->per_transaction.faults,
+        s->per_transaction.alloc_cont_pg,
+        s->per_transaction.free_cont_pg,
+        s->per_transaction.pallocations,
+        s->per_transaction.pfrees,
+        s->per_transaction.cpu_cache_flushes,
+        s->per_transaction.cpu_cache_fences,
+        s->per_transaction.memprotects,
+        s->per_transaction.se_init,
+        s->per_transaction.se_release,
+        s->per_transaction.sb_init,
+        s->per_transaction.so_init,
+        s->per_transaction.si_init,
+        s->per_transaction.sd_init
     );
     return msg;
 #else
@@ -56,38 +62,54 @@ char *stats_pt_report()
     "   alloc_cont_pg: %lu\n" \
     "   free_cont_pg: %lu\n" \
     "   pallocations: %lu\n" \
+    "   pfrees: %lu\n" \
     "   cpu_cache_flushes: %lu\n" \
+    "   cpu_cache_fences: %lu\n" \
     "   memprotects: %lu\n" \
     "   se_init: %lu\n" \
+    "   se_release: %lu\n" \
     "   sb_init: %lu\n" \
     "   so_init: %lu\n" \
     "   si_init: %lu\n" \
     "   sd_init: %lu\n" \
     "}"
 
-char *stats_general_report()
+char *stats_general_report_of(const struct global_stats *s)
 {
 #ifdef STATS_ENABLED
-    static char msg[512];
+    static __thread char msg[1024];
     sprintf(msg, GENERAL_TEMPLATE,
-        GLOBAL_STATS.general.transactions,
-        GLOBAL_STATS.general.cont_grow,
-        GLOBAL_STATS.general.cow_data_pg,
-        GLOBAL_STATS.general.cow_meta_pg,
-        GLOBAL_STATS.general.faults,
-        GLOBAL_STATS.general.alloc_cont_pg,
-        GLOBAL_STATS.general.free_cont_pg,
-        GLOBAL_STATS.general.pallocations,
-        GLOBAL_STATS.general.cpu_cache_flushes,
-        GLOBAL_STATS.general.memprotects,
-        GLOBAL_STATS.general.se_init,
-        GLOBAL_STATS.general.sb_init,
-        GLOBAL_STATS.general.so_init,
-        GLOBAL_STATS.general.si_init,
-        GLOBAL_STATS.general.sd_init
+        s->general.transactions,
+        s->general.cont_grow,
+        s->general.cow_data_pg,
+        s->general.cow_meta_pg,
+        s->general.faults,
+        s->general.alloc_cont_pg,
+        s->general.free_cont_pg,
+        s->general.pallocations,
+        s->general.pfrees,
+        s->general.cpu_cache_flushes,
+        s->general.cpu_cache_fences,
+        s->general.memprotects,
+        s->general.se_init,
+        s->general.se_release,
+        s->general.sb_init,
+        s->general.so_init,
+        s->general.si_init,
+        s->general.sd_init
     );
     return msg;
 #else
     return "Stats are not enabled!";
 #endif
 }
+
+char *stats_pt_report()
+{
+    return stats_pt_report_of(&GLOBAL_STATS);
+}
+
+char *stats_general_report()
+{
+    return stats_general_report_of(&GLOBAL_STATS);
+}
@@ -13,11 +13,14 @@ struct global_stats {
         uint64_t alloc_cont_pg;
         uint64_t free_cont_pg;
         uint64_t pallocations;
+        uint64_t pfrees;
         uint64_t cpu_cache_flushes;
+        uint64_t cpu_cache_fences;
         uint64_t memprotects;
 
         /* keeps track of when a new metadata node of the slab is init */
         uint64_t se_init;
+        uint64_t se_release;
         uint64_t sb_init;
         uint64_t so_init;
         uint64_t si_init;
@@ -34,11 +37,14 @@ struct global_stats {
         uint64_t alloc_cont_pg;
         uint64_t free_cont_pg;
         uint64_t pallocations;
+        uint64_t pfrees;
         uint64_t cpu_cache_flushes;
+        uint64_t cpu_cache_fences;
         uint64_t memprotects;
 
         /* keeps track of when a new metadata node of the slab is init */
         uint64_t se_init;
+        uint64_t se_release;
         uint64_t sb_init;
         uint64_t so_init;
         uint64_t si_init;
@@ -53,6 +59,10 @@ extern struct global_stats GLOBAL_STATS;
 char *stats_pt_report();
 char *stats_general_report();
 
+/* report a copy of the stats, taken at the end of a transaction */
+char *stats_pt_report_of(const struct global_stats *s);
+char *stats_general_report_of(const struct global_stats *s);
+
 #define STATS_IS_INIT() GLOBAL_STATS.init
 
 #ifdef STATS_ENABLED
@@ -81,24 +91,30 @@ char *stats_general_report();
     GLOBAL_STATS.per_transaction.alloc_cont_pg = 0; \
     GLOBAL_STATS.per_transaction.free_cont_pg = 0; \
     GLOBAL_STATS.per_transaction.pallocations = 0; \
+    GLOBAL_STATS.per_transaction.pfrees = 0; \
     GLOBAL_STATS.per_transaction.cpu_cache_flushes = 0; \
+    GLOBAL_STATS.per_transaction.cpu_cache_fences = 0; \
     GLOBAL_STATS.per_transaction.memprotects = 0; \
 } while (0)
 
 #define STATS_INC_CONTGROW()        __INC_BOTH(cont_grow)
 #define STATS_INC_PALLOCATIONS()    __INC_BOTH(pallocations)
+#define STATS_INC_PFREES()          __INC_BOTH(pfrees)
 #define STATS_INC_COWDATA()         __INC_BOTH(cow_data_pg)
 #define STATS_INC_COWMETA()         __INC_BOTH(cow_meta_pg)
 #define STATS_INC_FLUSH()           __INC_BOTH(cpu_cache_flushes)
+#define STATS_INC_FENCE()           __INC_BOTH(cpu_cache_fences)
 #define STATS_INC_ALLOCPG()         __INC_BOTH(alloc_cont_pg)
 #define STATS_INC_FREEPG()          __INC_BOTH(free_cont_pg)
 #define STATS_INC_MPROTECT()        __INC_BOTH(memprotects)
 
 /*
  * se_init gives us the number of data pages, while the sum of s[boid]_init
- * gives of the number of metadata pages
+ * gives of the number of metadata pages. se_release counts the slab_entry(s)
+ * that became empty and returned their data pages to the page allocator.
  */
 #define STATS_INC_SEINIT()          __INC_BOTH(se_init)
+#define STATS_INC_SERELEASE()       __INC_BOTH(se_release)
 #define STATS_INC_SBINIT()          __INC_BOTH(sb_init)
 #define STATS_INC_SOINIT()          __INC_BOTH(so_init)
 #define STATS_INC_SIINIT()          __INC_BOTH(si_init)
@@ -114,14 +130,17 @@ char *stats_general_report();
 
 #define STATS_INC_CONTGROW()
 #define STATS_INC_PALLOCATIONS()
+#define STATS_INC_PFREES()
 #define STATS_INC_COWDATA()
 #define STATS_INC_COWMETA()
 #define STATS_INC_FLUSH()
+#define STATS_INC_FENCE()
 #define STATS_INC_ALLOCPG()
 #define STATS_INC_FREEPG()
 #define STATS_INC_MPROTECT()
 
 #define STATS_INC_SEINIT()
+#define STATS_INC_SERELEASE()
 #define STATS_INC_SBINIT()
 #define STATS_INC_SOINIT()
 #define STATS_INC_SIINIT()
@@ -67,8 +67,7 @@ struct entry * entry_alloc(uint64_t data)
 void entry_free(struct entry * pe) 
 {
     if (SETTINGS.method == METHOD_SOFTPM) {
-        //freeat(pe); TODO
-        free(pe);
+        freeat(pe);
     } else {
         free(pe);
     }
@@ -37,7 +37,7 @@ void test_pointerat_mallocat()
         pointerat(cid, &array[i].f3);
     }
 
-    build_mallocat_tree();
+    build_mallocat_index();
     classify_pointers(cid);
     mallocat_pprint();
     htable_print(ht_pointerat);
@@ -53,7 +53,7 @@ void test_persistent_pointers()
         pointerat(cont->id, &s[i].f3);
     }
 
-    build_mallocat_tree();
+    build_mallocat_index();
     classify_pointers(cont->id);
     mallocat_pprint();
     htable_print(ht_pointerat);
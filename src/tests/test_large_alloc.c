@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cont.h>
+
+/*
+ * In this test, we create a list of objects bigger than a page. Each object
+ * keeps its pointer to the next object at the end of the object, so that the
+ * pointer lives on the last page of the run of pages that holds the object.
+ */
+
+#define PAGE_SIZE   4096
+#define NODES_COUNT 8
+
+const char * program_name;
+
+struct tail {
+    struct node *next;
+    int id;
+};
+
+struct node {
+    size_t size;
+    char data[1];
+};
+
+#define NODE_SIZE(i)        (2 * PAGE_SIZE + (i) * (PAGE_SIZE + 100))
+#define NODE_TAIL(n)        ((struct tail*) ((char*)(n) + (n)->size - sizeof(struct tail)))
+#define NODE_DATA_LEN(n)    ((n)->size - sizeof(struct node) - sizeof(struct tail))
+
+struct node *node_alloc(unsigned int cid, int i)
+{
+    struct node *n = container_palloc(cid, NODE_SIZE(i));
+    n->size = NODE_SIZE(i);
+    memset(n->data, 'a' + (i % 26), NODE_DATA_LEN(n));
+    NODE_TAIL(n)->id = i;
+    NODE_TAIL(n)->next = NULL;
+    pointerat(cid, &NODE_TAIL(n)->next);
+    return n;
+}
+
+int check_list(struct node *h)
+{
+    int i = 0;
+    struct node *n;
+
+    for (n = h; n; n = NODE_TAIL(n)->next, i++) {
+        if (n->size != NODE_SIZE(i) || NODE_TAIL(n)->id != i) {
+            printf("node %d has an invalid size or id\n", i);
+            return 1;
+        }
+
+        /* the first node was modified after the first cpoint */
+        char c = (i == 0) ? 'Z' : 'a' + (i % 26);
+        for (size_t j = 0; j < NODE_DATA_LEN(n); j++) {
+            if (n->data[j] != c) {
+                printf("node %d has invalid data at byte %zu\n", i, j);
+                return 1;
+            }
+        }
+    }
+
+    if (i != NODES_COUNT) {
+        printf("found %d nodes out of %d\n", i, NODES_COUNT);
+        return 1;
+    }
+
+    printf("list of %d nodes is correct\n", i);
+    return 0;
+}
+
+int create_list()
+{
+    struct container *cont;
+    struct node *h, *n, *prev;
+    char fname[128];
+
+    /* always start from an empty container */
+    sprintf(fname, "%s%d", FM_FILE_NAME_PREFIX, 0);
+    unlink(fname);
+
+    cont = container_init();
+
+    h = prev = node_alloc(cont->id, 0);
+    container_setroot(cont->id, h);
+
+    for (int i = 1; i < NODES_COUNT; i++) {
+        n = node_alloc(cont->id, i);
+        NODE_TAIL(prev)->next = n;
+        prev = n;
+    }
+    container_cpoint(cont->id);
+
+    /* this update faults on the last pages of the run */
+    memset(h->data + PAGE_SIZE, 'Z', NODE_DATA_LEN(h) - PAGE_SIZE);
+    memset(h->data, 'Z', PAGE_SIZE);
+    container_cpoint(cont->id);
+
+    return check_list(h);
+}
+
+int restore_list()
+{
+    int cid = 0;
+    struct container *cont;
+
+    cont = container_restore(cid);
+    return check_list(container_getroot(cont->id));
+}
+
+void print_usage(FILE* stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "   -h    --help        Display this usage information.\n"
+            "   -c    --create      Create new list (default).\n"
+            "   -r    --restore     Restore list.\n");
+    exit(exit_code);
+}
+
+int main(int argc,  char *const * argv)
+{
+    int next_option;
+    int ret = 0;
+    static struct option long_options[] = {
+        { "help",       no_argument, 0, 'h' },
+        { "create",     no_argument, 0, 'c' },
+        { "restore",    no_argument, 0, 'r' },
+        { 0,            0,           0,  0 }
+    };
+
+    program_name = argv[0];
+
+    if (argc == 1)
+        return create_list();
+
+    do {
+        next_option = getopt_long(argc, argv, "hcr", long_options, NULL);
+        switch(next_option) {
+            case 'h':
+                print_usage(stdout, 0);
+
+            case 'c': /* --create */
+                ret |= create_list();
+                break;
+
+            case 'r': /* --restore */
+                ret |= restore_list();
+                break;
+
+            case '?': /* user provided invalid option */
+                print_usage(stderr, 1);
+
+            case -1: /* done with options */
+                break;
+
+            default:
+                abort();
+        }
+    } while (next_option != -1);
+
+    return ret;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cont.h>
+
+/*
+ * In this test, we create a list of nodes, free every other node, and then
+ * allocate new nodes. The new nodes must reuse the memory of the freed ones
+ * and the list must survive a restore.
+ */
+
+#define NODES_COUNT 2000
+
+const char * program_name;
+
+struct node {
+    struct node *next;
+    int id;
+    char data[100];
+};
+
+struct node *node_alloc(unsigned int cid, int id)
+{
+    struct node *n = container_palloc(cid, sizeof(*n));
+    n->id = id;
+    n->next = NULL;
+    memset(n->data, 'a' + (id % 26), sizeof(n->data));
+    pointerat(cid, &n->next);
+    return n;
+}
+
+int check_list(struct node *h)
+{
+    int i = 0;
+    struct node *n;
+
+    for (n = h; n; n = n->next, i++) {
+        if (n->id != i || n->data[0] != 'a' + (i % 26) ||
+                n->data[sizeof(n->data) - 1] != 'a' + (i % 26)) {
+            printf("node %d is invalid\n", i);
+            return 1;
+        }
+    }
+
+    if (i != NODES_COUNT) {
+        printf("found %d nodes out of %d\n", i, NODES_COUNT);
+        return 1;
+    }
+
+    printf("list of %d nodes is correct\n", i);
+    return 0;
+}
+
+int create_list()
+{
+    struct container *cont;
+    struct node *h, *n, *prev;
+    struct node **freed;
+    char fname[128];
+    int reused = 0;
+
+    /* always start from an empty container */
+    sprintf(fname, "%s%d", FM_FILE_NAME_PREFIX, 0);
+    unlink(fname);
+
+    cont = container_init();
+
+    h = prev = node_alloc(cont->id, 0);
+    container_setroot(cont->id, h);
+    for (int i = 1; i < NODES_COUNT; i++) {
+        n = node_alloc(cont->id, i);
+        prev->next = n;
+        prev = n;
+    }
+    container_cpoint(cont->id);
+
+    /* free every odd node */
+    freed = calloc(NODES_COUNT / 2, sizeof(*freed));
+    for (n = h; n && n->next; n = n->next) {
+        freed[n->id / 2] = n->next;
+        n->next = n->next->next;
+        container_pfree(cont->id, freed[n->id / 2]);
+    }
+    container_cpoint(cont->id);
+
+    /* put back the odd nodes */
+    for (n = h; n; n = n->next->next) {
+        struct node *odd = node_alloc(cont->id, n->id + 1);
+        for (int i = 0; i < NODES_COUNT / 2; i++)
+            reused += (freed[i] == odd);
+        odd->next = n->next;
+        n->next = odd;
+    }
+    container_cpoint(cont->id);
+    free(freed);
+
+    if (reused != NODES_COUNT / 2) {
+        printf("only %d out of %d freed nodes were reused\n", reused, NODES_COUNT / 2);
+        return 1;
+    }
+
+    return check_list(h);
+}
+
+int restore_list()
+{
+    int cid = 0;
+    struct container *cont;
+
+    cont = container_restore(cid);
+    return check_list(container_getroot(cont->id));
+}
+
+void print_usage(FILE* stream, int exit_code)
+{
+    fprintf(stream, "Usage: %s options\n", program_name);
+    fprintf(stream,
+            "   -h    --help        Display this usage information.\n"
+            "   -c    --create      Create new list (default).\n"
+            "   -r    --restore     Restore list.\n");
+    exit(exit_code);
+}
+
+int main(int argc,  char *const * argv)
+{
+    int next_option;
+    int ret = 0;
+    static struct option long_options[] = {
+        { "help",       no_argument, 0, 'h' },
+        { "create",     no_argument, 0, 'c' },
+        { "restore",    no_argument, 0, 'r' },
+        { 0,            0,           0,  0 }
+    };
+
+    program_name = argv[0];
+
+    if (argc == 1)
+        return create_list();
+
+    do {
+        next_option = getopt_long(argc, argv, "hcr", long_options, NULL);
+        switch(next_option) {
+            case 'h':
+                print_usage(stdout, 0);
+
+            case 'c': /* --create */
+                ret |= create_list();
+                break;
+
+            case 'r': /* --restore */
+                ret |= restore_list();
+                break;
+
+            case '?': /* user provided invalid option */
+                print_usage(stderr, 1);
+
+            case -1: /* done with options */
+                break;
+
+            default:
+                abort();
+        }
+    } while (next_option != -1);
+
+    return ret;
+}
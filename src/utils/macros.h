@@ -70,6 +70,7 @@ static int bitmap_count_sets(bitstr_t *bm, int bm_size)
 #define CPOINT_INCOMPLETE   1
 #define CPOINT_RESTORE      2   ///< copint as part of the restore
 #define CPOINT_REGULAR      3   ///< regular cpoint
+#define CPOINT_ASYNC        4   ///< regular cpoint, the pages are freed in the background
 
 #define NOT_CS_CONSISTENT(c,s) (MIN(c, 1) ^ MIN(s, 1))   ///< (c=0 and s=1) is not allowed
 
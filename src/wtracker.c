@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "wtracker.h"
+#include "page_alloc.h"
+#include "settings.h"
+#include "macros.h"
+#include "stats.h"
+#include "out.h"
+
+/* number of userfaultfd events read at once by the tracker thread */
+#define UFFD_EVENTS_BATCH   64
+
+extern void slab_handle_write(unsigned int cid, void *addr);
+
+static struct write_tracker_ops *WRITE_TRACKER = NULL;
+
+/*
+ * signal write tracker
+ *
+ * Data pages are mapped read-only, so the first write to a page raises
+ * SIGSEGV. The handler (handle_memory_update) is registered by the container
+ * constructor.
+ */
+static int signal_init()
+{
+    return 0;
+}
+
+static void *signal_alloc_pages(unsigned int cid, int npages, size_t *laddr)
+{
+    if (npages > 1)
+        return page_allocator_getpages(cid, npages, laddr, PA_PROT_READ | PA_DATA);
+    return page_allocator_getpage(cid, laddr, PA_PROT_READ | PA_DATA);
+}
+
+static void signal_protect(unsigned int cid, void *maddr, size_t size)
+{
+    page_allocator_mprotect(cid, maddr, size, PA_PROT_READ);
+}
+
+static void signal_unprotect(unsigned int cid, void *maddr, size_t size)
+{
+    page_allocator_mprotect(cid, maddr, size, PA_PROT_RNW);
+}
+
+static struct write_tracker_ops signal_ops = {
+    .name = "signal write tracker",
+    .prot = PA_PROT_READ,
+    .init = signal_init,
+    .alloc_pages = signal_alloc_pages,
+    .protect = signal_protect,
+    .unprotect = signal_unprotect,
+};
+
+/*
+ * no write tracker
+ *
+ * Data pages are always writable. This is used by the soft-dirty checkpoint
+ * mode, which finds the modified pages when the checkpoint is taken.
+ */
+static int none_init()
+{
+    return 0;
+}
+
+static void *none_alloc_pages(unsigned int cid, int npages, size_t *laddr)
+{
+    if (npages > 1)
+        return page_allocator_getpages(cid, npages, laddr, PA_PROT_RNW | PA_DATA);
+    return page_allocator_getpage(cid, laddr, PA_PROT_RNW | PA_DATA);
+}
+
+static void none_protect(unsigned int cid, void *maddr, size_t size) {}
+
+static struct write_tracker_ops none_ops = {
+    .name = "no write tracker",
+    .prot = PA_PROT_RNW,
+    .init = none_init,
+    .alloc_pages = none_alloc_pages,
+    .protect = none_protect,
+    .unprotect = none_protect,
+};
+
+/*
+ * userfaultfd write tracker
+ *
+ * Data pages are mapped read-write and write-protected with userfaultfd. A
+ * write to a protected page blocks the writer and queues an event, which the
+ * tracker thread handles by taking the snapshot and removing the protection
+ * (which also wakes the writer up). The tracker thread reads the events in
+ * batches, and changing the protection of a range does not split the mapping.
+ *
+ * Ranges are registered with userfaultfd the first time they are protected.
+ * userfaultfd can write-protect anonymous and shmem mappings only, so if the
+ * first registration fails we fall back to the signal tracker.
+ */
+static int UFFD = -1;
+static int UFFD_REGISTERED = 0;
+
+static void *uffd_tracker(void *arg)
+{
+    struct uffd_msg msgs[UFFD_EVENTS_BATCH];
+    ssize_t n;
+
+    for (;;) {
+        n = read(UFFD, msgs, sizeof(msgs));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            handle_error("failed to read userfaultfd events\n");
+        }
+
+        for (int i = 0; i < n / sizeof(msgs[0]); i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT)
+                continue;
+            //TODO: add support for multiple containers
+            slab_handle_write(0, (void*) msgs[i].arg.pagefault.address);
+        }
+    }
+
+    return NULL;
+}
+
+static int uffd_init()
+{
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP,
+    };
+    pthread_t tid;
+
+    UFFD = syscall(SYS_userfaultfd, O_CLOEXEC);
+    if (UFFD < 0)
+        return -1;
+
+    if (ioctl(UFFD, UFFDIO_API, &api) || !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP))
+        goto err;
+
+    if (pthread_create(&tid, NULL, uffd_tracker, NULL))
+        goto err;
+    pthread_detach(tid);
+
+    return 0;
+
+err:
+    close(UFFD);
+    UFFD = -1;
+    return -1;
+}
+
+static int uffd_register(void *maddr, size_t size)
+{
+    struct uffdio_register reg = {
+        .range = { .start = ptoi(maddr), .len = size },
+        .mode = UFFDIO_REGISTER_MODE_WP,
+    };
+
+    return ioctl(UFFD, UFFDIO_REGISTER, &reg);
+}
+
+static int uffd_writeprotect(void *maddr, size_t size, int wp)
+{
+    struct uffdio_writeprotect uwp = {
+        .range = { .start = ptoi(maddr), .len = size },
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    STATS_INC_MPROTECT();
+
+    return ioctl(UFFD, UFFDIO_WRITEPROTECT, &uwp);
+}
+
+static void *uffd_alloc_pages(unsigned int cid, int npages, size_t *laddr)
+{
+    void *maddr;
+
+    if (npages > 1)
+        maddr = page_allocator_getpages(cid, npages, laddr, PA_PROT_RNW | PA_DATA);
+    else
+        maddr = page_allocator_getpage(cid, laddr, PA_PROT_RNW | PA_DATA);
+
+    if (maddr)
+        write_tracker_protect(cid, maddr, npages * PAGE_SIZE);
+
+    return maddr;
+}
+
+static void uffd_protect(unsigned int cid, void *maddr, size_t size)
+{
+    if (uffd_writeprotect(maddr, size, 1) == 0)
+        return;
+
+    if (errno != ENOENT)
+        handle_error("failed to write-protect %p\n", maddr);
+
+    if (uffd_register(maddr, size) == 0) {
+        UFFD_REGISTERED = 1;
+        if (uffd_writeprotect(maddr, size, 1))
+            handle_error("failed to write-protect %p\n", maddr);
+        return;
+    }
+
+    if (UFFD_REGISTERED)
+        handle_error("failed to register %p with userfaultfd\n", maddr);
+
+    LOG(3, "userfaultfd cannot track the container, using the %s", signal_ops.name);
+    WRITE_TRACKER = &signal_ops;
+    signal_protect(cid, maddr, size);
+}
+
+static void uffd_unprotect(unsigned int cid, void *maddr, size_t size)
+{
+    if (uffd_writeprotect(maddr, size, 0))
+        handle_error("failed to remove the write protection of %p\n", maddr);
+}
+
+static struct write_tracker_ops uffd_ops = {
+    .name = "userfaultfd write tracker",
+    .prot = PA_PROT_RNW,
+    .init = uffd_init,
+    .alloc_pages = uffd_alloc_pages,
+    .protect = uffd_protect,
+    .unprotect = uffd_unprotect,
+};
+
+void write_tracker_init()
+{
+    char *ptr;
+
+    // this is the default write tracker
+    WRITE_TRACKER = &signal_ops;
+
+    ptr = getenv("PMLIB_WRITE_TRACKER");
+    if (ptr && strcmp(ptr, "uffd") == 0) {
+        // the nonlinear mapper replaces mappings, which drops the registration
+        ptr = getenv("PMLIB_USE_NLMAPPER");
+        if (ptr && atoi(ptr) == 1)
+            LOG(3, "the %s does not support the nonlinear mapper", uffd_ops.name);
+        else
+            WRITE_TRACKER = &uffd_ops;
+    }
+
+    if (WRITE_TRACKER->init()) {
+        LOG(3, "failed to init the %s", WRITE_TRACKER->name);
+        WRITE_TRACKER = &signal_ops;
+    }
+    LOG(5, "%s has been set", WRITE_TRACKER->name);
+}
+
+void write_tracker_disable()
+{
+    WRITE_TRACKER = &none_ops;
+    LOG(5, "%s has been set", WRITE_TRACKER->name);
+}
+
+const char *write_tracker_name()
+{
+    return WRITE_TRACKER->name;
+}
+
+int write_tracker_prot()
+{
+    return WRITE_TRACKER->prot;
+}
+
+void *write_tracker_alloc_pages(unsigned int cid, int npages, size_t *laddr)
+{
+    return WRITE_TRACKER->alloc_pages(cid, npages, laddr);
+}
+
+void write_tracker_protect(unsigned int cid, void *maddr, size_t size)
+{
+    WRITE_TRACKER->protect(cid, maddr, size);
+}
+
+void write_tracker_unprotect(unsigned int cid, void *maddr, size_t size)
+{
+    WRITE_TRACKER->unprotect(cid, maddr, size);
+}
+
+void write_tracker_batch_init(struct write_tracker_batch *batch, unsigned int cid)
+{
+    batch->cid = cid;
+    batch->start = batch->end = NULL;
+}
+
+void write_tracker_batch_protect(struct write_tracker_batch *batch, void *maddr, size_t size)
+{
+    assert(maddr >= batch->start && "Ranges must be added in increasing order");
+
+    if (batch->end && maddr <= batch->end) {
+        batch->end = MAX(batch->end, maddr + size);
+        return;
+    }
+
+    write_tracker_batch_flush(batch);
+    batch->start = maddr;
+    batch->end = maddr + size;
+}
+
+void write_tracker_batch_flush(struct write_tracker_batch *batch)
+{
+    if (batch->end)
+        write_tracker_protect(batch->cid, batch->start, batch->end - batch->start);
+    batch->start = batch->end = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef WTRACKER_H
+#define WTRACKER_H
+
+#include <stdlib.h>
+
+/*
+ * Write trackers detect the first write to a data page after a checkpoint,
+ * which is when the page needs a copy-on-write snapshot.
+ *
+ *  - signal: data pages are read-only and writes raise SIGSEGV (default)
+ *  - uffd:   data pages are write-protected with userfaultfd, and faults are
+ *            handled by a tracker thread (PMLIB_WRITE_TRACKER=uffd)
+ *
+ * Writes are not tracked at all in the soft-dirty checkpoint mode
+ * (PMLIB_USE_SOFTDIRTY=1), see write_tracker_disable.
+ *
+ * The uffd tracker falls back to the signal tracker when userfaultfd is not
+ * available or the container is not mapped from shmem.
+ */
+struct write_tracker_ops {
+    const char *name;
+    int prot;   ///< protection of the data pages whose writes are tracked
+    int (*init)();
+    void* (*alloc_pages)(unsigned int, int, size_t*);
+    void (*protect)(unsigned int, void*, size_t);
+    void (*unprotect)(unsigned int, void*, size_t);
+};
+
+void write_tracker_init();
+void write_tracker_disable();
+const char *write_tracker_name();
+int write_tracker_prot();
+
+/* allocate npages of data pages; writes to them are tracked */
+void *write_tracker_alloc_pages(unsigned int cid, int npages, size_t *laddr);
+
+/* start/stop tracking the writes to a range of data pages */
+void write_tracker_protect(unsigned int cid, void *maddr, size_t size);
+void write_tracker_unprotect(unsigned int cid, void *maddr, size_t size);
+
+/*
+ * Protect many ranges with as few calls as possible. Ranges must be added in
+ * increasing order of address; contiguous (or overlapping) ranges are merged
+ * and protected with a single call.
+ */
+struct write_tracker_batch {
+    unsigned int cid;
+    void *start;
+    void *end;
+};
+
+void write_tracker_batch_init(struct write_tracker_batch *batch, unsigned int cid);
+void write_tracker_batch_protect(struct write_tracker_batch *batch, void *maddr, size_t size);
+void write_tracker_batch_flush(struct write_tracker_batch *batch);
+
+#endif /* end of include guard: WTRACKER_H */